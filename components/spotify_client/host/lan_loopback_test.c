@@ -0,0 +1,241 @@
+/*
+ * Host-side test of the LAN election. Forks one process per node; each runs the protocol of
+ * spotify_lan_proto.c over real multicast sockets on loopback, the way _lan_task in
+ * spotify_lan.c does on the device. The lowest id is started last and must take over, then it
+ * is killed and the others must fail over to the next lowest id.
+ *
+ *   cmake -S components/spotify_client/host -B build_host
+ *   cmake --build build_host && ctest --test-dir build_host --output-on-failure
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "spotify_lan_proto.h"
+
+#define LAN_GROUP           "239.255.42.99"
+#define LAN_GROUP_ID        (0x5EEDU)
+#define LAN_HEARTBEAT_MS    (100U)
+#define LAN_TIMEOUT_MS      (LAN_HEARTBEAT_MS * 3)
+#define LAN_SETTLE_MS       (LAN_TIMEOUT_MS * 3)
+
+/* sent to the parent every time the view of a node changes */
+typedef struct node_report_t
+{
+	uint32_t leader;
+	uint32_t snapshots;     /* snapshots received from that leader */
+} node_report_t;
+
+
+static uint32_t _now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static int _open_socket(int port)
+{
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0)
+		return -1;
+	int reuse = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#ifdef SO_REUSEPORT
+	setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+#endif
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	struct ip_mreq mreq = { 0 };
+	mreq.imr_multiaddr.s_addr = inet_addr(LAN_GROUP);
+	mreq.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+	struct in_addr iface = { .s_addr = htonl(INADDR_LOOPBACK) };
+	unsigned char ttl = 1;
+	unsigned char loop = 1;
+	struct timeval timeout = { .tv_sec = 0, .tv_usec = 20 * 1000 };
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0
+			|| setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0
+			|| setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) < 0
+			|| setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0
+			|| setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0
+			|| setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+		perror("lan socket");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static void _node_snapshot(uint32_t node_id, spotify_lan_snapshot_t *snapshot)
+{
+	memset(snapshot, 0, sizeof(spotify_lan_snapshot_t));
+	snprintf(snapshot->track_id, sizeof(snapshot->track_id), "%08x", node_id);
+	snprintf(snapshot->track_name, sizeof(snapshot->track_name), "Played by node %08x", node_id);
+	snapshot->is_playing = true;
+	snapshot->duration_ms = 200000;
+}
+
+/* the loop of _lan_task without FreeRTOS and the Spotify side */
+static void _run_node(uint32_t node_id, int port, int report_fd)
+{
+	int sock = _open_socket(port);
+	if (sock < 0)
+		_exit(2);
+	struct sockaddr_in group = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = inet_addr(LAN_GROUP),
+	};
+	spotify_lan_election_t election;
+	spotify_lan_election_init(&election, node_id, LAN_TIMEOUT_MS);
+	spotify_lan_snapshot_t own;
+	_node_snapshot(node_id, &own);
+	node_report_t report = { 0 };
+	uint32_t seq = 0;
+	uint32_t settled_at = _now_ms() + LAN_HEARTBEAT_MS + LAN_HEARTBEAT_MS / 2;
+	uint32_t last_heartbeat = 0;
+
+	for (;;) {
+		uint8_t buf[SPOTIFY_LAN_MAX_PACKET];
+		spotify_lan_header_t header;
+		spotify_lan_snapshot_t snapshot;
+		ssize_t len = recv(sock, buf, sizeof(buf), 0);
+		uint32_t now = _now_ms();
+		bool from_peer = len > 0 && spotify_lan_decode(buf, len, &header, &snapshot)
+				&& header.group_id == LAN_GROUP_ID && header.node_id != node_id;
+		if (from_peer)
+			spotify_lan_election_seen(&election, header.node_id, now);
+		uint32_t leader = spotify_lan_election_leader(&election, now);
+		bool leading = leader == node_id && (int32_t)(now - settled_at) >= 0;
+
+		node_report_t current = report;
+		if (leader != report.leader) {
+			current.leader = leader;
+			current.snapshots = 0;
+		}
+		spotify_lan_snapshot_t expected;
+		_node_snapshot(leader, &expected);
+		if (from_peer && header.type == SPOTIFY_LAN_SNAPSHOT && header.node_id == leader
+				&& strcmp(snapshot.track_name, expected.track_name) == 0)
+			current.snapshots++;
+		if (memcmp(&current, &report, sizeof(report)) != 0) {
+			report = current;
+			if (write(report_fd, &report, sizeof(report)) != sizeof(report))
+				_exit(3);
+		}
+
+		if (now - last_heartbeat >= LAN_HEARTBEAT_MS) {
+			spotify_lan_header_t out = {
+				.type = leading ? SPOTIFY_LAN_SNAPSHOT : SPOTIFY_LAN_HEARTBEAT,
+				.node_id = node_id,
+				.group_id = LAN_GROUP_ID,
+				.seq = seq++,
+			};
+			size_t out_len = spotify_lan_encode(buf, sizeof(buf), &out, leading ? &own : NULL);
+			if (out_len > 0)
+				sendto(sock, buf, out_len, 0, (struct sockaddr*)&group, sizeof(group));
+			last_heartbeat = now;
+		}
+	}
+}
+
+/* keeps the last report of every node */
+static void _drain(int count, const int *fds, node_report_t *reports)
+{
+	for (int i = 0; i < count; i++) {
+		node_report_t report;
+		while (fds[i] >= 0 && read(fds[i], &report, sizeof(report)) == sizeof(report))
+			reports[i] = report;
+	}
+}
+
+static int _check(const char *phase, int count, const uint32_t *ids, const pid_t *pids,
+		const node_report_t *reports, uint32_t expected)
+{
+	int failures = 0;
+	for (int i = 0; i < count; i++) {
+		if (pids[i] <= 0)
+			continue;
+		bool ok = reports[i].leader == expected && (ids[i] == expected || reports[i].snapshots > 0);
+		printf("%s: node %08x follows %08x, %u snapshots%s\n", phase, ids[i], reports[i].leader,
+				reports[i].snapshots, ok ? "" : "  <-- FAIL");
+		if (!ok)
+			failures++;
+	}
+	return failures;
+}
+
+int main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 3;
+	if (count < 2 || count > (int)SPOTIFY_LAN_MAX_PEERS)
+		count = 3;
+	// a port of its own, so concurrent runs do not hear each other
+	int port = argc > 2 ? atoi(argv[2]) : 40000 + getpid() % 20000;
+
+	uint32_t ids[SPOTIFY_LAN_MAX_PEERS];
+	pid_t pids[SPOTIFY_LAN_MAX_PEERS];
+	int fds[SPOTIFY_LAN_MAX_PEERS];
+	node_report_t reports[SPOTIFY_LAN_MAX_PEERS];
+	memset(reports, 0, sizeof(reports));
+
+	for (int i = 0; i < count; i++) {
+		// the lowest id joins last and has to take over from an established leader
+		ids[i] = 0x1000 + (count - i) * 0x10;
+		int pipe_fds[2];
+		if (pipe(pipe_fds) < 0) {
+			perror("pipe");
+			return 1;
+		}
+		pids[i] = fork();
+		if (pids[i] == 0) {
+#ifdef __linux__
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+			close(pipe_fds[0]);
+			_run_node(ids[i], port, pipe_fds[1]);
+		}
+		close(pipe_fds[1]);
+		fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+		fds[i] = pipe_fds[0];
+		usleep(LAN_SETTLE_MS * 1000 / count);
+	}
+
+	usleep(LAN_SETTLE_MS * 1000);
+	_drain(count, fds, reports);
+	int failures = _check("elected", count, ids, pids, reports, ids[count - 1]);
+
+	// kill the leader: the next lowest id must take over once it times out
+	kill(pids[count - 1], SIGKILL);
+	waitpid(pids[count - 1], NULL, 0);
+	pids[count - 1] = 0;
+	close(fds[count - 1]);
+	fds[count - 1] = -1;
+	usleep((LAN_TIMEOUT_MS + LAN_SETTLE_MS) * 1000);
+	_drain(count, fds, reports);
+	failures += _check("failover", count, ids, pids, reports, ids[count - 2]);
+
+	for (int i = 0; i < count; i++) {
+		if (pids[i] > 0) {
+			kill(pids[i], SIGKILL);
+			waitpid(pids[i], NULL, 0);
+		}
+	}
+	printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+	return failures == 0 ? 0 : 1;
+}
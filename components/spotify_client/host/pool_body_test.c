@@ -0,0 +1,264 @@
+/*
+ * Host test of the body handling of spotify_pool_request: spotify_pool.c is built against a fake
+ * esp_http_client that serves scripted responses, including bodies that stop before the length
+ * announced in their headers, the way a read timeout or an early close of the peer ends them.
+ *
+ *   cmake -S components/spotify_client/host -B build_host
+ *   cmake --build build_host && ctest --test-dir build_host --output-on-failure
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "spotify_pool.h"
+#include "spotify_breaker.h"
+#include "spotify_dns.h"
+#include "time_manager.h"
+
+/* what the fake server sends for the next request */
+typedef struct fake_response_t
+{
+	int status_code;
+	const char *body;
+	int content_length;     /* announced in the headers */
+	int sent;               /* bytes actually sent before the stream stops */
+	int read_size;          /* at most this many bytes per read */
+	bool read_error;        /* the stream stops with an error rather than with a 0 read */
+} fake_response_t;
+
+struct esp_http_client
+{
+	fake_response_t response;
+	int offset;
+};
+
+static fake_response_t next_response;
+
+
+const char *esp_err_to_name(esp_err_t code)
+{
+	static char name[16];
+	snprintf(name, sizeof(name), "0x%x", code);
+	return name;
+}
+
+uint32_t time_millis()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+uint32_t time_micros()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+bool spotify_breaker_allow(const char *host)
+{
+	(void)host;
+	return true;
+}
+
+void spotify_breaker_report(const char *host, spotify_breaker_outcome_t outcome)
+{
+	(void)host; (void)outcome;
+}
+
+esp_err_t spotify_dns_resolve(const char *host, char *ip, size_t size)
+{
+	(void)host; (void)ip; (void)size;
+	return ESP_FAIL;
+}
+
+void spotify_dns_invalidate(const char *host)
+{
+	(void)host;
+}
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config)
+{
+	(void)config;
+	return (esp_http_client_handle_t)calloc(1, sizeof(struct esp_http_client));
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client)
+{
+	free(client);
+	return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_url(esp_http_client_handle_t client, const char *url)
+{
+	(void)client; (void)url;
+	return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_method(esp_http_client_handle_t client, esp_http_client_method_t method)
+{
+	(void)client; (void)method;
+	return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value)
+{
+	(void)client; (void)key; (void)value;
+	return ESP_OK;
+}
+
+esp_err_t esp_http_client_delete_header(esp_http_client_handle_t client, const char *key)
+{
+	(void)client; (void)key;
+	return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_timeout_ms(esp_http_client_handle_t client, int timeout_ms)
+{
+	(void)client; (void)timeout_ms;
+	return ESP_OK;
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len)
+{
+	(void)write_len;
+	client->response = next_response;
+	client->offset = 0;
+	return ESP_OK;
+}
+
+int esp_http_client_write(esp_http_client_handle_t client, const char *buffer, int len)
+{
+	(void)client; (void)buffer;
+	return len;
+}
+
+int esp_http_client_fetch_headers(esp_http_client_handle_t client)
+{
+	return client->response.content_length;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client)
+{
+	return client->response.status_code;
+}
+
+int esp_http_client_read(esp_http_client_handle_t client, char *buffer, int len)
+{
+	int left = client->response.sent - client->offset;
+	if (left <= 0)
+		return client->response.read_error ? -1 : 0;
+	if (len > left)
+		len = left;
+	if (len > client->response.read_size)
+		len = client->response.read_size;
+	memcpy(buffer, client->response.body + client->offset, len);
+	client->offset += len;
+	return len;
+}
+
+bool esp_http_client_is_complete_data_received(esp_http_client_handle_t client)
+{
+	return client->offset >= client->response.content_length;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client)
+{
+	(void)client;
+	return ESP_OK;
+}
+
+static esp_err_t _count_data(void *ctx, const char *data, int len)
+{
+	(void)data;
+	*(int*)ctx += len;
+	return ESP_OK;
+}
+
+static int failures = 0;
+
+static void _expect(const char *name, bool ok)
+{
+	printf("%-48s %s\n", name, ok ? "ok" : "FAIL");
+	if (!ok)
+		failures++;
+}
+
+int main(void)
+{
+	if (spotify_pool_init() != ESP_OK)
+		return 1;
+
+	static char large[SPOTIFY_RESPONSE_BUF_SIZE * 2];
+	memset(large, 'x', sizeof(large));
+	const char *json = "{\"items\":[{\"played_at\":\"2024-01-01T00:00:00Z\"},{\"played_at\":\"2024-01-02T00:00:00Z\"}]}";
+	int json_len = strlen(json);
+	spotify_request_t request = {
+		.host = "api.spotify.com",
+		.path = "/v1/me/player/recently-played",
+		.method = HTTP_METHOD_GET,
+		.priority = SPOTIFY_PRIORITY_COMMAND,
+	};
+	spotify_request_t streamed = request;
+	int streamed_len = 0;
+	streamed.on_data = _count_data;
+	streamed.ctx = &streamed_len;
+	spotify_request_t truncatable = request;
+	truncatable.allow_truncated = true;
+	spotify_response_t response;
+	esp_err_t err;
+
+	next_response = (fake_response_t){ 200, json, json_len, json_len, 16, false };
+	err = spotify_pool_request(&request, &response);
+	_expect("complete body", err == ESP_OK && !response.truncated && response.data_len == json_len
+			&& strcmp(response.data, json) == 0);
+	spotify_pool_release(&response);
+
+	next_response = (fake_response_t){ 204, "", 0, 0, 16, false };
+	err = spotify_pool_request(&request, &response);
+	_expect("empty body", err == ESP_OK && response.data_len == 0);
+	spotify_pool_release(&response);
+
+	next_response = (fake_response_t){ 200, json, json_len, json_len / 2, 16, false };
+	err = spotify_pool_request(&request, &response);
+	_expect("body cut short is an error", err != ESP_OK && !response.truncated);
+	spotify_pool_release(&response);
+
+	next_response = (fake_response_t){ 200, json, json_len, 0, 16, false };
+	err = spotify_pool_request(&request, &response);
+	_expect("body missing entirely is an error", err != ESP_OK);
+	spotify_pool_release(&response);
+
+	next_response = (fake_response_t){ 200, json, json_len, json_len / 2, 16, false };
+	err = spotify_pool_request(&streamed, &response);
+	_expect("streamed body cut short is an error", err != ESP_OK && streamed_len == json_len / 2);
+	spotify_pool_release(&response);
+
+	next_response = (fake_response_t){ 200, json, json_len, json_len / 2, 16, true };
+	err = spotify_pool_request(&request, &response);
+	_expect("read error is an error", err == ESP_FAIL);
+	spotify_pool_release(&response);
+
+	next_response = (fake_response_t){ 200, large, sizeof(large), sizeof(large), 1024, false };
+	err = spotify_pool_request(&truncatable, &response);
+	_expect("oversized body truncated on request", err == ESP_OK && response.truncated
+			&& response.data_len == SPOTIFY_RESPONSE_BUF_SIZE - 1);
+	spotify_pool_release(&response);
+
+	next_response = (fake_response_t){ 200, large, sizeof(large), sizeof(large), 1024, false };
+	err = spotify_pool_request(&request, &response);
+	_expect("oversized body is an error otherwise", err == ESP_ERR_INVALID_SIZE && !response.truncated);
+	spotify_pool_release(&response);
+
+	// a body cut short inside the head a truncating caller asked for is still an error
+	next_response = (fake_response_t){ 200, large, sizeof(large), 1000, 1024, false };
+	err = spotify_pool_request(&truncatable, &response);
+	_expect("truncatable body cut short is an error", err != ESP_OK && !response.truncated);
+	spotify_pool_release(&response);
+
+	printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+	return failures == 0 ? 0 : 1;
+}
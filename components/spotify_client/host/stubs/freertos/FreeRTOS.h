@@ -0,0 +1,15 @@
+/* Host stand-in for FreeRTOS, enough for single-threaded tests: a semaphore is a counter */
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE          1
+#define pdFALSE         0
+#define pdPASS          pdTRUE
+#define pdFAIL          pdFALSE
+#define portMAX_DELAY   ((TickType_t)0xffffffffUL)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
@@ -0,0 +1,4 @@
+/* Host stand-in for FreeRTOS, included by time_manager.h */
+#pragma once
+
+#include "freertos/FreeRTOS.h"
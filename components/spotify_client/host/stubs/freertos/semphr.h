@@ -0,0 +1,33 @@
+/* Host stand-in for FreeRTOS: nothing ever blocks, taking an empty semaphore fails at once */
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct host_semaphore_t { int count; } *SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t host_semaphore_create(int count)
+{
+	SemaphoreHandle_t semaphore = (SemaphoreHandle_t)malloc(sizeof(*semaphore));
+	if (semaphore != NULL)
+		semaphore->count = count;
+	return semaphore;
+}
+
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks)
+{
+	(void)ticks;
+	if (semaphore->count <= 0)
+		return pdFALSE;
+	semaphore->count--;
+	return pdTRUE;
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+	semaphore->count++;
+	return pdTRUE;
+}
+
+#define xSemaphoreCreateMutex()                     host_semaphore_create(1)
+#define xSemaphoreCreateBinary()                    host_semaphore_create(0)
+#define xSemaphoreCreateCounting(max, initial)      host_semaphore_create(initial)
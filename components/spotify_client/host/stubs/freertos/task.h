@@ -0,0 +1,28 @@
+/* Host stand-in for FreeRTOS: tasks are never started, the tests stay on one thread */
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+static inline BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint32_t stack, void *param,
+		uint32_t priority, TaskHandle_t *handle)
+{
+	(void)code; (void)name; (void)stack; (void)param; (void)priority;
+	if (handle != NULL)
+		*handle = NULL;
+	return pdFAIL;
+}
+
+static inline uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+	(void)clear; (void)ticks;
+	return 0;
+}
+
+static inline BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+	(void)task;
+	return pdPASS;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define SPOTIFY_IMAGE_HOST          "i.scdn.co"
+#define SPOTIFY_ART_CACHE_SLOTS     (3U)
+#define SPOTIFY_ART_MAX_SIZE        (1024 * 8)
+#define SPOTIFY_ART_URL_LENGTH      (70U)
+
+/**
+ * Album art cache. Holds the raw image bytes of the last few covers, enough for the current,
+ * the prefetched next and the previous track. Slots are recycled least recently used first.
+ */
+esp_err_t spotify_art_init(void);
+
+/**
+ * @brief Download url into the cache unless it is already there. Runs at poll priority.
+ */
+esp_err_t spotify_art_fetch(const char *url);
+
+/**
+ * @brief Copy the cached image for url into buf. Returns false on a miss or if buf is too small.
+ */
+bool spotify_art_get(const char *url, uint8_t *buf, size_t size, size_t *length);
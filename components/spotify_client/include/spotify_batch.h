@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "spotify_client.h"
+
+#define SPOTIFY_BATCH_MAX_IDS           (50U)
+#define SPOTIFY_BATCH_WINDOW_MS         CONFIG_SPOTIFY_BATCH_WINDOW_MS
+#define SPOTIFY_BATCH_ITEM_BUF_SIZE     (1024 * 4)
+#define SPOTIFY_BATCH_TASK_STACK        (6144U)
+#define SPOTIFY_BATCH_TASK_PRIORITY     (3U)
+
+#define SPOTIFY_TRACKS_LOOKUP_ENDPOINT  "/v1/tracks?market=from_token&ids="
+#define SPOTIFY_TRACKS_CONTAINS_ENDPOINT "/v1/me/tracks/contains?ids="
+
+/**
+ * Batched lookups. IDs submitted by any task within SPOTIFY_BATCH_WINDOW_MS of each other go out
+ * together, up to SPOTIFY_BATCH_MAX_IDS per request, and each caller blocks until its own IDs
+ * are answered. Larger submissions are split over several requests transparently.
+ */
+esp_err_t spotify_batch_init(void);
+
+/**
+ * @brief Look up track metadata. tracks[i] describes ids[i]; its track_id is left empty when
+ * Spotify does not know that ID.
+ */
+esp_err_t spotify_get_tracks(const char *const *ids, int count, spotify_track_t *tracks);
+
+/**
+ * @brief Check whether each track is in the user's Liked Songs.
+ */
+esp_err_t spotify_tracks_contains(const char *const *ids, int count, bool *saved);
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define SPOTIFY_BREAKER_MAX_HOSTS           (3U)
+#define SPOTIFY_BREAKER_FAILURE_THRESHOLD   CONFIG_SPOTIFY_BREAKER_FAILURE_THRESHOLD
+#define SPOTIFY_BREAKER_OPEN_MS             CONFIG_SPOTIFY_BREAKER_OPEN_MS
+#define SPOTIFY_BREAKER_MAX_OPEN_MS         (5U * 60U * 1000U)
+
+#define SPOTIFY_ERR_BASE                    (0xA000)
+#define SPOTIFY_ERR_CIRCUIT_OPEN            (SPOTIFY_ERR_BASE + 1)
+
+/**
+ * Closed: requests go out normally. Open: requests fail fast without touching the network.
+ * Half-open: the cool-down expired and a single probe request is let through; its outcome
+ * closes the circuit or opens it again for twice as long.
+ */
+typedef enum spotify_breaker_state_t
+{
+  SPOTIFY_BREAKER_CLOSED,
+  SPOTIFY_BREAKER_OPEN,
+  SPOTIFY_BREAKER_HALF_OPEN
+} spotify_breaker_state_t;
+
+typedef enum spotify_breaker_outcome_t
+{
+  SPOTIFY_BREAKER_SUCCESS,
+  SPOTIFY_BREAKER_FAILURE,
+  SPOTIFY_BREAKER_NEUTRAL
+} spotify_breaker_outcome_t;
+
+typedef struct spotify_breaker_event_t
+{
+  const char *host;
+  spotify_breaker_state_t state;
+  uint32_t open_ms;
+} spotify_breaker_event_t;
+
+bool spotify_breaker_allow(const char *host);
+void spotify_breaker_report(const char *host, spotify_breaker_outcome_t outcome);
+spotify_breaker_state_t spotify_breaker_get_state(const char *host);
+
+/**
+ * @brief Register a callback run on every state transition. The parameter is a spotify_breaker_event_t*
+ * only valid during the call. It runs on the task that issued the request, so keep it short.
+ */
+void spotify_breaker_set_callback(void (*func_ptr)(void*));
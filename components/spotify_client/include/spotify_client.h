@@ -5,6 +5,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/event_groups.h"
 
 #include "esp_err.h"
 #include "esp_log.h"
@@ -14,6 +15,10 @@
 #include "esp_tls.h"
 #include "time_manager.h"
 #include "cJSON.h"
+#include "spotify_pool.h"
+#include "spotify_breaker.h"
+#include "spotify_dns.h"
+#include "spotify_art.h"
 
 #define MAX_SONG_TITLE_LENGTH       (64U)
 #define MAX_SONG_ID_LENGTH          (22U)
@@ -55,11 +60,22 @@
 #define SPOTIFY_PREVIOUS_TRACK_ENDPOINT "/v1/me/player/previous"
 #define SPOTIFY_TRACKS_ENDPOINT "/v1/me/tracks"
 #define SPOTIFY_SEEK_ENDPOINT "/v1/me/player/seek"
+#define SPOTIFY_QUEUE_ENDPOINT "/v1/me/player/queue"
 
 #define SPOTIFY_NUM_ALBUM_IMAGES 3
 #define SPOTIFY_MAX_NUM_ARTISTS 5
 
 #define SPOTIFY_ACCESS_TOKEN_LENGTH 309
+#define SPOTIFY_AUTH_HEADER_LENGTH (SPOTIFY_ACCESS_TOKEN_LENGTH + 8)
+#define SPOTIFY_TOKEN_MARGIN_SEC 60
+
+#define SPOTIFY_MAX_ACCOUNTS             CONFIG_SPOTIFY_MAX_ACCOUNTS
+#define SPOTIFY_RATE_LIMIT_DEFAULT_SEC   (5U)
+#define SPOTIFY_ERR_RATE_LIMITED         (SPOTIFY_ERR_BASE + 2)
+
+#define SPOTIFY_BACKGROUND_TASK_STACK    (6144U)
+#define SPOTIFY_BACKGROUND_TASK_PRIORITY (2U)
+#define SPOTIFY_LATENCY_BENCH_ROUNDS     (20U)
 
 typedef enum repeat_options_t
 {
@@ -77,9 +93,9 @@ typedef struct spotify_image_t
 
 typedef struct spotify_device_t
 {
-  const char *id;
-  const char *name;
-  const char *type;
+  char id[SPOTIFY_DEVICE_ID_CHAR_LENGTH];
+  char name[SPOTIFY_DEVICE_NAME_CHAR_LENGTH];
+  char type[SPOTIFY_DEVICE_TYPE_CHAR_LENGTH];
   bool is_active;
   bool is_restricted;
   bool is_private_session;
@@ -132,6 +148,37 @@ typedef struct currently_playing_t
   uint32_t timestamp;
 } currently_playing_t;
 
+/**
+ * Owned copy of the last now-playing state. Unlike currently_playing_t it does not point into
+ * a parsed response, so it can outlive the request, be handed to other tasks and be persisted.
+ * spotify_get_now_playing extrapolates progress_ms to the time of the call.
+ */
+typedef struct now_playing_t
+{
+  char track_name[MAX_SONG_TITLE_LENGTH + 1];
+  char track_id[MAX_SONG_ID_LENGTH + 1];
+  int num_artists;
+  char artists[SPOTIFY_MAX_NUM_ARTISTS][MAX_ARTIST_NAME_LENGTH + 1];
+  char album_image_url[SPOTIFY_URL_CHAR_LENGTH];
+  bool is_playing;
+  uint32_t progress_ms;
+  uint32_t duration_ms;
+  uint32_t timestamp;
+} now_playing_t;
+
+/**
+ * Display fields of a track object, owned. Filled by spotify_parse_track and the batch lookups.
+ */
+typedef struct spotify_track_t
+{
+  char track_id[MAX_SONG_ID_LENGTH + 1];
+  char track_name[MAX_SONG_TITLE_LENGTH + 1];
+  int num_artists;
+  char artists[SPOTIFY_MAX_NUM_ARTISTS][MAX_ARTIST_NAME_LENGTH + 1];
+  char album_image_url[SPOTIFY_URL_CHAR_LENGTH];
+  uint32_t duration_ms;
+} spotify_track_t;
+
 typedef struct spotify_access_t
 {
   bool is_fresh;
@@ -143,9 +190,49 @@ typedef struct spotify_access_t
 } spotify_access_t;
 
 void spotify_init(void);
+bool spotify_wait_for_network(TickType_t ticks_to_wait);
 bool spotify_refresh_access_token(void);
 bool spotify_get_player_details(player_details_t *player_details);
 bool spotify_get_current_playing(currently_playing_t *currently_playing);
 bool spotify_play(const char *context_uri, int queue_pos, int position_ms, const char *device_id);
 void spotify_pause(void);
-void spotify_change_volume(int volume_percent, const char *device_id);
\ No newline at end of file
+void spotify_change_volume(int volume_percent, const char *device_id);
+void spotify_seek(int position_ms, const char *device_id);
+bool spotify_get_now_playing(now_playing_t *now_playing);
+void spotify_get_command_latency_stats(spotify_latency_stats_t *stats);
+
+/**
+ * @brief Log the worst and mean latency of a critical request sent while every pooled connection
+ * is busy polling, first with poll preemption and then without. Needs the network. Only compiled
+ * in when CONFIG_DEBUG_SPOTIFY_CLIENT is above 0.
+ */
+void spotify_latency_benchmark(void);
+
+/**
+ * @brief Send request to the Web API host with the current access token. The token is refreshed
+ * first when needed, and once more if the API answers 401. Critical requests are hedged.
+ */
+esp_err_t spotify_api_request(spotify_request_t *request, spotify_response_t *response);
+void spotify_parse_track(cJSON *track, spotify_track_t *out);
+
+/**
+ * Accounts: 0 is the one configured in Kconfig, up to SPOTIFY_MAX_ACCOUNTS - 1 more can be added
+ * at runtime and are kept in NVS. Each has its own tokens and rate-limit state; all of them share
+ * the connection pool and DNS cache, so switching accounts costs no handshake. While an account
+ * is rate limited, its requests fail with SPOTIFY_ERR_RATE_LIMITED without being sent.
+ */
+int spotify_account_add(const char *client_id, const char *client_secret, const char *refresh_token);
+esp_err_t spotify_account_remove(int account);
+esp_err_t spotify_account_select(int account);
+int spotify_account_get_active(void);
+
+/**
+ * @brief Stable identifier of the active account, equal on every unit logged into it.
+ */
+uint32_t spotify_account_get_id(void);
+
+/**
+ * @brief Replace the now-playing state with one received from elsewhere, e.g. the LAN leader.
+ * Publishes the change events like a poll would, but starts no prefetch or history refresh.
+ */
+void spotify_set_now_playing(const now_playing_t *snapshot);
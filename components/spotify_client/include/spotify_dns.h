@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define SPOTIFY_DNS_MAX_HOSTS           (4U)
+#define SPOTIFY_DNS_IP_LENGTH           (16U)
+#define SPOTIFY_DNS_MIN_TTL_SEC         (30U)
+#define SPOTIFY_DNS_MAX_TTL_SEC         (3600U)
+#define SPOTIFY_DNS_FALLBACK_TTL_SEC    (60U)
+#define SPOTIFY_DNS_REFRESH_PERCENT     (80U)
+#define SPOTIFY_DNS_MAX_STALE_SEC       (300U)
+#define SPOTIFY_DNS_QUERY_TIMEOUT_MS    (2000U)
+#define SPOTIFY_DNS_TASK_STACK          (4096U)
+#define SPOTIFY_DNS_TASK_PRIORITY       (3U)
+
+/**
+ * Small resolver cache shared by every pooled connection. Entries live for the record TTL and
+ * are refreshed in the background once SPOTIFY_DNS_REFRESH_PERCENT of it has elapsed; lookups
+ * keep returning the cached address while that refresh is in flight, so DNS only sits on the
+ * request path the very first time a host is used.
+ */
+esp_err_t spotify_dns_init(void);
+
+/**
+ * @brief Resolve host to a dotted IPv4 string. Blocks only on a cold miss, or when the cached
+ * address is more than SPOTIFY_DNS_MAX_STALE_SEC past its TTL.
+ */
+esp_err_t spotify_dns_resolve(const char *host, char *ip, size_t size);
+
+/**
+ * @brief Drop the cached address of host, e.g. after a connect to it failed.
+ */
+void spotify_dns_invalidate(const char *host);
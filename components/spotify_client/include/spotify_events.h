@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "spotify_client.h"
+
+#define SPOTIFY_EVENTS_MAX_SUBSCRIBERS  (4U)
+#define SPOTIFY_EVENTS_RING_SIZE        (8U)    /* power of two */
+#define SPOTIFY_SEEK_THRESHOLD_MS       (2000U)
+
+/* bit flags, so a subscriber can select several in one mask */
+typedef enum spotify_event_type_t
+{
+  SPOTIFY_EVENT_TRACK_CHANGED = BIT0,
+  SPOTIFY_EVENT_PLAY_STATE    = BIT1,
+  SPOTIFY_EVENT_SEEK          = BIT2,
+  SPOTIFY_EVENT_VOLUME        = BIT3,
+  SPOTIFY_EVENT_DEVICE        = BIT4,
+  SPOTIFY_EVENT_ALL           = 0x1F
+} spotify_event_type_t;
+
+/**
+ * One change between two consecutive snapshots, by value: it stays valid after the snapshot it
+ * came from is gone.
+ */
+typedef struct spotify_event_t
+{
+  spotify_event_type_t type;
+  uint32_t timestamp;
+  union {
+    struct {
+      char track_id[MAX_SONG_ID_LENGTH + 1];
+      uint32_t duration_ms;
+    } track;
+    struct {
+      bool is_playing;
+    } play_state;
+    struct {
+      uint32_t expected_ms;
+      uint32_t progress_ms;
+    } seek;
+    struct {
+      int volume_percent;
+    } volume;
+    struct {
+      char device_id[SPOTIFY_DEVICE_ID_CHAR_LENGTH];
+    } device;
+  };
+} spotify_event_t;
+
+/**
+ * Change-detection bus. spotify_client compares every poll with the previous state and publishes
+ * only what changed. Each subscriber owns a single-producer single-consumer ring, so publishing
+ * never takes a lock and a slow subscriber only loses its own events; after queueing, the
+ * subscriber's task is notified with its notify_bits.
+ */
+esp_err_t spotify_events_init(void);
+
+/**
+ * @brief Subscribe task to the events in mask. Returns the subscriber id, or -1 if all
+ * SPOTIFY_EVENTS_MAX_SUBSCRIBERS slots are taken.
+ */
+int spotify_events_subscribe(uint32_t mask, TaskHandle_t task, uint32_t notify_bits);
+void spotify_events_unsubscribe(int id);
+
+/**
+ * @brief Pop the oldest pending event of subscriber id. Only the subscribing task may call it.
+ */
+bool spotify_events_receive(int id, spotify_event_t *event);
+
+/**
+ * @brief Events lost because the ring of subscriber id was full.
+ */
+uint32_t spotify_events_dropped(int id);
+
+/**
+ * @brief Fan event out to the subscribers. Single producer: spotify_client publishes with its
+ * now-playing lock held.
+ */
+void spotify_events_publish(const spotify_event_t *event);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "spotify_client.h"
+#include "spotify_record.h"
+
+#define SPOTIFY_HISTORY_SIZE                CONFIG_SPOTIFY_HISTORY_SIZE
+#define SPOTIFY_HISTORY_ITEM_BUF_SIZE       (1024 * 8)
+#define SPOTIFY_RECENTLY_PLAYED_ENDPOINT    "/v1/me/player/recently-played"
+
+/**
+ * One play. Strings keep the currently_playing_t limits but only the first artist, so the whole
+ * ring stays a few KB and fits the NVS partition next to the Wi-Fi settings.
+ */
+typedef struct spotify_history_entry_t
+{
+  spotify_track_record_t track;
+  int64_t played_at;
+} spotify_history_entry_t;
+
+/**
+ * @brief Restore the ring saved by the last refresh. No network needed.
+ */
+esp_err_t spotify_history_init(void);
+
+/**
+ * @brief Fetch the plays newer than the newest one in the ring, using the `after` cursor.
+ * The ring holds the plays of one account: the first refresh after switching accounts drops
+ * the plays of the previous one and fetches the new account's from scratch.
+ */
+esp_err_t spotify_history_refresh(void);
+
+/**
+ * @brief Copy up to max entries, newest first. Returns the number copied.
+ */
+int spotify_history_get(spotify_history_entry_t *entries, int max);
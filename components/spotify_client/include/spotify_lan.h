@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "spotify_client.h"
+#include "spotify_lan_proto.h"
+
+#define SPOTIFY_LAN_GROUP               "239.255.42.99"
+#define SPOTIFY_LAN_PORT                CONFIG_SPOTIFY_LAN_PORT
+#define SPOTIFY_LAN_HEARTBEAT_MS        CONFIG_SPOTIFY_LAN_HEARTBEAT_MS
+#define SPOTIFY_LAN_TIMEOUT_MS          (SPOTIFY_LAN_HEARTBEAT_MS * 3)
+#define SPOTIFY_LAN_TASK_STACK          (4096U)
+#define SPOTIFY_LAN_TASK_PRIORITY       (3U)
+
+/**
+ * Units on the same LAN and account elect one leader over UDP multicast (see
+ * spotify_lan_proto.h). Only the leader polls Spotify; it multicasts a snapshot after every
+ * poll and with each heartbeat, and the followers extrapolate from those. Without
+ * CONFIG_SPOTIFY_LAN_SHARING every unit is its own leader.
+ */
+esp_err_t spotify_lan_init(void);
+
+/**
+ * @brief False while another unit of the same account leads, or while the election is still
+ * settling after start-up; polls should then be skipped.
+ */
+bool spotify_lan_should_poll(void);
+
+/**
+ * @brief Multicast snapshot right away, if this unit leads. Called after every poll.
+ */
+void spotify_lan_publish(const now_playing_t *snapshot);
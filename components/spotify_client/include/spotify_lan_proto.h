@@ -0,0 +1,82 @@
+#pragma once
+
+/*
+ * Wire format and leader election of the LAN state sharing. Plain C with no ESP-IDF or FreeRTOS
+ * dependency, so the protocol can be built into host-side processes and exercised on loopback;
+ * host/lan_loopback_test.c does that with one process per node.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPOTIFY_LAN_MAGIC               (0x4C505345U)   /* "ESPL" */
+#define SPOTIFY_LAN_VERSION             (1U)
+#define SPOTIFY_LAN_MAX_PEERS           (8U)
+#define SPOTIFY_LAN_MAX_PACKET          (512U)
+#define SPOTIFY_LAN_ID_LENGTH           (22U)
+#define SPOTIFY_LAN_NAME_LENGTH         (64U)
+#define SPOTIFY_LAN_URL_LENGTH          (70U)
+
+typedef enum spotify_lan_packet_type_t
+{
+  SPOTIFY_LAN_HEARTBEAT = 1,
+  SPOTIFY_LAN_SNAPSHOT
+} spotify_lan_packet_type_t;
+
+/* what a follower needs to draw and extrapolate the leader's state */
+typedef struct spotify_lan_snapshot_t
+{
+  char track_id[SPOTIFY_LAN_ID_LENGTH + 1];
+  char track_name[SPOTIFY_LAN_NAME_LENGTH + 1];
+  char artist_name[SPOTIFY_LAN_NAME_LENGTH + 1];
+  char album_image_url[SPOTIFY_LAN_URL_LENGTH];
+  bool is_playing;
+  uint32_t progress_ms;
+  uint32_t duration_ms;
+} spotify_lan_snapshot_t;
+
+typedef struct spotify_lan_header_t
+{
+  uint8_t type;
+  uint32_t node_id;
+  uint32_t group_id;
+  uint32_t seq;
+} spotify_lan_header_t;
+
+typedef struct spotify_lan_peer_t
+{
+  uint32_t node_id;
+  uint32_t last_seen_ms;
+} spotify_lan_peer_t;
+
+/**
+ * Every unit knows the units of its group heard within timeout_ms. The leader is the lowest
+ * node id among them and itself, so all units agree without a negotiation round, and a leader
+ * that goes quiet is replaced by the next lowest one once it times out.
+ */
+typedef struct spotify_lan_election_t
+{
+  uint32_t self_id;
+  uint32_t timeout_ms;
+  int num_peers;
+  spotify_lan_peer_t peers[SPOTIFY_LAN_MAX_PEERS];
+} spotify_lan_election_t;
+
+void spotify_lan_election_init(spotify_lan_election_t *election, uint32_t self_id, uint32_t timeout_ms);
+void spotify_lan_election_reset(spotify_lan_election_t *election);
+void spotify_lan_election_seen(spotify_lan_election_t *election, uint32_t node_id, uint32_t now_ms);
+uint32_t spotify_lan_election_leader(spotify_lan_election_t *election, uint32_t now_ms);
+
+/**
+ * @brief Encode a packet, little-endian. snapshot is only used for SPOTIFY_LAN_SNAPSHOT.
+ * Returns the packet length, or 0 if buf is too small.
+ */
+size_t spotify_lan_encode(uint8_t *buf, size_t size, const spotify_lan_header_t *header,
+    const spotify_lan_snapshot_t *snapshot);
+
+/**
+ * @brief Decode a packet; false for foreign, truncated or other-version packets.
+ */
+bool spotify_lan_decode(const uint8_t *buf, size_t len, spotify_lan_header_t *header,
+    spotify_lan_snapshot_t *snapshot);
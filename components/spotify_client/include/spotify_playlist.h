@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "spotify_client.h"
+#include "spotify_record.h"
+
+#define SPOTIFY_PLAYLIST_MAX                CONFIG_SPOTIFY_PLAYLIST_MAX
+#define SPOTIFY_PLAYLIST_CACHE_SLOTS        CONFIG_SPOTIFY_PLAYLIST_CACHE_SLOTS
+#define SPOTIFY_PLAYLIST_MAX_TRACKS         CONFIG_SPOTIFY_PLAYLIST_MAX_TRACKS
+#define SPOTIFY_SNAPSHOT_ID_LENGTH          (64U)
+#define SPOTIFY_PLAYLIST_PAGE_SIZE          (50U)
+#define SPOTIFY_PLAYLIST_ITEM_BUF_SIZE      (1024 * 3)
+#define SPOTIFY_USER_PLAYLISTS_ENDPOINT     "/v1/me/playlists"
+#define SPOTIFY_PLAYLIST_TRACKS_ENDPOINT    "/v1/playlists/%s/tracks"
+#define SPOTIFY_PLAYLIST_TRACKS_FIELDS      "items(track(uri,name,duration_ms,artists(name)))"
+
+typedef struct spotify_playlist_t
+{
+  char id[MAX_PLAYLIST_ID_LENGTH + 1];
+  char name[MAX_PLAYLIST_NAME_LENGTH + 1];
+  char snapshot_id[SPOTIFY_SNAPSHOT_ID_LENGTH + 1];
+  uint16_t total_tracks;
+} spotify_playlist_t;
+
+/* stored in flash exactly as returned, one sealed record per track */
+typedef spotify_track_record_t spotify_playlist_track_t;
+
+/**
+ * Flash-backed playlist cache. The list of the user's playlists is kept with each snapshot_id;
+ * the tracks of the SPOTIFY_PLAYLIST_CACHE_SLOTS most recently opened playlists are kept too,
+ * tagged with the snapshot they were downloaded at. A sync re-lists the playlists and downloads
+ * tracks again only for cached playlists whose snapshot_id moved.
+ */
+esp_err_t spotify_playlist_init(void);
+esp_err_t spotify_playlists_sync(void);
+
+/**
+ * @brief Copy up to max playlists from the cached list. No network access.
+ */
+int spotify_playlists_get(spotify_playlist_t *playlists, int max);
+
+/**
+ * @brief Load the tracks of a playlist into tracks, which must hold SPOTIFY_PLAYLIST_MAX_TRACKS
+ * entries. Served from flash when the cached copy matches the listed snapshot_id; downloaded
+ * otherwise. Returns the number of tracks, or -1 on error.
+ */
+int spotify_playlist_open(const char *playlist_id, spotify_playlist_track_t *tracks);
+
+/**
+ * @brief Load the tracks cached in slot, whatever playlist they belong to. Never touches the
+ * network; returns -1 for an empty slot.
+ */
+int spotify_playlist_get_cached(int slot, spotify_playlist_track_t *tracks);
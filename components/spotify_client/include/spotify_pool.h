@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "esp_err.h"
+#include "esp_http_client.h"
+
+#define SPOTIFY_POOL_SIZE           CONFIG_SPOTIFY_POOL_SIZE
+#define SPOTIFY_RESPONSE_BUF_SIZE   (1024 * 12)
+#define SPOTIFY_URL_MAX_LENGTH      (1280U)
+#define SPOTIFY_TX_BUF_SIZE         (1536)
+#define SPOTIFY_HEDGE_AUTH_LENGTH   (320U)
+#define SPOTIFY_HEDGE_SAMPLES       (32U)
+#define SPOTIFY_HEDGE_MIN_SAMPLES   (8U)
+#define SPOTIFY_HEDGE_TASK_STACK    (8192U)
+#define SPOTIFY_HEDGE_TASK_PRIORITY (4U)
+#define SPOTIFY_CANCEL_SLICE_MS     (100U)
+
+/**
+ * Requests are either background polls or user commands. A command submitted while a poll
+ * is in flight asks the poll to abort at its next read boundary, so the command never queues
+ * behind a slow response whose content it is about to invalidate anyway. While waiting for the
+ * response headers a poll checks for that every SPOTIFY_CANCEL_SLICE_MS.
+ * Critical commands are idempotent and body-less, so they may also be hedged: if no response
+ * arrives within the running p95 a second copy goes out on another pooled connection.
+ */
+typedef enum spotify_priority_t
+{
+  SPOTIFY_PRIORITY_POLL,
+  SPOTIFY_PRIORITY_COMMAND,
+  SPOTIFY_PRIORITY_CRITICAL
+} spotify_priority_t;
+
+typedef struct spotify_request_t
+{
+  const char *host;
+  const char *path;
+  esp_http_client_method_t method;
+  const char *content_type;
+  const char *accept;
+  const char *body;
+  const char *authorization;
+  spotify_priority_t priority;
+  int timeout_ms;
+  volatile bool *cancel;
+  bool allow_truncated;
+  esp_err_t (*on_data)(void *ctx, const char *data, int len);
+  void *ctx;
+} spotify_request_t;
+
+typedef struct spotify_conn_t
+{
+  esp_http_client_handle_t client;
+  const char *host;
+  bool in_use;
+  spotify_priority_t priority;
+  volatile bool abort;
+  char *response_buf;
+  uint32_t retry_after_sec;
+} spotify_conn_t;
+
+typedef struct spotify_response_t
+{
+  spotify_conn_t *conn;
+  int status_code;
+  int data_len;
+  char *data;
+  bool aborted;
+  bool truncated;
+  uint32_t retry_after_sec;   /* Retry-After of a 429, 0 if absent */
+} spotify_response_t;
+
+typedef struct spotify_latency_stats_t
+{
+  uint32_t commands;
+  uint32_t preemptions;
+  uint32_t last_us;
+  uint32_t worst_us;
+  uint32_t worst_wait_us;
+  uint32_t hedges_sent;
+  uint32_t hedges_won;
+  uint32_t hedge_threshold_ms;
+} spotify_latency_stats_t;
+
+esp_err_t spotify_pool_init(void);
+esp_err_t spotify_pool_request(const spotify_request_t *request, spotify_response_t *response);
+esp_err_t spotify_pool_request_hedged(const spotify_request_t *request, spotify_response_t *response);
+void spotify_pool_release(spotify_response_t *response);
+void spotify_pool_get_latency_stats(spotify_latency_stats_t *stats);
+void spotify_pool_reset_latency_stats(void);
+
+/**
+ * @brief Turn poll preemption off and on at runtime, to compare command latencies with and
+ * without it. Has no effect unless CONFIG_SPOTIFY_POLL_PREEMPTION is set.
+ */
+void spotify_pool_set_preemption(bool enabled);
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cJSON.h"
+#include "spotify_client.h"
+
+#define SPOTIFY_RECORD_VERSION          (1U)
+#define SPOTIFY_RECORD_BENCH_ROUNDS     (200U)
+
+typedef enum spotify_record_type_t
+{
+  SPOTIFY_RECORD_TRACK = 1,
+  SPOTIFY_RECORD_ARTIST,
+  SPOTIFY_RECORD_ALBUM
+} spotify_record_type_t;
+
+/**
+ * Common head of every record. length is the sizeof the record when it was sealed, so a record
+ * written by a firmware with another layout fails the check even when the version matches.
+ */
+typedef struct spotify_record_header_t
+{
+  uint8_t type;
+  uint8_t version;
+  uint16_t length;
+} spotify_record_header_t;
+
+/**
+ * Fixed-layout records: inline NUL-terminated strings, explicit padding and a trailing CRC-32
+ * over everything before it. They hold no pointers, so they can be memcpy'd between tasks,
+ * sent through a FreeRTOS queue by value and written to flash as they are.
+ */
+typedef struct spotify_track_record_t
+{
+  spotify_record_header_t header;
+  uint32_t duration_ms;
+  char track_id[MAX_SONG_ID_LENGTH + 1];
+  char track_name[MAX_SONG_TITLE_LENGTH + 1];
+  char artist_name[MAX_ARTIST_NAME_LENGTH + 1];
+  uint8_t num_artists;
+  uint8_t reserved[2];
+  uint32_t crc;
+} spotify_track_record_t;
+
+typedef struct spotify_artist_record_t
+{
+  spotify_record_header_t header;
+  char artist_id[MAX_SONG_ID_LENGTH + 1];
+  char artist_name[MAX_ARTIST_NAME_LENGTH + 1];
+  uint32_t crc;
+} spotify_artist_record_t;
+
+typedef struct spotify_album_record_t
+{
+  spotify_record_header_t header;
+  char album_id[MAX_SONG_ID_LENGTH + 1];
+  char album_name[MAX_SONG_TITLE_LENGTH + 1];
+  char image_url[SPOTIFY_URL_CHAR_LENGTH];
+  uint8_t reserved[2];
+  uint32_t crc;
+} spotify_album_record_t;
+
+/**
+ * @brief Fill the header and the CRC of a record whose fields are set. size is its sizeof.
+ */
+void spotify_record_seal(void *record, spotify_record_type_t type, size_t size);
+
+/**
+ * @brief True if record is a sealed record of type, of this layout and version, and intact.
+ */
+bool spotify_record_check(const void *record, spotify_record_type_t type, size_t size);
+
+void spotify_track_record_from_track(const spotify_track_t *track, spotify_track_record_t *record);
+void spotify_artist_record_from_json(cJSON *artist, spotify_artist_record_t *record);
+void spotify_album_record_from_json(cJSON *album, spotify_album_record_t *record);
+
+/**
+ * @brief Log the cost of passing a track as a record against printing and re-parsing its JSON.
+ * Only compiled in when CONFIG_DEBUG_SPOTIFY_CLIENT is above 0.
+ */
+void spotify_record_benchmark(void);
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include "esp_err.h"
+#include "spotify_client.h"
+
+#define SPOTIFY_SEARCH_MAX_ENTRIES      CONFIG_SPOTIFY_SEARCH_MAX_ENTRIES
+#define SPOTIFY_SEARCH_MAX_TOKENS       (SPOTIFY_SEARCH_MAX_ENTRIES * 8)
+#define SPOTIFY_SEARCH_POOL_SIZE        (SPOTIFY_SEARCH_MAX_ENTRIES * 72)
+#define SPOTIFY_SEARCH_MAX_WORDS        (4U)
+#define SPOTIFY_SEARCH_MAX_QUERY        (64U)
+#define SPOTIFY_SEARCH_ITEM_BUF_SIZE    (1024 * 6)
+#define SPOTIFY_SEARCH_REMOTE_LIMIT     (50U)
+
+/**
+ * Local search over the cached library: recently played tracks and the cached playlists.
+ * Every word of every title and artist name is a token; the tokens are kept sorted, so a query
+ * word is a binary search for the range of tokens it prefixes. The index is small enough to be
+ * saved to NVS whole and is rebuilt whenever the history or the playlists change.
+ */
+esp_err_t spotify_search_init(void);
+esp_err_t spotify_search_rebuild(void);
+
+/**
+ * @brief Ranked local matches for query. Every query word must prefix a word of the title or
+ * the artist; title matches rank above artist matches. String fields of results point into
+ * strings. Returns the number of results.
+ */
+int spotify_search_local(const char *query, search_result_t *results, int max, char *strings, size_t size);
+
+/**
+ * @brief Local search first; SPOTIFY_SEARCH_ENDPOINT only when the local index has no match.
+ * The remote search returns at most SPOTIFY_SEARCH_REMOTE_LIMIT results.
+ * Returns the number of results, or -1 if the remote search failed.
+ */
+int spotify_search(const char *query, search_result_t *results, int max, char *strings, size_t size);
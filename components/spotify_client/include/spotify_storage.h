@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#include "spotify_client.h"
+
+#define SPOTIFY_NVS_NAMESPACE "spotify"
+
+esp_err_t spotify_storage_set_blob(const char *key, const void *data, size_t length);
+esp_err_t spotify_storage_get_blob(const char *key, void *data, size_t *length);
+
+/**
+ * @brief Persist the access token of account with its expiry as wall-clock seconds, 0 if the
+ * clock was not set. Account 0 keeps the keys used before there were several accounts.
+ */
+esp_err_t spotify_storage_save_token(int account, const char *access_token, int64_t expires_at);
+esp_err_t spotify_storage_load_token(int account, char *access_token, size_t size, int64_t *expires_at);
+
+/**
+ * @brief Persist the credentials of an account added at runtime; account 0 comes from Kconfig.
+ */
+esp_err_t spotify_storage_save_account(int account, const spotify_access_t *access);
+esp_err_t spotify_storage_load_account(int account, spotify_access_t *access);
+esp_err_t spotify_storage_erase_account(int account);
+esp_err_t spotify_storage_save_now_playing(const now_playing_t *now_playing);
+esp_err_t spotify_storage_load_now_playing(now_playing_t *now_playing);
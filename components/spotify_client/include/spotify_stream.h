@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "cJSON.h"
+
+typedef void (*spotify_stream_item_cb_t)(void *ctx, int index, cJSON *item);
+
+/**
+ * Incremental scanner for Web API documents shaped like {"key":[{...},{...}], ...}. Objects of the
+ * first-level array are cut out as they stream in and handed to on_item one at a time, so the
+ * whole document never has to fit in memory. Elements larger than the buffer, or null, are
+ * skipped but still counted, so index always matches the position in the array.
+ * For arrays nested one level deeper, like {"tracks":{"items":[...]}}, set array_depth to 3
+ * after spotify_stream_init.
+ */
+typedef struct spotify_stream_t
+{
+  char *buf;
+  int buf_size;
+  spotify_stream_item_cb_t on_item;
+  void *ctx;
+  int array_depth;
+  int depth;
+  bool in_string;
+  bool escape;
+  bool in_array;
+  bool capturing;
+  bool overflow;
+  int index;
+  int item_len;
+} spotify_stream_t;
+
+void spotify_stream_init(spotify_stream_t *stream, char *buf, int buf_size, spotify_stream_item_cb_t on_item, void *ctx);
+
+/**
+ * @brief Feed the next chunk. Matches the on_data hook of spotify_request_t, with the stream as ctx.
+ */
+esp_err_t spotify_stream_feed(void *stream, const char *data, int len);
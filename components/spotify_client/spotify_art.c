@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "spotify_art.h"
+#include "spotify_pool.h"
+#include "time_manager.h"
+
+#define SPOTIFY_ART_URL_PREFIX "https://" SPOTIFY_IMAGE_HOST
+
+typedef struct spotify_art_slot_t
+{
+	char url[SPOTIFY_ART_URL_LENGTH];
+	uint8_t *data;
+	size_t length;
+	uint32_t last_used;
+} spotify_art_slot_t;
+
+static const char *TAG = "SpotifyArt";
+static spotify_art_slot_t slots[SPOTIFY_ART_CACHE_SLOTS];
+static SemaphoreHandle_t art_mutex = NULL;
+
+
+static spotify_art_slot_t* _art_find(const char *url)
+{
+	for (int i = 0; i < SPOTIFY_ART_CACHE_SLOTS; i++) {
+		if (slots[i].length > 0 && strcmp(slots[i].url, url) == 0)
+			return &slots[i];
+	}
+	return NULL;
+}
+
+esp_err_t spotify_art_init(void)
+{
+	if (art_mutex != NULL)
+		return ESP_OK;
+
+	memset(slots, 0, sizeof(slots));
+	art_mutex = xSemaphoreCreateMutex();
+	return art_mutex != NULL ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t spotify_art_fetch(const char *url)
+{
+	size_t prefix_len = strlen(SPOTIFY_ART_URL_PREFIX);
+	if (url == NULL || strncmp(url, SPOTIFY_ART_URL_PREFIX, prefix_len) != 0 || url[prefix_len] != '/'
+			|| strlen(url) >= SPOTIFY_ART_URL_LENGTH)
+		return ESP_ERR_INVALID_ARG;
+
+	xSemaphoreTake(art_mutex, portMAX_DELAY);
+	spotify_art_slot_t *slot = _art_find(url);
+	if (slot != NULL)
+		slot->last_used = time_millis();
+	xSemaphoreGive(art_mutex);
+	if (slot != NULL)
+		return ESP_OK;
+
+	spotify_request_t request = {
+		.host = SPOTIFY_IMAGE_HOST,
+		.path = url + prefix_len,
+		.method = HTTP_METHOD_GET,
+		.accept = "image/*",
+		.priority = SPOTIFY_PRIORITY_POLL,
+	};
+	spotify_response_t response;
+	esp_err_t err = spotify_pool_request(&request, &response);
+	if (err == ESP_OK && (response.status_code != 200 || response.data_len <= 0))
+		err = ESP_FAIL;
+	if (err == ESP_OK && response.data_len > SPOTIFY_ART_MAX_SIZE)
+		err = ESP_ERR_INVALID_SIZE;
+	if (err != ESP_OK) {
+		ESP_LOGW(TAG, "Could not fetch %s: %s", url, esp_err_to_name(err));
+		goto cleanup;
+	}
+
+	xSemaphoreTake(art_mutex, portMAX_DELAY);
+	slot = &slots[0];
+	for (int i = 1; i < SPOTIFY_ART_CACHE_SLOTS; i++) {
+		if (slots[i].length == 0 || (slot->length != 0 && slots[i].last_used < slot->last_used))
+			slot = &slots[i];
+	}
+	if (slot->data == NULL)
+		slot->data = (uint8_t*)malloc(SPOTIFY_ART_MAX_SIZE);
+	if (slot->data != NULL) {
+		memcpy(slot->data, response.data, response.data_len);
+		slot->length = response.data_len;
+		slot->last_used = time_millis();
+		snprintf(slot->url, sizeof(slot->url), "%s", url);
+		ESP_LOGD(TAG, "Cached %d bytes of art for %s", response.data_len, url);
+	} else {
+		err = ESP_ERR_NO_MEM;
+	}
+	xSemaphoreGive(art_mutex);
+
+cleanup:
+	spotify_pool_release(&response);
+	return err;
+}
+
+bool spotify_art_get(const char *url, uint8_t *buf, size_t size, size_t *length)
+{
+	bool hit = false;
+	xSemaphoreTake(art_mutex, portMAX_DELAY);
+	spotify_art_slot_t *slot = _art_find(url);
+	if (slot != NULL && slot->length <= size) {
+		memcpy(buf, slot->data, slot->length);
+		*length = slot->length;
+		slot->last_used = time_millis();
+		hit = true;
+	}
+	xSemaphoreGive(art_mutex);
+	return hit;
+}
@@ -0,0 +1,218 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "spotify_batch.h"
+#include "spotify_stream.h"
+
+typedef enum spotify_batch_kind_t
+{
+	SPOTIFY_BATCH_TRACKS,
+	SPOTIFY_BATCH_CONTAINS,
+	SPOTIFY_BATCH_KINDS
+} spotify_batch_kind_t;
+
+/* lives on the stack of the blocked caller until done is given */
+typedef struct spotify_batch_waiter_t
+{
+	spotify_batch_kind_t kind;
+	const char *const *ids;
+	int count;
+	int dispatched;
+	int completed;
+	void *results;
+	esp_err_t err;
+	SemaphoreHandle_t done;
+	StaticSemaphore_t done_buffer;
+	struct spotify_batch_waiter_t *next;
+} spotify_batch_waiter_t;
+
+typedef struct spotify_batch_slot_t
+{
+	spotify_batch_waiter_t *waiter;
+	int index;
+} spotify_batch_slot_t;
+
+static const char *TAG = "SpotifyBatch";
+static spotify_batch_waiter_t *pending[SPOTIFY_BATCH_KINDS];
+static spotify_batch_slot_t slots[SPOTIFY_BATCH_MAX_IDS];
+static char item_buf[SPOTIFY_BATCH_ITEM_BUF_SIZE];
+static char path[SPOTIFY_URL_MAX_LENGTH];
+static SemaphoreHandle_t batch_mutex = NULL;
+static TaskHandle_t batch_task = NULL;
+
+
+static void _batch_on_track(void *ctx, int index, cJSON *track)
+{
+	int count = *(int*)ctx;
+	if (index >= count)
+		return;
+	spotify_batch_slot_t *slot = &slots[index];
+	spotify_parse_track(track, &((spotify_track_t*)slot->waiter->results)[slot->index]);
+}
+
+static esp_err_t _batch_contains(int count)
+{
+	spotify_request_t request = {
+		.path = path,
+		.method = HTTP_METHOD_GET,
+		.priority = SPOTIFY_PRIORITY_POLL,
+	};
+	spotify_response_t response;
+	cJSON *response_json = NULL;
+	esp_err_t err = spotify_api_request(&request, &response);
+	if (err != ESP_OK)
+		goto cleanup;
+	response_json = cJSON_Parse(response.data);
+	if (response.status_code != 200 || !cJSON_IsArray(response_json)) {
+		err = ESP_FAIL;
+		goto cleanup;
+	}
+	for (int i = 0; i < count && i < cJSON_GetArraySize(response_json); i++)
+		((bool*)slots[i].waiter->results)[slots[i].index] = cJSON_IsTrue(cJSON_GetArrayItem(response_json, i));
+cleanup:
+	if (response_json) cJSON_Delete(response_json);
+	spotify_pool_release(&response);
+	return err;
+}
+
+static esp_err_t _batch_tracks(int count)
+{
+	spotify_stream_t stream;
+	spotify_stream_init(&stream, item_buf, sizeof(item_buf), _batch_on_track, &count);
+	// Full track objects add up to far more than a pooled buffer: parse them as they stream in.
+	spotify_request_t request = {
+		.path = path,
+		.method = HTTP_METHOD_GET,
+		.priority = SPOTIFY_PRIORITY_POLL,
+		.on_data = spotify_stream_feed,
+		.ctx = &stream,
+	};
+	spotify_response_t response;
+	esp_err_t err = spotify_api_request(&request, &response);
+	if (err == ESP_OK && response.status_code != 200)
+		err = ESP_FAIL;
+	spotify_pool_release(&response);
+	return err;
+}
+
+/* sends one request for up to SPOTIFY_BATCH_MAX_IDS pending IDs of kind, false if none were pending */
+static bool _batch_run(spotify_batch_kind_t kind)
+{
+	int count = 0;
+	xSemaphoreTake(batch_mutex, portMAX_DELAY);
+	for (spotify_batch_waiter_t *waiter = pending[kind]; waiter != NULL && count < SPOTIFY_BATCH_MAX_IDS; waiter = waiter->next) {
+		while (waiter->dispatched < waiter->count && count < SPOTIFY_BATCH_MAX_IDS) {
+			slots[count].waiter = waiter;
+			slots[count].index = waiter->dispatched++;
+			count++;
+		}
+	}
+	xSemaphoreGive(batch_mutex);
+	if (count == 0)
+		return false;
+
+	int len = snprintf(path, sizeof(path), "%s",
+			kind == SPOTIFY_BATCH_TRACKS ? SPOTIFY_TRACKS_LOOKUP_ENDPOINT : SPOTIFY_TRACKS_CONTAINS_ENDPOINT);
+	for (int i = 0; i < count; i++) {
+		spotify_batch_slot_t *slot = &slots[i];
+		len += snprintf(path + len, sizeof(path) - len, "%s%s", i > 0 ? "," : "", slot->waiter->ids[slot->index]);
+		if (kind == SPOTIFY_BATCH_TRACKS)
+			memset(&((spotify_track_t*)slot->waiter->results)[slot->index], 0, sizeof(spotify_track_t));
+		else
+			((bool*)slot->waiter->results)[slot->index] = false;
+	}
+
+	esp_err_t err = kind == SPOTIFY_BATCH_TRACKS ? _batch_tracks(count) : _batch_contains(count);
+	ESP_LOGD(TAG, "Looked up %d IDs in one request: %s", count, esp_err_to_name(err));
+
+	xSemaphoreTake(batch_mutex, portMAX_DELAY);
+	for (int i = 0; i < count; i++) {
+		slots[i].waiter->completed++;
+		if (err != ESP_OK)
+			slots[i].waiter->err = err;
+	}
+	spotify_batch_waiter_t **link = &pending[kind];
+	while (*link != NULL) {
+		spotify_batch_waiter_t *waiter = *link;
+		if (waiter->completed < waiter->count) {
+			link = &waiter->next;
+			continue;
+		}
+		*link = waiter->next;
+		// the caller returns and its stack frame goes away: do not touch waiter after this
+		xSemaphoreGive(waiter->done);
+	}
+	xSemaphoreGive(batch_mutex);
+	return true;
+}
+
+static void _batch_task(void *pvParameter)
+{
+	for (;;) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		// Give callers on other tasks a moment to join this batch.
+		vTaskDelay(pdMS_TO_TICKS(SPOTIFY_BATCH_WINDOW_MS));
+		for (int kind = 0; kind < SPOTIFY_BATCH_KINDS; kind++) {
+			while (_batch_run(kind))
+				;
+		}
+	}
+}
+
+static esp_err_t _batch_submit(spotify_batch_kind_t kind, const char *const *ids, int count, void *results)
+{
+	if (count <= 0)
+		return ESP_OK;
+	for (int i = 0; i < count; i++) {
+		if (ids[i] == NULL || ids[i][0] == '\0' || strlen(ids[i]) > MAX_SONG_ID_LENGTH)
+			return ESP_ERR_INVALID_ARG;
+	}
+
+	spotify_batch_waiter_t waiter = {
+		.kind = kind,
+		.ids = ids,
+		.count = count,
+		.results = results,
+		.err = ESP_OK,
+	};
+	waiter.done = xSemaphoreCreateBinaryStatic(&waiter.done_buffer);
+
+	xSemaphoreTake(batch_mutex, portMAX_DELAY);
+	spotify_batch_waiter_t **link = &pending[kind];
+	while (*link != NULL)
+		link = &(*link)->next;
+	*link = &waiter;
+	xSemaphoreGive(batch_mutex);
+
+	xTaskNotifyGive(batch_task);
+	xSemaphoreTake(waiter.done, portMAX_DELAY);
+	return waiter.err;
+}
+
+esp_err_t spotify_batch_init(void)
+{
+	if (batch_mutex != NULL)
+		return ESP_OK;
+
+	memset(pending, 0, sizeof(pending));
+	batch_mutex = xSemaphoreCreateMutex();
+	if (batch_mutex == NULL)
+		return ESP_ERR_NO_MEM;
+	if (xTaskCreate(&_batch_task, "spotify_batch", SPOTIFY_BATCH_TASK_STACK, NULL,
+			SPOTIFY_BATCH_TASK_PRIORITY, &batch_task) != pdPASS)
+		return ESP_ERR_NO_MEM;
+	return ESP_OK;
+}
+
+esp_err_t spotify_get_tracks(const char *const *ids, int count, spotify_track_t *tracks)
+{
+	return _batch_submit(SPOTIFY_BATCH_TRACKS, ids, count, tracks);
+}
+
+esp_err_t spotify_tracks_contains(const char *const *ids, int count, bool *saved)
+{
+	return _batch_submit(SPOTIFY_BATCH_CONTAINS, ids, count, saved);
+}
@@ -0,0 +1,146 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "spotify_breaker.h"
+#include "time_manager.h"
+
+typedef struct spotify_breaker_t
+{
+	const char *host;
+	spotify_breaker_state_t state;
+	uint32_t failures;
+	uint32_t open_ms;
+	uint32_t open_until;
+	bool probe_in_flight;
+} spotify_breaker_t;
+
+static const char *TAG = "SpotifyBreaker";
+static spotify_breaker_t breakers[SPOTIFY_BREAKER_MAX_HOSTS];
+static portMUX_TYPE breaker_mux = portMUX_INITIALIZER_UNLOCKED;
+static void (*breaker_cb)(void*) = NULL;
+
+
+static spotify_breaker_t* _breaker_get(const char *host)
+{
+	spotify_breaker_t *free_slot = NULL;
+	for (int i = 0; i < SPOTIFY_BREAKER_MAX_HOSTS; i++) {
+		if (breakers[i].host != NULL && strcmp(breakers[i].host, host) == 0)
+			return &breakers[i];
+		if (breakers[i].host == NULL && free_slot == NULL)
+			free_slot = &breakers[i];
+	}
+	if (free_slot != NULL) {
+		memset(free_slot, 0, sizeof(spotify_breaker_t));
+		free_slot->host = host;
+		free_slot->open_ms = SPOTIFY_BREAKER_OPEN_MS;
+	}
+	return free_slot;
+}
+
+static void _breaker_notify(const char *host, spotify_breaker_state_t state, uint32_t open_ms)
+{
+	static const char *state_names[] = { "closed", "open", "half-open" };
+	ESP_LOGI(TAG, "Circuit for %s is %s", host, state_names[state]);
+	if (breaker_cb) {
+		spotify_breaker_event_t event = {
+			.host = host,
+			.state = state,
+			.open_ms = open_ms,
+		};
+		(*breaker_cb)(&event);
+	}
+}
+
+bool spotify_breaker_allow(const char *host)
+{
+	bool allow = true;
+	bool half_opened = false;
+	portENTER_CRITICAL(&breaker_mux);
+	spotify_breaker_t *breaker = _breaker_get(host);
+	if (breaker != NULL) {
+		switch (breaker->state) {
+			case SPOTIFY_BREAKER_CLOSED:
+				break;
+			case SPOTIFY_BREAKER_OPEN:
+				if ((int32_t)(time_millis() - breaker->open_until) >= 0) {
+					breaker->state = SPOTIFY_BREAKER_HALF_OPEN;
+					breaker->probe_in_flight = true;
+					half_opened = true;
+				} else {
+					allow = false;
+				}
+				break;
+			case SPOTIFY_BREAKER_HALF_OPEN:
+				// Only the probe goes out; everyone else keeps failing fast until it reports.
+				if (breaker->probe_in_flight)
+					allow = false;
+				else
+					breaker->probe_in_flight = true;
+				break;
+		}
+	}
+	portEXIT_CRITICAL(&breaker_mux);
+
+	if (half_opened)
+		_breaker_notify(host, SPOTIFY_BREAKER_HALF_OPEN, 0);
+	return allow;
+}
+
+void spotify_breaker_report(const char *host, spotify_breaker_outcome_t outcome)
+{
+	bool changed = false;
+	spotify_breaker_state_t state = SPOTIFY_BREAKER_CLOSED;
+	uint32_t open_ms = 0;
+	portENTER_CRITICAL(&breaker_mux);
+	spotify_breaker_t *breaker = _breaker_get(host);
+	if (breaker != NULL) {
+		bool probe = breaker->state == SPOTIFY_BREAKER_HALF_OPEN && breaker->probe_in_flight;
+		if (probe)
+			breaker->probe_in_flight = false;
+
+		if (outcome == SPOTIFY_BREAKER_SUCCESS) {
+			breaker->failures = 0;
+			if (breaker->state != SPOTIFY_BREAKER_CLOSED) {
+				breaker->state = SPOTIFY_BREAKER_CLOSED;
+				breaker->open_ms = SPOTIFY_BREAKER_OPEN_MS;
+				changed = true;
+			}
+		} else if (outcome == SPOTIFY_BREAKER_FAILURE) {
+			breaker->failures++;
+			if (probe) {
+				// Failed probe: back off twice as long before the next one.
+				breaker->open_ms = breaker->open_ms * 2 > SPOTIFY_BREAKER_MAX_OPEN_MS ?
+						SPOTIFY_BREAKER_MAX_OPEN_MS : breaker->open_ms * 2;
+			}
+			if (probe || (breaker->state == SPOTIFY_BREAKER_CLOSED && breaker->failures >= SPOTIFY_BREAKER_FAILURE_THRESHOLD)) {
+				breaker->state = SPOTIFY_BREAKER_OPEN;
+				breaker->open_until = time_millis() + breaker->open_ms;
+				changed = true;
+			}
+		}
+		state = breaker->state;
+		open_ms = breaker->open_ms;
+	}
+	portEXIT_CRITICAL(&breaker_mux);
+
+	if (changed)
+		_breaker_notify(host, state, state == SPOTIFY_BREAKER_OPEN ? open_ms : 0);
+}
+
+spotify_breaker_state_t spotify_breaker_get_state(const char *host)
+{
+	spotify_breaker_state_t state = SPOTIFY_BREAKER_CLOSED;
+	portENTER_CRITICAL(&breaker_mux);
+	spotify_breaker_t *breaker = _breaker_get(host);
+	if (breaker != NULL)
+		state = breaker->state;
+	portEXIT_CRITICAL(&breaker_mux);
+	return state;
+}
+
+void spotify_breaker_set_callback(void (*func_ptr)(void*))
+{
+	breaker_cb = func_ptr;
+}
@@ -1,98 +1,315 @@
 #include "spotify_client.h"
+#include "spotify_storage.h"
+#include "spotify_batch.h"
+#include "spotify_history.h"
+#include "spotify_playlist.h"
+#include "spotify_search.h"
+#include "spotify_record.h"
+#include "spotify_events.h"
+#include "spotify_lan.h"
+#include "esp_wifi.h"
+#include "wifi_manager.h"
+
+#define SPOTIFY_NETWORK_READY_BIT BIT0
+
+#define SPOTIFY_WORK_WARMUP   BIT0
+#define SPOTIFY_WORK_PREFETCH BIT1
+#define SPOTIFY_WORK_HISTORY  BIT2
+
+/**
+ * Token and rate-limit state of one account. Connections and DNS are not per account: every
+ * account sends its requests through the shared pool, only the Authorization header differs.
+ */
+typedef struct spotify_account_t
+{
+	bool in_use;
+	spotify_access_t access;
+	uint32_t rate_limited_until;
+	SemaphoreHandle_t token_mutex;
+} spotify_account_t;
 
-#define RESPONSE_BUF_SIZE (1024 * 12)
 static const char *TAG = "NewSpotifyClient";
-spotify_access_t spotify_access;
-static char* local_response_buf = NULL;
-static char* authorization_header = NULL;
+static spotify_account_t accounts[SPOTIFY_MAX_ACCOUNTS];
+static volatile int active_account = 0;
+static SemaphoreHandle_t account_mutex = NULL;
+static SemaphoreHandle_t now_playing_mutex = NULL;
+static EventGroupHandle_t spotify_event_group = NULL;
+static TaskHandle_t background_task = NULL;
+static now_playing_t now_playing;
+static bool now_playing_valid = false;
+static bool now_playing_live = false;
+static now_playing_t next_playing;
+static bool next_playing_valid = false;
+static int device_volume = -1;
+static char device_id[SPOTIFY_DEVICE_ID_CHAR_LENGTH];
+
+static void _spotify_restore_token(int index)
+{
+	spotify_access_t *access = &accounts[index].access;
+	int64_t expires_at = 0;
+	if (spotify_storage_load_token(index, access->access_token, sizeof(access->access_token), &expires_at) != ESP_OK)
+		return;
+
+	if (time_is_synced() && expires_at != 0) {
+		int64_t remaining = expires_at - time_epoch();
+		if (remaining <= SPOTIFY_TOKEN_MARGIN_SEC) {
+			ESP_LOGD(TAG, "Stored access token of account %d expired", index);
+			return;
+		}
+		access->token_expiration_time = time_seconds() + remaining;
+	} else {
+		// The wall clock is not set yet: use the token optimistically, a 401 triggers a refresh.
+		access->token_expiration_time = time_seconds() + SPOTIFY_TOKEN_TIMEOUT_SEC;
+	}
+	access->is_fresh = true;
+	ESP_LOGI(TAG, "Reusing stored access token of account %d", index);
+}
 
+static esp_err_t _spotify_api_request(const char *path, esp_http_client_method_t method, const char *body,
+		spotify_priority_t priority, int timeout_ms, spotify_response_t *response);
 
-esp_err_t _http_event_handler(esp_http_client_event_t *evt)
+static void _spotify_warmup()
 {
-	static char *output_buffer;
-	static int output_len;
-	switch(evt->event_id) {
-		case HTTP_EVENT_ERROR:
-			ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
-			break;
-		case HTTP_EVENT_ON_CONNECTED:
-			ESP_LOGD(TAG, "HTTP_EVENT_ON_CONNECTED");
-			break;
-		case HTTP_EVENT_HEADER_SENT:
-			ESP_LOGD(TAG, "HTTP_EVENT_HEADER_SENT");
-			break;
-		case HTTP_EVENT_ON_HEADER:
-			ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
-			break;
-		case HTTP_EVENT_ON_DATA:
-			ESP_LOGD(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-			//ESP_LOGD(TAG, "HTTP_EVENT_ON_DATA, content_length=%d", esp_http_client_get_content_length(evt->client));
-			ESP_LOGD(TAG, "HTTP_EVENT_ON_DATA, output_len=%d", output_len);
-			// If user_data buffer is configured, copy the response into the buffer
-			if (evt->user_data) {
-				memcpy(evt->user_data + output_len, evt->data, evt->data_len);
-			} else {
-				if (output_buffer == NULL && esp_http_client_get_content_length(evt->client) > 0) {
-					output_buffer = (char *) malloc(esp_http_client_get_content_length(evt->client));
-					output_len = 0;
-					if (output_buffer == NULL) {
-						ESP_LOGE(TAG, "Failed to allocate memory for output buffer");
-						return ESP_FAIL;
-					}
-				}
-				memcpy(output_buffer + output_len, evt->data, evt->data_len);
-			}
-			output_len += evt->data_len;
-			break;
-		case HTTP_EVENT_ON_FINISH:
-			ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH");
-			if (output_buffer != NULL) {
-				// Response is accumulated in output_buffer. Uncomment the below line to print the accumulated response
-				// ESP_LOG_BUFFER_HEX(TAG, output_buffer, output_len);
-				free(output_buffer);
-				output_buffer = NULL;
-			}
-			output_len = 0;
-			break;
-		case HTTP_EVENT_DISCONNECTED:
-			ESP_LOGD(TAG, "HTTP_EVENT_DISCONNECTED");
-			int mbedtls_err = 0;
-			esp_err_t err = esp_tls_get_and_clear_last_error(evt->data, &mbedtls_err, NULL);
-			if (err != 0) {
-				if (output_buffer != NULL) {
-					free(output_buffer);
-					output_buffer = NULL;
-				}
-				output_len = 0;
-				// ESP_LOGE(TAG, "Last esp error code: 0x%x", err);
-				// ESP_LOGE(TAG, "Last mbedtls failure: 0x%x", mbedtls_err);
-			}
+	uint32_t start = time_millis();
+	char ip[SPOTIFY_DNS_IP_LENGTH];
+	spotify_dns_resolve(SPOTIFY_HOST, ip, sizeof(ip));
+	spotify_dns_resolve(SPOTIFY_ACCOUNTS_HOST, ip, sizeof(ip));
+
+	spotify_response_t response;
+	esp_err_t err = _spotify_api_request(SPOTIFY_DEVICES_ENDPOINT, HTTP_METHOD_GET, NULL,
+			SPOTIFY_PRIORITY_POLL, 0, &response);
+	spotify_pool_release(&response);
+	if (err == ESP_OK)
+		ESP_LOGI(TAG, "Connections warmed up in %u ms", time_millis() - start);
+	else
+		ESP_LOGW(TAG, "Connection warm-up failed: %s", esp_err_to_name(err));
+}
+
+void spotify_parse_track(cJSON *track, spotify_track_t *out)
+{
+	memset(out, 0, sizeof(spotify_track_t));
+	cJSON *name = cJSON_GetObjectItem(track, "name");
+	snprintf(out->track_name, sizeof(out->track_name), "%s", cJSON_IsString(name) ? name->valuestring : "");
+	cJSON *uri = cJSON_GetObjectItem(track, "uri");
+	const char *track_id = cJSON_IsString(uri) ? strrchr(uri->valuestring, ':') : NULL;
+	snprintf(out->track_id, sizeof(out->track_id), "%s", track_id ? track_id + 1 : "");
+	out->duration_ms = cJSON_GetNumberValue(cJSON_GetObjectItem(track, "duration_ms"));
+
+	cJSON *artist = NULL;
+	cJSON_ArrayForEach(artist, cJSON_GetObjectItem(track, "artists")) {
+		if (out->num_artists >= SPOTIFY_MAX_NUM_ARTISTS)
 			break;
+		cJSON *artist_name = cJSON_GetObjectItem(artist, "name");
+		snprintf(out->artists[out->num_artists++], sizeof(out->artists[0]), "%s",
+				cJSON_IsString(artist_name) ? artist_name->valuestring : "");
 	}
-	return ESP_OK;
+	// Images are sorted widest first: the last one is the small cover the display uses.
+	cJSON *images = cJSON_GetObjectItem(cJSON_GetObjectItem(track, "album"), "images");
+	int num_images = cJSON_GetArraySize(images);
+	if (num_images > 0) {
+		cJSON *url = cJSON_GetObjectItem(cJSON_GetArrayItem(images, num_images - 1), "url");
+		if (cJSON_IsString(url))
+			snprintf(out->album_image_url, sizeof(out->album_image_url), "%s", url->valuestring);
+	}
+}
+
+static void _spotify_track_snapshot(cJSON *track, now_playing_t *snapshot)
+{
+	spotify_track_t parsed;
+	spotify_parse_track(track, &parsed);
+	memset(snapshot, 0, sizeof(now_playing_t));
+	memcpy(snapshot->track_name, parsed.track_name, sizeof(snapshot->track_name));
+	memcpy(snapshot->track_id, parsed.track_id, sizeof(snapshot->track_id));
+	snapshot->num_artists = parsed.num_artists;
+	memcpy(snapshot->artists, parsed.artists, sizeof(snapshot->artists));
+	memcpy(snapshot->album_image_url, parsed.album_image_url, sizeof(snapshot->album_image_url));
+	snapshot->duration_ms = parsed.duration_ms;
+}
+
+/**
+ * Returns the first element of the array under key, located by scanning the raw text. Works on
+ * a response that was cut short, as long as that element made it into the buffer.
+ */
+static cJSON* _spotify_parse_first_item(char *data, const char *key)
+{
+	char pattern[32];
+	snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+	char *p = strstr(data, pattern);
+	if (p == NULL || (p = strchr(p + strlen(pattern), '[')) == NULL)
+		return NULL;
+	p += 1 + strspn(p + 1, " \t\r\n");
+	if (*p != '{')
+		return NULL;
+
+	int depth = 0;
+	bool in_string = false;
+	for (char *end = p; *end; end++) {
+		if (in_string) {
+			if (*end == '\\' && end[1])
+				end++;
+			else if (*end == '"')
+				in_string = false;
+		} else if (*end == '"') {
+			in_string = true;
+		} else if (*end == '{') {
+			depth++;
+		} else if (*end == '}' && --depth == 0) {
+			char saved = end[1];
+			end[1] = '\0';
+			cJSON *item = cJSON_Parse(p);
+			end[1] = saved;
+			return item;
+		}
+	}
+	return NULL;
 }
 
+/**
+ * Fetches the playback queue when a track starts and keeps its head as the next track, with
+ * its cover in the art cache. Only the head is needed and full track objects are large, so the
+ * response is allowed to be truncated once that first element is in the buffer.
+ */
+static void _spotify_prefetch_next()
+{
+	now_playing_t current;
+	if (!spotify_get_now_playing(&current))
+		return;
+	spotify_art_fetch(current.album_image_url);
+
+	spotify_response_t response;
+	cJSON *item = NULL;
+	spotify_request_t request = {
+		.path = SPOTIFY_QUEUE_ENDPOINT,
+		.method = HTTP_METHOD_GET,
+		.priority = SPOTIFY_PRIORITY_POLL,
+		.allow_truncated = true,
+	};
+	esp_err_t err = spotify_api_request(&request, &response);
+	if (err != ESP_OK || response.status_code != 200) {
+		ESP_LOGD(TAG, "Queue prefetch failed: %s (%d)", esp_err_to_name(err), response.status_code);
+		goto cleanup;
+	}
+	item = _spotify_parse_first_item(response.data, "queue");
+	if (item == NULL) {
+		ESP_LOGD(TAG, "Queue is empty");
+		goto cleanup;
+	}
+
+	now_playing_t next;
+	_spotify_track_snapshot(item, &next);
+	xSemaphoreTake(now_playing_mutex, portMAX_DELAY);
+	// The track may have changed again while the queue was in flight.
+	bool current_track = strcmp(now_playing.track_id, current.track_id) == 0;
+	if (current_track) {
+		next_playing = next;
+		next_playing_valid = true;
+	}
+	xSemaphoreGive(now_playing_mutex);
+	if (current_track) {
+		ESP_LOGD(TAG, "Up next: %s", next.track_name);
+		spotify_art_fetch(next.album_image_url);
+	}
+cleanup:
+	if (item) cJSON_Delete(item);
+	spotify_pool_release(&response);
+}
+
+/**
+ * Runs the slow work that must not block the caller: the connection warm-up and playlist sync
+ * once per WM_EVENT_STA_GOT_IP, the queue prefetch and the history refresh once per track change.
+ * Resolving both hosts fills the resolver cache, and a cheap poll leaves a keep-alive TLS
+ * connection to the API host in the pool. If the token needs a refresh, that refresh goes out
+ * first on its own connection, which warms the accounts host too. Everything runs at POLL
+ * priority, so user commands preempt it.
+ */
+static void _spotify_background_task(void *pvParameter)
+{
+	uint32_t work = 0;
+	for (;;) {
+		xTaskNotifyWait(0, UINT32_MAX, &work, portMAX_DELAY);
+		if (work & SPOTIFY_WORK_WARMUP) {
+			_spotify_warmup();
+			spotify_playlists_sync();
+		}
+		if (work & SPOTIFY_WORK_PREFETCH)
+			_spotify_prefetch_next();
+		if (work & SPOTIFY_WORK_HISTORY)
+			spotify_history_refresh();
+		// Either of them may have changed the tracks held in flash.
+		if (work & (SPOTIFY_WORK_WARMUP | SPOTIFY_WORK_HISTORY))
+			spotify_search_rebuild();
+	}
+}
+
+static void _spotify_cb_got_ip(void *pvParameter)
+{
+	// Runs on the wifi_manager task, or from spotify_init if the IP came first: hand the slow
+	// part over to the background task.
+	time_sync_start();
+	xEventGroupSetBits(spotify_event_group, SPOTIFY_NETWORK_READY_BIT);
+	xTaskNotify(background_task, SPOTIFY_WORK_WARMUP, eSetBits);
+}
+
+
 void spotify_init()
 {
-    spotify_access.is_fresh = false;
-    memset(spotify_access.client_id, 0, sizeof(spotify_access.client_id));
-    memset(spotify_access.client_secret, 0, sizeof(spotify_access.client_secret));
-    memset(spotify_access.refresh_token, 0, sizeof(spotify_access.refresh_token));
-    memset(spotify_access.access_token, 0, sizeof(spotify_access.access_token));
-	
-    local_response_buf = (char*)malloc(RESPONSE_BUF_SIZE);
-    authorization_header = (char*)malloc(1024);
-	memset(local_response_buf, 0, RESPONSE_BUF_SIZE);
-	memset(authorization_header, 0, 1024);
-    // Context init.
-
-    snprintf(spotify_access.client_id, sizeof(spotify_access.client_id), "%s", CONFIG_SPOTIFY_CLIENT_ID);
-    snprintf(spotify_access.client_secret, sizeof(spotify_access.client_secret), "%s", CONFIG_SPOTIFY_CLIENT_SECRET);
-    snprintf(spotify_access.refresh_token, sizeof(spotify_access.refresh_token), "%s", CONFIG_SPOTIFY_REFRESH_TOKEN);
-
-    if(spotify_access.is_fresh==false) {
-       spotify_access.is_fresh = spotify_refresh_access_token();
+    memset(accounts, 0, sizeof(accounts));
+    for (int i = 0; i < SPOTIFY_MAX_ACCOUNTS; i++)
+        accounts[i].token_mutex = xSemaphoreCreateMutex();
+    account_mutex = xSemaphoreCreateMutex();
+    now_playing_mutex = xSemaphoreCreateMutex();
+    spotify_event_group = xEventGroupCreate();
+    ESP_ERROR_CHECK(spotify_dns_init());
+    ESP_ERROR_CHECK(spotify_pool_init());
+    ESP_ERROR_CHECK(spotify_art_init());
+    ESP_ERROR_CHECK(spotify_batch_init());
+    ESP_ERROR_CHECK(spotify_events_init());
+    // Account 0 is the one configured at build time, the others were added at runtime.
+    spotify_access_t *access = &accounts[0].access;
+    snprintf(access->client_id, sizeof(access->client_id), "%s", CONFIG_SPOTIFY_CLIENT_ID);
+    snprintf(access->client_secret, sizeof(access->client_secret), "%s", CONFIG_SPOTIFY_CLIENT_SECRET);
+    snprintf(access->refresh_token, sizeof(access->refresh_token), "%s", CONFIG_SPOTIFY_REFRESH_TOKEN);
+    accounts[0].in_use = true;
+    for (int i = 1; i < SPOTIFY_MAX_ACCOUNTS; i++) {
+        if (spotify_storage_load_account(i, &accounts[i].access) == ESP_OK) {
+            accounts[i].access.is_fresh = false;
+            accounts[i].in_use = true;
+        }
+    }
+    uint8_t saved = 0;
+    size_t sz = sizeof(saved);
+    if (spotify_storage_get_blob("account_active", &saved, &sz) == ESP_OK && saved < SPOTIFY_MAX_ACCOUNTS
+            && accounts[saved].in_use)
+        active_account = saved;
+
+    // Warm boot: no network round-trip here, the token is refreshed lazily by the first request.
+    for (int i = 0; i < SPOTIFY_MAX_ACCOUNTS; i++) {
+        if (accounts[i].in_use)
+            _spotify_restore_token(i);
     }
+    now_playing_valid = spotify_storage_load_now_playing(&now_playing) == ESP_OK;
+    spotify_history_init();
+    spotify_playlist_init();
+    spotify_search_init();
+    // Only with CONFIG_DEBUG_SPOTIFY_CLIENT > 0; a no-op otherwise.
+    spotify_record_benchmark();
+    ESP_ERROR_CHECK(spotify_lan_init());
+
+    // Pre-connect as soon as an IP is assigned, before the first user-visible request.
+    xTaskCreate(&_spotify_background_task, "spotify_bg", SPOTIFY_BACKGROUND_TASK_STACK, NULL,
+            SPOTIFY_BACKGROUND_TASK_PRIORITY, &background_task);
+    wifi_manager_set_callback(WM_EVENT_STA_GOT_IP, &_spotify_cb_got_ip);
+    // wifi_manager_start() ran first: with a direct reconnect or a static IP the event may
+    // already be gone. Running the callback twice is harmless.
+    if (wifi_manager_is_sta_connected())
+        _spotify_cb_got_ip(NULL);
+}
+
+bool spotify_wait_for_network(TickType_t ticks_to_wait)
+{
+	EventBits_t bits = xEventGroupWaitBits(spotify_event_group, SPOTIFY_NETWORK_READY_BIT,
+			pdFALSE, pdTRUE, ticks_to_wait);
+	return (bits & SPOTIFY_NETWORK_READY_BIT) != 0;
 }
 
 bool _check_response_error(cJSON* response_json)
@@ -113,298 +330,536 @@ bool _check_response_error(cJSON* response_json)
 	}
 }
 
-bool spotify_is_access_token_fresh()
-{	
-	if(spotify_access.is_fresh)
-		return time_seconds() < spotify_access.token_expiration_time;
+static bool _spotify_token_fresh(const spotify_access_t *access)
+{
+	if(access->is_fresh)
+		return time_seconds() < access->token_expiration_time;
 	return false;
 }
 
-bool spotify_refresh_access_token()
+bool spotify_is_access_token_fresh()
 {
-	size_t content_length;
-	esp_http_client_config_t config = {
+	return _spotify_token_fresh(&accounts[active_account].access);
+}
+
+/* call with the token_mutex of the account held */
+static bool _spotify_refresh_access_token(int index)
+{
+	spotify_access_t *access = &accounts[index].access;
+	char post_data[1024];
+	snprintf(post_data, 1024, "client_id=%s&client_secret=%s&refresh_token=%s&grant_type=refresh_token",
+			access->client_id,
+			access->client_secret,
+			access->refresh_token);
+	spotify_request_t request = {
 		.host = SPOTIFY_ACCOUNTS_HOST,
-        .transport_type = HTTP_TRANSPORT_OVER_SSL,
-		.event_handler = _http_event_handler,
-        .path = SPOTIFY_TOKEN_ENDPOINT,
-		.user_data = local_response_buf,
-		.disable_auto_redirect = true,
+		.path = SPOTIFY_TOKEN_ENDPOINT,
+		.method = HTTP_METHOD_POST,
+		.content_type = "application/x-www-form-urlencoded",
+		.body = post_data,
+		.priority = SPOTIFY_PRIORITY_COMMAND,
 	};
-	esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_http_client_set_method(client, HTTP_METHOD_POST);
-    char post_data[1024];
-    snprintf(post_data, 1024, "client_id=%s&client_secret=%s&refresh_token=%s&grant_type=refresh_token",
-            spotify_access.client_id,
-            spotify_access.client_secret,
-            spotify_access.refresh_token);
-    esp_http_client_set_post_field(client, post_data, strlen(post_data));
+	spotify_response_t response;
+	cJSON* response_json = NULL;
 	// GET Token
-	esp_err_t err = esp_http_client_perform(client);
-	if (err == ESP_OK) {
-		ESP_LOGD(TAG, "HTTP GET Status = %d, content_length = %d",
-				esp_http_client_get_status_code(client),
-				esp_http_client_get_content_length(client));
-		content_length = esp_http_client_get_content_length(client);
+	esp_err_t err = spotify_pool_request(&request, &response);
+	if (err != ESP_OK || response.data_len <= 0) {
+		ESP_LOGW(TAG, "Could not read HTTP CLIENT: %s", esp_err_to_name(err));
+		goto cleanup;
+	}
+	ESP_LOGD(TAG, "HTTP POST Status = %d, Response Size: %d", response.status_code, response.data_len);
 
+	response_json = cJSON_Parse(response.data);
+	cJSON* error = cJSON_GetObjectItem(response_json, "error");
+	if (error!=NULL) {
+		ESP_LOGW(TAG, "Error on request");
 	} else {
-		ESP_LOGW(TAG, "HTTP GET request failed: %s", esp_err_to_name(err));
-		content_length = 0;
-	}
-    if (content_length <= 0) {
-        ESP_LOGW(TAG, "Could not read HTTP CLIENT.");
-    } else {
-        ESP_LOGD(TAG, "Response Size: %d", content_length);
-        cJSON* response_json = NULL;
-        response_json = cJSON_Parse(local_response_buf);
-        cJSON* error = cJSON_GetObjectItem(response_json, "error");
-        if (error!=NULL) {
-            ESP_LOGW(TAG, "Error on request");
-			goto cleanup;
-        } else {
-            cJSON* access_token = cJSON_GetObjectItem(response_json, "access_token");
-            cJSON* expires_in = cJSON_GetObjectItem(response_json, "expires_in");
-            if (access_token!=NULL) {
-				char* access_token_value = cJSON_GetObjectItem(response_json, "access_token")->valuestring;
-                uint32_t expiration_time = cJSON_GetNumberValue(expires_in);
-                if (access_token_value) {
-                    strncpy(spotify_access.access_token, access_token_value, strlen(access_token_value));
-					spotify_access.token_expiration_time = time_seconds() + expiration_time;
-                    spotify_access.is_fresh = true;
-                    ESP_LOGD(TAG, "Access Token expires in: %d", spotify_access.token_expiration_time);
-                }
-            } else {
-                ESP_LOGW(TAG, "Access Token Not Found.");
-            }
-        }
+		cJSON* access_token = cJSON_GetObjectItem(response_json, "access_token");
+		cJSON* expires_in = cJSON_GetObjectItem(response_json, "expires_in");
+		if (access_token!=NULL) {
+			char* access_token_value = access_token->valuestring;
+			uint32_t expiration_time = cJSON_GetNumberValue(expires_in);
+			if (access_token_value) {
+				snprintf(access->access_token, sizeof(access->access_token), "%s", access_token_value);
+				access->token_expiration_time = time_seconds() + expiration_time;
+				access->is_fresh = true;
+				ESP_LOGD(TAG, "Access Token of account %d expires in: %d", index, access->token_expiration_time);
+				spotify_storage_save_token(index, access->access_token,
+						time_is_synced() ? time_epoch() + expiration_time : 0);
+			}
+		} else {
+			ESP_LOGW(TAG, "Access Token Not Found.");
+		}
+	}
 cleanup:
-		if(response_json) cJSON_Delete(response_json);
-		memset(local_response_buf, 0, RESPONSE_BUF_SIZE);
-    }
-	esp_http_client_cleanup(client);
-    return time_seconds() < spotify_access.token_expiration_time;
+	if(response_json) cJSON_Delete(response_json);
+	spotify_pool_release(&response);
+	return time_seconds() < access->token_expiration_time;
 }
 
-bool spotify_get_player_details(player_details_t *player_details)
+bool spotify_refresh_access_token()
+{
+	int index = active_account;
+	xSemaphoreTake(accounts[index].token_mutex, portMAX_DELAY);
+	bool fresh = _spotify_refresh_access_token(index);
+	xSemaphoreGive(accounts[index].token_mutex);
+	return fresh;
+}
+
+static bool _spotify_authorization(int index, char *header, size_t size)
+{
+	spotify_account_t *account = &accounts[index];
+	bool fresh = true;
+	xSemaphoreTake(account->token_mutex, portMAX_DELAY);
+	// Another task may have refreshed the token while we were waiting for the lock.
+	if (!_spotify_token_fresh(&account->access))
+		fresh = _spotify_refresh_access_token(index);
+	if (fresh)
+		snprintf(header, size, "Bearer %s", account->access.access_token);
+	xSemaphoreGive(account->token_mutex);
+	return fresh;
+}
+
+static bool _spotify_rate_limited(int index)
+{
+	xSemaphoreTake(accounts[index].token_mutex, portMAX_DELAY);
+	bool limited = accounts[index].rate_limited_until != 0
+			&& (int32_t)(accounts[index].rate_limited_until - time_seconds()) > 0;
+	xSemaphoreGive(accounts[index].token_mutex);
+	return limited;
+}
+
+static void _spotify_note_rate_limit(int index, const spotify_response_t *response)
+{
+	if (response->status_code != 429)
+		return;
+	uint32_t wait_sec = response->retry_after_sec > 0 ? response->retry_after_sec : SPOTIFY_RATE_LIMIT_DEFAULT_SEC;
+	xSemaphoreTake(accounts[index].token_mutex, portMAX_DELAY);
+	accounts[index].rate_limited_until = time_seconds() + wait_sec;
+	xSemaphoreGive(accounts[index].token_mutex);
+	ESP_LOGW(TAG, "Account %d rate limited for %u s", index, wait_sec);
+}
+
+esp_err_t spotify_api_request(spotify_request_t *request, spotify_response_t *response)
+{
+	char authorization[SPOTIFY_AUTH_HEADER_LENGTH];
+	memset(response, 0, sizeof(spotify_response_t));
+	// One request is sent for one account, even if the active account changes meanwhile.
+	int index = active_account;
+	if (_spotify_rate_limited(index))
+		return SPOTIFY_ERR_RATE_LIMITED;
+	if (!_spotify_authorization(index, authorization, sizeof(authorization)))
+		return ESP_ERR_INVALID_STATE;
+
+	request->host = SPOTIFY_HOST;
+	request->authorization = authorization;
+	esp_err_t err = request->priority == SPOTIFY_PRIORITY_CRITICAL ?
+			spotify_pool_request_hedged(request, response) : spotify_pool_request(request, response);
+	if (err == ESP_OK && response->status_code == 401) {
+		// Typically a token restored from flash that was revoked or expired: refresh and retry once.
+		ESP_LOGW(TAG, "Access token rejected, refreshing");
+		spotify_pool_release(response);
+		xSemaphoreTake(accounts[index].token_mutex, portMAX_DELAY);
+		accounts[index].access.is_fresh = false;
+		xSemaphoreGive(accounts[index].token_mutex);
+		if (!_spotify_authorization(index, authorization, sizeof(authorization))) {
+			request->authorization = NULL;
+			return ESP_ERR_INVALID_STATE;
+		}
+		err = request->priority == SPOTIFY_PRIORITY_CRITICAL ?
+				spotify_pool_request_hedged(request, response) : spotify_pool_request(request, response);
+	}
+	if (err == ESP_OK)
+		_spotify_note_rate_limit(index, response);
+	request->authorization = NULL;
+	return err;
+}
+
+int spotify_account_add(const char *client_id, const char *client_secret, const char *refresh_token)
+{
+	int index = -1;
+	xSemaphoreTake(account_mutex, portMAX_DELAY);
+	for (int i = 1; i < SPOTIFY_MAX_ACCOUNTS && index < 0; i++) {
+		if (!accounts[i].in_use)
+			index = i;
+	}
+	if (index < 0) {
+		xSemaphoreGive(account_mutex);
+		ESP_LOGW(TAG, "No free account slot");
+		return -1;
+	}
+	spotify_account_t *account = &accounts[index];
+	xSemaphoreTake(account->token_mutex, portMAX_DELAY);
+	memset(&account->access, 0, sizeof(spotify_access_t));
+	snprintf(account->access.client_id, sizeof(account->access.client_id), "%s",
+			client_id ? client_id : CONFIG_SPOTIFY_CLIENT_ID);
+	snprintf(account->access.client_secret, sizeof(account->access.client_secret), "%s",
+			client_secret ? client_secret : CONFIG_SPOTIFY_CLIENT_SECRET);
+	snprintf(account->access.refresh_token, sizeof(account->access.refresh_token), "%s", refresh_token);
+	account->rate_limited_until = 0;
+	account->in_use = true;
+	spotify_storage_save_account(index, &account->access);
+	xSemaphoreGive(account->token_mutex);
+	xSemaphoreGive(account_mutex);
+	ESP_LOGI(TAG, "Added account %d", index);
+	return index;
+}
+
+esp_err_t spotify_account_remove(int index)
+{
+	// Account 0 is the configured one, and the active one is in use.
+	if (index <= 0 || index >= SPOTIFY_MAX_ACCOUNTS || index == active_account)
+		return ESP_ERR_INVALID_ARG;
+	xSemaphoreTake(account_mutex, portMAX_DELAY);
+	xSemaphoreTake(accounts[index].token_mutex, portMAX_DELAY);
+	bool in_use = accounts[index].in_use;
+	accounts[index].in_use = false;
+	memset(&accounts[index].access, 0, sizeof(spotify_access_t));
+	xSemaphoreGive(accounts[index].token_mutex);
+	xSemaphoreGive(account_mutex);
+	return in_use ? spotify_storage_erase_account(index) : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t spotify_account_select(int index)
+{
+	if (index < 0 || index >= SPOTIFY_MAX_ACCOUNTS)
+		return ESP_ERR_INVALID_ARG;
+	xSemaphoreTake(account_mutex, portMAX_DELAY);
+	if (!accounts[index].in_use) {
+		xSemaphoreGive(account_mutex);
+		return ESP_ERR_NOT_FOUND;
+	}
+	bool changed = active_account != index;
+	active_account = index;
+	xSemaphoreGive(account_mutex);
+	if (!changed)
+		return ESP_OK;
+	uint8_t saved = index;
+	spotify_storage_set_blob("account_active", &saved, sizeof(saved));
+
+	// The playback state belongs to the previous account; the next poll fills it in again.
+	xSemaphoreTake(now_playing_mutex, portMAX_DELAY);
+	now_playing_valid = false;
+	now_playing_live = false;
+	next_playing_valid = false;
+	device_volume = -1;
+	device_id[0] = '\0';
+	xSemaphoreGive(now_playing_mutex);
+	ESP_LOGI(TAG, "Switched to account %d", index);
+	// Gets a token for the new account ahead of the first request if it has none.
+	if (spotify_wait_for_network(0))
+		xTaskNotify(background_task, SPOTIFY_WORK_WARMUP, eSetBits);
+	return ESP_OK;
+}
+
+int spotify_account_get_active(void)
 {
-	if (!spotify_is_access_token_fresh())
-		if(!spotify_refresh_access_token())
-			return false;
+	return active_account;
+}
 
-	snprintf(authorization_header, 1024, "Bearer %s", spotify_access.access_token);
+uint32_t spotify_account_get_id(void)
+{
+	// FNV-1a of the refresh token: the same on every unit logged into the account.
+	uint32_t hash = 2166136261u;
+	xSemaphoreTake(accounts[active_account].token_mutex, portMAX_DELAY);
+	for (const char *p = accounts[active_account].access.refresh_token; *p; p++)
+		hash = (hash ^ (uint8_t)*p) * 16777619u;
+	xSemaphoreGive(accounts[active_account].token_mutex);
+	return hash;
+}
 
-	int content_length;
-	esp_http_client_config_t config = {
-		.host = SPOTIFY_HOST,
-        .transport_type = HTTP_TRANSPORT_OVER_SSL,
-		.event_handler = _http_event_handler,
-        .path = SPOTIFY_PLAYER_ENDPOINT,
+static esp_err_t _spotify_api_request(const char *path, esp_http_client_method_t method, const char *body,
+		spotify_priority_t priority, int timeout_ms, spotify_response_t *response)
+{
+	spotify_request_t request = {
+		.path = path,
+		.method = method,
+		.body = body,
+		.priority = priority,
+		.timeout_ms = timeout_ms,
 	};
-	esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_http_client_set_header(client, "Accept", "application/json");
-    esp_http_client_set_header(client, "Content-Type", "application/json");
-    esp_http_client_set_header(client, "Authorization", authorization_header);
-	esp_http_client_set_method(client, HTTP_METHOD_GET);
-	esp_err_t err = esp_http_client_open(client, 0);
+	return spotify_api_request(&request, response);
+}
+
+static void _spotify_publish(spotify_event_t *event, spotify_event_type_t type, uint32_t timestamp)
+{
+	event->type = type;
+	event->timestamp = timestamp;
+	spotify_events_publish(event);
+}
+
+/**
+ * Diffs snapshot against now_playing and publishes what changed. A seek is a jump of progress
+ * away from where the previous poll extrapolates to, within the same track. Call with
+ * now_playing_mutex held: that keeps the bus single-producer.
+ */
+static void _spotify_publish_changes(const now_playing_t *snapshot, bool track_changed)
+{
+	spotify_event_t event;
+	memset(&event, 0, sizeof(event));
+	if (track_changed) {
+		memcpy(event.track.track_id, snapshot->track_id, sizeof(event.track.track_id));
+		event.track.duration_ms = snapshot->duration_ms;
+		_spotify_publish(&event, SPOTIFY_EVENT_TRACK_CHANGED, snapshot->timestamp);
+	}
+	if (!now_playing_live || now_playing.is_playing != snapshot->is_playing) {
+		event.play_state.is_playing = snapshot->is_playing;
+		_spotify_publish(&event, SPOTIFY_EVENT_PLAY_STATE, snapshot->timestamp);
+	}
+	if (!track_changed) {
+		uint32_t expected = now_playing.progress_ms;
+		if (now_playing.is_playing)
+			expected += snapshot->timestamp - now_playing.timestamp;
+		int32_t drift = (int32_t)(snapshot->progress_ms - expected);
+		if (drift > (int32_t)SPOTIFY_SEEK_THRESHOLD_MS || drift < -(int32_t)SPOTIFY_SEEK_THRESHOLD_MS) {
+			event.seek.expected_ms = expected;
+			event.seek.progress_ms = snapshot->progress_ms;
+			_spotify_publish(&event, SPOTIFY_EVENT_SEEK, snapshot->timestamp);
+		}
+	}
+}
+
+static void _spotify_update_device(const player_details_t *player_details)
+{
+	spotify_event_t event;
+	memset(&event, 0, sizeof(event));
+	uint32_t now = time_millis();
+	xSemaphoreTake(now_playing_mutex, portMAX_DELAY);
+	if (strcmp(device_id, player_details->device.id) != 0) {
+		snprintf(device_id, sizeof(device_id), "%s", player_details->device.id);
+		memcpy(event.device.device_id, device_id, sizeof(event.device.device_id));
+		_spotify_publish(&event, SPOTIFY_EVENT_DEVICE, now);
+	}
+	if (device_volume != player_details->device.volume_percent) {
+		device_volume = player_details->device.volume_percent;
+		event.volume.volume_percent = device_volume;
+		_spotify_publish(&event, SPOTIFY_EVENT_VOLUME, now);
+	}
+	xSemaphoreGive(now_playing_mutex);
+}
+
+static void _spotify_apply_now_playing(const now_playing_t *snapshot, bool local);
+
+static void _spotify_update_now_playing(const currently_playing_t *currently_playing)
+{
+	now_playing_t snapshot;
+	memset(&snapshot, 0, sizeof(snapshot));
+	snprintf(snapshot.track_name, sizeof(snapshot.track_name), "%s", currently_playing->track_name ? currently_playing->track_name : "");
+	const char *track_id = currently_playing->track_uri ? strrchr(currently_playing->track_uri, ':') : NULL;
+	snprintf(snapshot.track_id, sizeof(snapshot.track_id), "%s", track_id ? track_id + 1 : "");
+	snapshot.num_artists = currently_playing->num_artists;
+	for (int i = 0; i < snapshot.num_artists; i++)
+		snprintf(snapshot.artists[i], sizeof(snapshot.artists[i]), "%s", currently_playing->artists[i].artist_name);
+	if (currently_playing->album.num_images > 0)
+		snprintf(snapshot.album_image_url, sizeof(snapshot.album_image_url), "%s",
+				currently_playing->album.album_images[currently_playing->album.num_images - 1].url);
+	snapshot.is_playing = currently_playing->is_playing;
+	snapshot.progress_ms = currently_playing->progress_ms;
+	snapshot.duration_ms = currently_playing->duration_ms;
+	snapshot.timestamp = time_millis();
+	_spotify_apply_now_playing(&snapshot, true);
+	spotify_lan_publish(&snapshot);
+}
+
+void spotify_set_now_playing(const now_playing_t *snapshot)
+{
+	_spotify_apply_now_playing(snapshot, false);
+}
+
+/* local: snapshot comes from our own poll rather than from the LAN leader */
+static void _spotify_apply_now_playing(const now_playing_t *snapshot, bool local)
+{
+	xSemaphoreTake(now_playing_mutex, portMAX_DELAY);
+	bool track_changed = !now_playing_live || strcmp(now_playing.track_id, snapshot->track_id) != 0;
+	_spotify_publish_changes(snapshot, track_changed);
+	// Only write flash when something a warm boot would show actually changed.
+	bool persist = !now_playing_valid || strcmp(now_playing.track_id, snapshot->track_id) != 0
+			|| now_playing.is_playing != snapshot->is_playing;
+	now_playing = *snapshot;
+	now_playing_valid = true;
+	now_playing_live = true;
+	if (track_changed)
+		next_playing_valid = false;
+	xSemaphoreGive(now_playing_mutex);
+
+	if (persist)
+		spotify_storage_save_now_playing(snapshot);
+	// A new track means the previous one just became a play in the history. Followers leave
+	// both to the leader's snapshots: they do not call Spotify.
+	if (local && track_changed && snapshot->track_id[0] != '\0')
+		xTaskNotify(background_task, SPOTIFY_WORK_PREFETCH | SPOTIFY_WORK_HISTORY, eSetBits);
+}
+
+bool spotify_get_now_playing(now_playing_t *snapshot)
+{
+	xSemaphoreTake(now_playing_mutex, portMAX_DELAY);
+	bool valid = now_playing_valid;
+	if (valid)
+		*snapshot = now_playing;
+	// Extrapolate progress from the last poll. Past the end of the track, switch to the
+	// prefetched next one right away: the following poll only has to confirm it.
+	if (valid && now_playing_live && now_playing.is_playing) {
+		uint32_t now = time_millis();
+		uint32_t progress = now_playing.progress_ms + (now - now_playing.timestamp);
+		if (progress >= now_playing.duration_ms && next_playing_valid) {
+			*snapshot = next_playing;
+			snapshot->is_playing = true;
+			progress -= now_playing.duration_ms;
+		}
+		snapshot->progress_ms = progress < snapshot->duration_ms ? progress : snapshot->duration_ms;
+		snapshot->timestamp = now;
+	}
+	xSemaphoreGive(now_playing_mutex);
+	return valid;
+}
+
+bool spotify_get_player_details(player_details_t *player_details)
+{
+	spotify_response_t response;
 	int req_status = 0;
-	int data_read = 0;
 	cJSON* response_json = NULL;
-	if (err != ESP_OK) {
-		ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+	if (!spotify_lan_should_poll())
+		return false;
+	esp_err_t err = _spotify_api_request(SPOTIFY_PLAYER_ENDPOINT, HTTP_METHOD_GET, NULL,
+			SPOTIFY_PRIORITY_POLL, 0, &response);
+	if (err != ESP_OK || response.data_len <= 0) {
+		ESP_LOGE(TAG, "Failed to read response: %s", esp_err_to_name(err));
 		req_status = -1;
 		goto cleanup;
-	} else {
-		content_length = esp_http_client_fetch_headers(client);
-		if (content_length < 0) {
-			ESP_LOGE(TAG, "HTTP client fetch headers failed");
-		} else {
-			data_read = esp_http_client_read_response(client, local_response_buf, RESPONSE_BUF_SIZE);
-			if (data_read > 0) {
-				ESP_LOGD(TAG, "HTTP GET Status = %d, content_length = %d",
-						esp_http_client_get_status_code(client),
-						esp_http_client_get_content_length(client));
-			} else {
-				ESP_LOGE(TAG, "Failed to read response");
-				req_status = -1;
-				goto cleanup;
-			}
-		}
 	}
-	esp_http_client_close(client);
-
-	if (data_read > 0) {
-		response_json = cJSON_Parse(local_response_buf);
-		bool error = _check_response_error(response_json);
-		if (error==true)
-			goto cleanup;
-		cJSON* device = cJSON_GetObjectItem(response_json, "device");
-		if (device != NULL)
-			goto cleanup;
-		player_details->device.id = cJSON_GetObjectItem(device, "id")->valuestring;
-		player_details->device.name = cJSON_GetObjectItem(device, "name")->valuestring;
-		player_details->device.type = cJSON_GetObjectItem(device, "type")->valuestring;
-		player_details->device.is_active = cJSON_IsTrue(cJSON_GetObjectItem(device, "is_active"));
-		player_details->device.is_restricted = cJSON_IsTrue(cJSON_GetObjectItem(device, "is_restricted"));
-		player_details->device.is_private_session = cJSON_IsTrue(cJSON_GetObjectItem(device, "is_private_session"));
-		player_details->device.volume_percent = cJSON_GetObjectItem(device, "volume_percent")->valueint;
-		player_details->progress_ms = cJSON_GetObjectItem(response_json, "progress_ms")->valueint;
-		player_details->is_playing = cJSON_IsTrue(cJSON_GetObjectItem(response_json, "is_playing"));
-		player_details->shuffle_state = cJSON_IsTrue(cJSON_GetObjectItem(response_json, "shuffle_state"));
-		char* repeat_state = cJSON_GetObjectItem(response_json, "repeat_state")->valuestring;
-		if (strcmp(repeat_state, "off") == 0) {
-			player_details->repeat_state = REPEAT_OFF;
-		} else if (strcmp(repeat_state, "context") == 0) {
-			player_details->repeat_state = REPEAT_CONTEXT;
-		} else {
-			player_details->repeat_state = REPEAT_TRACK;
-		}
+	ESP_LOGD(TAG, "HTTP GET Status = %d, content_length = %d", response.status_code, response.data_len);
+
+	response_json = cJSON_Parse(response.data);
+	bool error = _check_response_error(response_json);
+	if (error==true)
+		goto cleanup;
+	cJSON* device = cJSON_GetObjectItem(response_json, "device");
+	if (device == NULL)
+		goto cleanup;
+	// Copied out: the strings die with response_json below.
+	cJSON *id = cJSON_GetObjectItem(device, "id");
+	cJSON *name = cJSON_GetObjectItem(device, "name");
+	cJSON *type = cJSON_GetObjectItem(device, "type");
+	snprintf(player_details->device.id, sizeof(player_details->device.id), "%s",
+			cJSON_IsString(id) ? id->valuestring : "");
+	snprintf(player_details->device.name, sizeof(player_details->device.name), "%s",
+			cJSON_IsString(name) ? name->valuestring : "");
+	snprintf(player_details->device.type, sizeof(player_details->device.type), "%s",
+			cJSON_IsString(type) ? type->valuestring : "");
+	player_details->device.is_active = cJSON_IsTrue(cJSON_GetObjectItem(device, "is_active"));
+	player_details->device.is_restricted = cJSON_IsTrue(cJSON_GetObjectItem(device, "is_restricted"));
+	player_details->device.is_private_session = cJSON_IsTrue(cJSON_GetObjectItem(device, "is_private_session"));
+	cJSON *volume_percent = cJSON_GetObjectItem(device, "volume_percent");
+	player_details->device.volume_percent = cJSON_IsNumber(volume_percent) ? volume_percent->valueint : 0;
+	cJSON *progress_ms = cJSON_GetObjectItem(response_json, "progress_ms");
+	player_details->progress_ms = cJSON_IsNumber(progress_ms) ? progress_ms->valueint : 0;
+	player_details->is_playing = cJSON_IsTrue(cJSON_GetObjectItem(response_json, "is_playing"));
+	player_details->shuffle_state = cJSON_IsTrue(cJSON_GetObjectItem(response_json, "shuffle_state"));
+	cJSON *repeat = cJSON_GetObjectItem(response_json, "repeat_state");
+	const char *repeat_state = cJSON_IsString(repeat) ? repeat->valuestring : "off";
+	if (strcmp(repeat_state, "off") == 0) {
+		player_details->repeat_state = REPEAT_OFF;
+	} else if (strcmp(repeat_state, "context") == 0) {
+		player_details->repeat_state = REPEAT_CONTEXT;
+	} else {
+		player_details->repeat_state = REPEAT_TRACK;
 	}
+	_spotify_update_device(player_details);
 cleanup:
 	if(response_json) cJSON_Delete(response_json);
-	memset(local_response_buf, 0, RESPONSE_BUF_SIZE);
-	memset(authorization_header, 0, 1024);
-	esp_http_client_cleanup(client);
-    return !(req_status < 0);
+	spotify_pool_release(&response);
+	return !(req_status < 0);
 }
 
 bool spotify_get_current_playing(currently_playing_t *currently_playing)
 {
-	if (!spotify_is_access_token_fresh())
-		if(!spotify_refresh_access_token())
-			return false;
-
-	snprintf(authorization_header, 1024, "Bearer %s", spotify_access.access_token);
-
-	int content_length;
-	esp_http_client_config_t config = {
-		.host = SPOTIFY_HOST,
-        .transport_type = HTTP_TRANSPORT_OVER_SSL,
-		.event_handler = _http_event_handler,
-        .path = SPOTIFY_CURRENTLY_PLAYING_ENDPOINT,
-		.timeout_ms = 3000,
-	};
-	
-	esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_http_client_set_header(client, "Accept", "application/json");
-    esp_http_client_set_header(client, "Content-Type", "application/json");
-    esp_http_client_set_header(client, "Authorization", authorization_header);
-	esp_http_client_set_method(client, HTTP_METHOD_GET);
-	esp_err_t err = esp_http_client_open(client, 0);
+	spotify_response_t response;
 	int req_status = 0;
-	int data_read = 0;
 	cJSON* response_json = NULL;
-	if (err != ESP_OK) { 
-		ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+	// Another unit on the LAN polls for this account; its snapshots keep now_playing current.
+	if (!spotify_lan_should_poll())
+		return false;
+	esp_err_t err = _spotify_api_request(SPOTIFY_CURRENTLY_PLAYING_ENDPOINT, HTTP_METHOD_GET, NULL,
+			SPOTIFY_PRIORITY_POLL, 3000, &response);
+	if (response.aborted) {
+		ESP_LOGD(TAG, "Poll preempted by a user command");
 		req_status = -1;
 		goto cleanup;
-	} else { 
-		content_length = esp_http_client_fetch_headers(client); 
-		if (content_length < 0) { 
-			ESP_LOGE(TAG, "HTTP client fetch headers failed");
-			req_status = -1;
-			goto cleanup;
-		} else { 
-			data_read = esp_http_client_read_response(client, local_response_buf, RESPONSE_BUF_SIZE); 
-			if (data_read > 0) { 
-				ESP_LOGD(TAG, "HTTP GET Status = %d, content_length = %d", 
-						esp_http_client_get_status_code(client), 
-						esp_http_client_get_content_length(client));
-
-				response_json = cJSON_Parse(local_response_buf);
-				bool error = _check_response_error(response_json);
-				if (error == true) {
-					ESP_LOGD(TAG, "Found Some Error");
-					goto cleanup;
-				}
-				cJSON* timestamp = cJSON_GetObjectItem(response_json, "timestamp");
-				if (timestamp == NULL) {
-					ESP_LOGW(TAG, "No timestamp found");
-					goto cleanup;
-				}
-				currently_playing->is_playing = timestamp->valueint;
-				currently_playing->is_playing = cJSON_IsTrue(cJSON_GetObjectItem(response_json, "is_playing"));
-				currently_playing->progress_ms = cJSON_GetObjectItem(response_json, "progress_ms")->valueint;
-				cJSON* item = cJSON_GetObjectItem(response_json, "item");
-				if (item == NULL) {
-					ESP_LOGW(TAG, "No item Found");
-					goto cleanup;
-				}
-				currently_playing->duration_ms = cJSON_GetObjectItem(item, "duration_ms")->valueint;
-				currently_playing->track_name = cJSON_GetObjectItem(item, "name")->valuestring;
-				currently_playing->track_uri = cJSON_GetObjectItem(item, "uri")->valuestring;
-
-				cJSON* current_element = NULL;
-				cJSON* artists = cJSON_GetObjectItem(item, "artists");
-				if (artists != NULL) {
-					currently_playing->num_artists = cJSON_GetArraySize(artists);
-					if (currently_playing->num_artists > SPOTIFY_MAX_NUM_ARTISTS)
-						currently_playing->num_artists = SPOTIFY_MAX_NUM_ARTISTS;
-
-					for (int i = 0; i < currently_playing->num_artists; i++) {
-						current_element = cJSON_GetArrayItem(artists, i);
-						currently_playing->artists[i].artist_name = cJSON_GetObjectItem(current_element, "name")->valuestring;
-						currently_playing->artists[i].artist_uri = cJSON_GetObjectItem(current_element, "uri")->valuestring;
-					}
-				}
-				cJSON* album = cJSON_GetObjectItem(item, "album");
-				if (album != NULL) {
-					current_element = NULL;
-					cJSON* images = cJSON_GetObjectItem(album, "images");
-					currently_playing->album.num_images = cJSON_GetArraySize(images);
-					if (currently_playing->album.num_images > SPOTIFY_NUM_ALBUM_IMAGES)
-						currently_playing->album.num_images = SPOTIFY_NUM_ALBUM_IMAGES;
-
-					for (int i = 0; i < currently_playing->album.num_images; i++) {
-						current_element = cJSON_GetArrayItem(images, i);
-						currently_playing->album.album_images[i].height = cJSON_GetObjectItem(current_element, "height")->valueint;
-						currently_playing->album.album_images[i].width = cJSON_GetObjectItem(current_element, "width")->valueint;
-						currently_playing->album.album_images[i].url = cJSON_GetObjectItem(current_element, "url")->valuestring;
-					}
-				}	
-			} else { 
-				ESP_LOGE(TAG, "Failed to read response");
-				req_status = -1;
-				goto cleanup;
-			}
+	}
+	if (err != ESP_OK || response.data_len <= 0) {
+		ESP_LOGE(TAG, "Failed to read response: %s", esp_err_to_name(err));
+		req_status = -1;
+		goto cleanup;
+	}
+	ESP_LOGD(TAG, "HTTP GET Status = %d, content_length = %d", response.status_code, response.data_len);
+
+	response_json = cJSON_Parse(response.data);
+	bool error = _check_response_error(response_json);
+	if (error == true) {
+		ESP_LOGD(TAG, "Found Some Error");
+		goto cleanup;
+	}
+	cJSON* timestamp = cJSON_GetObjectItem(response_json, "timestamp");
+	if (timestamp == NULL) {
+		ESP_LOGW(TAG, "No timestamp found");
+		goto cleanup;
+	}
+	currently_playing->is_playing = timestamp->valueint;
+	currently_playing->is_playing = cJSON_IsTrue(cJSON_GetObjectItem(response_json, "is_playing"));
+	currently_playing->progress_ms = cJSON_GetObjectItem(response_json, "progress_ms")->valueint;
+	cJSON* item = cJSON_GetObjectItem(response_json, "item");
+	if (item == NULL) {
+		ESP_LOGW(TAG, "No item Found");
+		goto cleanup;
+	}
+	currently_playing->duration_ms = cJSON_GetObjectItem(item, "duration_ms")->valueint;
+	currently_playing->track_name = cJSON_GetObjectItem(item, "name")->valuestring;
+	currently_playing->track_uri = cJSON_GetObjectItem(item, "uri")->valuestring;
+
+	currently_playing->num_artists = 0;
+	currently_playing->album.num_images = 0;
+	cJSON* current_element = NULL;
+	cJSON* artists = cJSON_GetObjectItem(item, "artists");
+	if (artists != NULL) {
+		currently_playing->num_artists = cJSON_GetArraySize(artists);
+		if (currently_playing->num_artists > SPOTIFY_MAX_NUM_ARTISTS)
+			currently_playing->num_artists = SPOTIFY_MAX_NUM_ARTISTS;
+
+		for (int i = 0; i < currently_playing->num_artists; i++) {
+			current_element = cJSON_GetArrayItem(artists, i);
+			currently_playing->artists[i].artist_name = cJSON_GetObjectItem(current_element, "name")->valuestring;
+			currently_playing->artists[i].artist_uri = cJSON_GetObjectItem(current_element, "uri")->valuestring;
+		}
+	}
+	cJSON* album = cJSON_GetObjectItem(item, "album");
+	if (album != NULL) {
+		current_element = NULL;
+		cJSON* images = cJSON_GetObjectItem(album, "images");
+		currently_playing->album.num_images = cJSON_GetArraySize(images);
+		if (currently_playing->album.num_images > SPOTIFY_NUM_ALBUM_IMAGES)
+			currently_playing->album.num_images = SPOTIFY_NUM_ALBUM_IMAGES;
+
+		for (int i = 0; i < currently_playing->album.num_images; i++) {
+			current_element = cJSON_GetArrayItem(images, i);
+			currently_playing->album.album_images[i].height = cJSON_GetObjectItem(current_element, "height")->valueint;
+			currently_playing->album.album_images[i].width = cJSON_GetObjectItem(current_element, "width")->valueint;
+			currently_playing->album.album_images[i].url = cJSON_GetObjectItem(current_element, "url")->valuestring;
 		}
 	}
+	_spotify_update_now_playing(currently_playing);
 
 cleanup:
-	esp_http_client_close(client); 
 	if(response_json) cJSON_Delete(response_json);
-	memset(local_response_buf, 0, RESPONSE_BUF_SIZE);
-	memset(authorization_header, 0, 1024);
-	esp_http_client_cleanup(client);
+	spotify_pool_release(&response);
 	return !(req_status < 0);
 }
 
 bool spotify_play(const char *context_uri, int queue_pos, int position_ms, const char *device_id)
 {
-	if (!spotify_is_access_token_fresh())
-		if(!spotify_refresh_access_token())
-			return false;
-
-	snprintf(authorization_header, 1024, "Bearer %s", spotify_access.access_token);
-
-	int req_status = 0;
-	esp_http_client_config_t config = {
-		.host = SPOTIFY_HOST,
-        .transport_type = HTTP_TRANSPORT_OVER_SSL,
-		.event_handler = _http_event_handler,
-        .path = SPOTIFY_PLAY_ENDPOINT,
-	};
-	esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_http_client_set_header(client, "Accept", "application/json");
-    esp_http_client_set_header(client, "Content-Type", "application/json");
-    esp_http_client_set_header(client, "Authorization", authorization_header);
-	esp_http_client_set_method(client, HTTP_METHOD_PUT);
+	if (context_uri == NULL || context_uri[0] == '\0')
+		return false;
 
 	cJSON* data = cJSON_CreateObject();
-
-	if (context_uri[0] == '\0' || context_uri == NULL) {
-		req_status = -1;
-		goto cleanup;
-	}
 	cJSON_AddStringToObject(data, "context_uri", context_uri);
 	if (queue_pos != 0) {
 		cJSON* offset = cJSON_CreateObject();
@@ -412,95 +867,134 @@ bool spotify_play(const char *context_uri, int queue_pos, int position_ms, const
 		cJSON_AddItemToObject(data, "offset", offset);
 	}
 	cJSON_AddNumberToObject(data, "position_ms", position_ms);
-	if (device_id != NULL)
+	if (device_id != NULL && device_id[0] != '\0')
 		cJSON_AddStringToObject(data, "device_id", device_id);
-	char *post_data = cJSON_Print(data);
-	int data_len = strlen(post_data);
-	esp_http_client_set_post_field(client, post_data, data_len);
-	esp_err_t err = esp_http_client_perform(client);
-	if (err != ESP_OK) {
-		req_status = -1;
-		goto cleanup;
-	}
+	char *post_data = cJSON_PrintUnformatted(data);
 	cJSON_Delete(data);
-	free(post_data);
 
-cleanup:
-	memset(authorization_header, 0, 1024);
-	esp_http_client_cleanup(client);
-	return !(req_status < 0);
+	spotify_response_t response;
+	esp_err_t err = _spotify_api_request(SPOTIFY_PLAY_ENDPOINT, HTTP_METHOD_PUT, post_data,
+			SPOTIFY_PRIORITY_COMMAND, 0, &response);
+	spotify_pool_release(&response);
+	free(post_data);
+	return err == ESP_OK;
 }
 
 void spotify_pause()
 {
-	if (!spotify_is_access_token_fresh())
-		spotify_refresh_access_token();
-
-	snprintf(authorization_header, 1024, "Bearer %s", spotify_access.access_token);
-
-	esp_http_client_config_t config = {
-		.host = SPOTIFY_HOST,
-        .transport_type = HTTP_TRANSPORT_OVER_SSL,
-		.event_handler = _http_event_handler,
-        .path = SPOTIFY_PAUSE_ENDPOINT,
-	};
-	esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_http_client_set_header(client, "Accept", "application/json");
-    esp_http_client_set_header(client, "Content-Type", "application/json");
-    esp_http_client_set_header(client, "Authorization", authorization_header);
-	esp_http_client_set_method(client, HTTP_METHOD_PUT);
-
-	esp_err_t err = esp_http_client_perform(client);
+	spotify_response_t response;
+	esp_err_t err = _spotify_api_request(SPOTIFY_PAUSE_ENDPOINT, HTTP_METHOD_PUT, NULL,
+			SPOTIFY_PRIORITY_CRITICAL, 0, &response);
 	if (err == ESP_OK) {
-		ESP_LOGD(TAG, "HTTP GET Status = %d, content_length = %d",
-				esp_http_client_get_status_code(client),
-				esp_http_client_get_content_length(client));
+		ESP_LOGD(TAG, "HTTP PUT Status = %d, content_length = %d", response.status_code, response.data_len);
 	} else {
-		ESP_LOGW(TAG, "HTTP GET request failed: %s", esp_err_to_name(err));
+		ESP_LOGW(TAG, "HTTP PUT request failed: %s", esp_err_to_name(err));
 	}
-	
-	memset(authorization_header, 0, 1024);
-	esp_http_client_cleanup(client);
+	spotify_pool_release(&response);
 }
 
 void spotify_change_volume(int volume_percent, const char *device_id)
 {
-	if (!spotify_is_access_token_fresh())
-		spotify_refresh_access_token();
-
-	snprintf(authorization_header, 1024, "Bearer %s", spotify_access.access_token);
 	char endpoint[1024];
-	if (device_id == NULL) {
+	if (device_id == NULL || device_id[0] == '\0') {
    		snprintf(endpoint, 1024, "%s?volume_percent=%d", SPOTIFY_VOLUME_ENDPOINT, volume_percent);
 	} else {
    		snprintf(endpoint, 1024, "%s?volume_percent=%d&device_id=%s", SPOTIFY_VOLUME_ENDPOINT, volume_percent, device_id);
 	}
 
-	esp_http_client_config_t config = {
-		.host = SPOTIFY_HOST,
-        .transport_type = HTTP_TRANSPORT_OVER_SSL,
-		.event_handler = _http_event_handler,
-        .path = endpoint,
-		// .user_data = local_response_buf,
-	};
-	esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_http_client_set_header(client, "Accept", "application/json");
-    esp_http_client_set_header(client, "Content-Type", "application/json");
-    esp_http_client_set_header(client, "Authorization", authorization_header);
-	esp_http_client_set_method(client, HTTP_METHOD_PUT);
-	esp_err_t err = esp_http_client_perform(client);
+	spotify_response_t response;
+	esp_err_t err = _spotify_api_request(endpoint, HTTP_METHOD_PUT, NULL,
+			SPOTIFY_PRIORITY_CRITICAL, 0, &response);
+	if (err == ESP_OK) {
+		ESP_LOGD(TAG, "HTTP PUT Status = %d, content_length = %d", response.status_code, response.data_len);
+	} else {
+		ESP_LOGW(TAG, "HTTP PUT request failed: %s", esp_err_to_name(err));
+	}
+	spotify_pool_release(&response);
+}
+
+void spotify_seek(int position_ms, const char *device_id)
+{
+	char endpoint[1024];
+	if (device_id == NULL || device_id[0] == '\0') {
+		snprintf(endpoint, 1024, "%s?position_ms=%d", SPOTIFY_SEEK_ENDPOINT, position_ms);
+	} else {
+		snprintf(endpoint, 1024, "%s?position_ms=%d&device_id=%s", SPOTIFY_SEEK_ENDPOINT, position_ms, device_id);
+	}
+
+	spotify_response_t response;
+	esp_err_t err = _spotify_api_request(endpoint, HTTP_METHOD_PUT, NULL,
+			SPOTIFY_PRIORITY_CRITICAL, 0, &response);
 	if (err == ESP_OK) {
-		ESP_LOGD(TAG, "HTTP GET Status = %d, content_length = %d",
-				esp_http_client_get_status_code(client),
-				esp_http_client_get_content_length(client));
+		ESP_LOGD(TAG, "HTTP PUT Status = %d, content_length = %d", response.status_code, response.data_len);
 	} else {
-		ESP_LOGW(TAG, "HTTP GET request failed: %s", esp_err_to_name(err));
-	}
-	// cJSON *response_json = cJSON_Parse(local_response_buf);
-	// char* msg = cJSON_Print(response_json);
-	// printf("%s\n", msg);
-	// cJSON_Delete(response_json);
-	// free(msg);
-	memset(authorization_header, 0, 1024);
-	esp_http_client_cleanup(client);
-}
\ No newline at end of file
+		ESP_LOGW(TAG, "HTTP PUT request failed: %s", esp_err_to_name(err));
+	}
+	spotify_pool_release(&response);
+}
+
+void spotify_get_command_latency_stats(spotify_latency_stats_t *stats)
+{
+	spotify_pool_get_latency_stats(stats);
+}
+
+#if CONFIG_DEBUG_SPOTIFY_CLIENT > 0
+static volatile bool bench_polling = false;
+
+static void _bench_poll_task(void *pvParameter)
+{
+	while (bench_polling) {
+		spotify_response_t response;
+		_spotify_api_request(SPOTIFY_CURRENTLY_PLAYING_ENDPOINT, HTTP_METHOD_GET, NULL,
+				SPOTIFY_PRIORITY_POLL, 0, &response);
+		spotify_pool_release(&response);
+	}
+	xSemaphoreGive((SemaphoreHandle_t)pvParameter);
+	vTaskDelete(NULL);
+}
+
+void spotify_latency_benchmark(void)
+{
+	SemaphoreHandle_t stopped = xSemaphoreCreateCounting(SPOTIFY_POOL_SIZE, 0);
+	if (stopped == NULL)
+		return;
+	for (int preempt = 1; preempt >= 0; preempt--) {
+		spotify_pool_set_preemption(preempt);
+		bench_polling = true;
+		for (int i = 0; i < SPOTIFY_POOL_SIZE; i++)
+			xTaskCreate(&_bench_poll_task, "spotify_bench", SPOTIFY_BACKGROUND_TASK_STACK, stopped,
+					SPOTIFY_BACKGROUND_TASK_PRIORITY, NULL);
+		uint32_t worst_us = 0;
+		uint64_t total_us = 0;
+		int ok = 0;
+		for (int round = 0; round < SPOTIFY_LATENCY_BENCH_ROUNDS; round++) {
+			// Land at a random point of the polls in flight, like a button press would.
+			vTaskDelay(pdMS_TO_TICKS(100 + esp_random() % 400));
+			spotify_response_t response;
+			uint32_t start = time_micros();
+			// A GET changes nothing on the account but takes the same path as pause or volume.
+			esp_err_t err = _spotify_api_request(SPOTIFY_PLAYER_ENDPOINT, HTTP_METHOD_GET, NULL,
+					SPOTIFY_PRIORITY_CRITICAL, 0, &response);
+			uint32_t elapsed_us = time_micros() - start;
+			spotify_pool_release(&response);
+			total_us += elapsed_us;
+			if (elapsed_us > worst_us)
+				worst_us = elapsed_us;
+			if (err == ESP_OK)
+				ok++;
+		}
+		bench_polling = false;
+		for (int i = 0; i < SPOTIFY_POOL_SIZE; i++)
+			xSemaphoreTake(stopped, portMAX_DELAY);
+		ESP_LOGI(TAG, "Command latency %s poll preemption: worst %u ms, mean %u ms (%d/%d ok)",
+				preempt ? "with" : "without", worst_us / 1000,
+				(uint32_t)(total_us / SPOTIFY_LATENCY_BENCH_ROUNDS / 1000), ok, SPOTIFY_LATENCY_BENCH_ROUNDS);
+	}
+	spotify_pool_set_preemption(true);
+	vSemaphoreDelete(stopped);
+}
+#else
+void spotify_latency_benchmark(void)
+{
+}
+#endif
\ No newline at end of file
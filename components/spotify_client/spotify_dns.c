@@ -0,0 +1,333 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "lwip/dns.h"
+
+#include "spotify_dns.h"
+#include "time_manager.h"
+
+#define DNS_PORT            53
+#define DNS_HEADER_SIZE     12
+#define DNS_MAX_PACKET_SIZE 512
+#define DNS_FLAG_RD         0x0100
+#define DNS_FLAG_QR         0x8000
+#define DNS_RCODE_MASK      0x000F
+#define DNS_TYPE_A          1
+#define DNS_CLASS_IN        1
+
+typedef struct spotify_dns_entry_t
+{
+	const char *host;
+	uint32_t addr;
+	uint32_t resolved_ms;       /* last successful lookup, the max-stale limit counts from here */
+	uint32_t ttl_ms;
+	uint32_t next_attempt_ms;   /* when the refresh task resolves it again */
+	bool refreshing;
+} spotify_dns_entry_t;
+
+static const char *TAG = "SpotifyDns";
+static spotify_dns_entry_t entries[SPOTIFY_DNS_MAX_HOSTS];
+static SemaphoreHandle_t dns_mutex = NULL;
+static TaskHandle_t dns_task = NULL;
+
+
+static uint16_t _dns_read_u16(const uint8_t *p)
+{
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t _dns_read_u32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* returns the offset right after the (possibly compressed) name starting at offset, or -1 */
+static int _dns_skip_name(const uint8_t *packet, int length, int offset)
+{
+	while (offset < length) {
+		uint8_t label = packet[offset];
+		if (label == 0)
+			return offset + 1;
+		if ((label & 0xC0) == 0xC0)
+			return offset + 2 <= length ? offset + 2 : -1;
+		offset += label + 1;
+	}
+	return -1;
+}
+
+static int _dns_build_query(uint8_t *packet, uint16_t id, const char *host)
+{
+	memset(packet, 0, DNS_HEADER_SIZE);
+	packet[0] = id >> 8;
+	packet[1] = id & 0xFF;
+	packet[2] = DNS_FLAG_RD >> 8;
+	packet[5] = 1; /* one question */
+
+	int offset = DNS_HEADER_SIZE;
+	const char *label = host;
+	while (*label) {
+		const char *dot = strchr(label, '.');
+		size_t label_len = dot ? (size_t)(dot - label) : strlen(label);
+		if (label_len == 0 || label_len > 63 || offset + label_len + 6 > DNS_MAX_PACKET_SIZE)
+			return -1;
+		packet[offset++] = label_len;
+		memcpy(&packet[offset], label, label_len);
+		offset += label_len;
+		label += label_len;
+		if (*label == '.')
+			label++;
+	}
+	packet[offset++] = 0;
+	packet[offset++] = 0;
+	packet[offset++] = DNS_TYPE_A;
+	packet[offset++] = 0;
+	packet[offset++] = DNS_CLASS_IN;
+	return offset;
+}
+
+/**
+ * lwIP's getaddrinfo keeps the TTL to itself, so ask the configured DNS server directly.
+ * The TTL reported is the smallest one along the CNAME chain leading to the first A record.
+ */
+static esp_err_t _dns_query(const char *host, uint32_t *addr, uint32_t *ttl_sec)
+{
+	const ip_addr_t *server = dns_getserver(0);
+	if (server == NULL || IP_GET_TYPE(server) != IPADDR_TYPE_V4 || ip4_addr_get_u32(ip_2_ip4(server)) == 0)
+		return ESP_ERR_INVALID_STATE;
+
+	uint8_t packet[DNS_MAX_PACKET_SIZE];
+	uint16_t id = esp_random() & 0xFFFF;
+	int length = _dns_build_query(packet, id, host);
+	if (length < 0)
+		return ESP_ERR_INVALID_ARG;
+
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0)
+		return ESP_FAIL;
+	struct timeval timeout = {
+		.tv_sec = SPOTIFY_DNS_QUERY_TIMEOUT_MS / 1000,
+		.tv_usec = (SPOTIFY_DNS_QUERY_TIMEOUT_MS % 1000) * 1000,
+	};
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	struct sockaddr_in dest = {
+		.sin_family = AF_INET,
+		.sin_port = htons(DNS_PORT),
+		.sin_addr.s_addr = ip4_addr_get_u32(ip_2_ip4(server)),
+	};
+
+	esp_err_t err = ESP_FAIL;
+	if (sendto(sock, packet, length, 0, (struct sockaddr*)&dest, sizeof(dest)) != length)
+		goto cleanup;
+	length = recv(sock, packet, sizeof(packet), 0);
+	if (length < DNS_HEADER_SIZE || _dns_read_u16(&packet[0]) != id)
+		goto cleanup;
+
+	uint16_t flags = _dns_read_u16(&packet[2]);
+	uint16_t questions = _dns_read_u16(&packet[4]);
+	uint16_t answers = _dns_read_u16(&packet[6]);
+	if (!(flags & DNS_FLAG_QR) || (flags & DNS_RCODE_MASK) != 0 || answers == 0)
+		goto cleanup;
+
+	int offset = DNS_HEADER_SIZE;
+	for (int i = 0; i < questions && offset >= 0; i++) {
+		offset = _dns_skip_name(packet, length, offset);
+		if (offset >= 0)
+			offset += 4;
+	}
+	uint32_t min_ttl = UINT32_MAX;
+	for (int i = 0; i < answers && offset >= 0; i++) {
+		offset = _dns_skip_name(packet, length, offset);
+		if (offset < 0 || offset + 10 > length)
+			break;
+		uint16_t type = _dns_read_u16(&packet[offset]);
+		uint16_t class = _dns_read_u16(&packet[offset + 2]);
+		uint32_t ttl = _dns_read_u32(&packet[offset + 4]);
+		uint16_t rdlength = _dns_read_u16(&packet[offset + 8]);
+		offset += 10;
+		if (offset + rdlength > length)
+			break;
+		if (ttl < min_ttl)
+			min_ttl = ttl;
+		if (type == DNS_TYPE_A && class == DNS_CLASS_IN && rdlength == 4) {
+			memcpy(addr, &packet[offset], 4);
+			*ttl_sec = min_ttl;
+			err = ESP_OK;
+			break;
+		}
+		offset += rdlength;
+	}
+cleanup:
+	close(sock);
+	return err;
+}
+
+static esp_err_t _dns_lookup(const char *host, uint32_t *addr, uint32_t *ttl_sec)
+{
+	esp_err_t err = _dns_query(host, addr, ttl_sec);
+	if (err == ESP_OK)
+		return ESP_OK;
+
+	// No usable answer from the direct query: let lwIP resolve it and assume a short TTL.
+	ESP_LOGD(TAG, "Direct query for %s failed (%s), falling back to getaddrinfo", host, esp_err_to_name(err));
+	struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res = NULL;
+	if (getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL)
+		return ESP_FAIL;
+	*addr = ((struct sockaddr_in*)res->ai_addr)->sin_addr.s_addr;
+	*ttl_sec = SPOTIFY_DNS_FALLBACK_TTL_SEC;
+	freeaddrinfo(res);
+	return ESP_OK;
+}
+
+static void _dns_store(const char *host, uint32_t addr, uint32_t ttl_sec)
+{
+	if (ttl_sec < SPOTIFY_DNS_MIN_TTL_SEC)
+		ttl_sec = SPOTIFY_DNS_MIN_TTL_SEC;
+	if (ttl_sec > SPOTIFY_DNS_MAX_TTL_SEC)
+		ttl_sec = SPOTIFY_DNS_MAX_TTL_SEC;
+
+	spotify_dns_entry_t *slot = NULL;
+	spotify_dns_entry_t *oldest = &entries[0];
+	xSemaphoreTake(dns_mutex, portMAX_DELAY);
+	for (int i = 0; i < SPOTIFY_DNS_MAX_HOSTS && slot == NULL; i++) {
+		if (entries[i].host != NULL && strcmp(entries[i].host, host) == 0)
+			slot = &entries[i];
+	}
+	for (int i = 0; i < SPOTIFY_DNS_MAX_HOSTS && slot == NULL; i++) {
+		if (entries[i].host == NULL)
+			slot = &entries[i];
+		else if (entries[i].resolved_ms < oldest->resolved_ms)
+			oldest = &entries[i];
+	}
+	if (slot == NULL)
+		slot = oldest;
+	slot->host = host;
+	slot->addr = addr;
+	slot->resolved_ms = time_millis();
+	slot->ttl_ms = ttl_sec * 1000;
+	slot->next_attempt_ms = slot->resolved_ms + (slot->ttl_ms / 100) * SPOTIFY_DNS_REFRESH_PERCENT;
+	slot->refreshing = false;
+	xSemaphoreGive(dns_mutex);
+	ESP_LOGD(TAG, "%s cached for %u s", host, ttl_sec);
+}
+
+static uint32_t _dns_refresh_in_ms(const spotify_dns_entry_t *entry, uint32_t now)
+{
+	int32_t remaining = (int32_t)(entry->next_attempt_ms - now);
+	return remaining <= 0 ? 0 : (uint32_t)remaining;
+}
+
+/**
+ * Sleeps until the earliest entry reaches its refresh point, then re-resolves it. The entry keeps
+ * serving its current address meanwhile; a failed refresh is retried after the minimum TTL.
+ */
+static void _dns_refresh_task(void *pvParameter)
+{
+	for (;;) {
+		const char *host = NULL;
+		uint32_t wait_ms = SPOTIFY_DNS_MAX_TTL_SEC * 1000;
+		uint32_t now = time_millis();
+		xSemaphoreTake(dns_mutex, portMAX_DELAY);
+		for (int i = 0; i < SPOTIFY_DNS_MAX_HOSTS; i++) {
+			if (entries[i].host == NULL)
+				continue;
+			uint32_t refresh_in = _dns_refresh_in_ms(&entries[i], now);
+			if (refresh_in == 0 && host == NULL) {
+				host = entries[i].host;
+				entries[i].refreshing = true;
+			} else if (refresh_in < wait_ms) {
+				wait_ms = refresh_in;
+			}
+		}
+		xSemaphoreGive(dns_mutex);
+
+		if (host == NULL) {
+			ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_ms));
+			continue;
+		}
+		uint32_t addr;
+		uint32_t ttl_sec;
+		if (_dns_lookup(host, &addr, &ttl_sec) == ESP_OK) {
+			_dns_store(host, addr, ttl_sec);
+		} else {
+			ESP_LOGW(TAG, "Refreshing %s failed, keeping the cached address", host);
+			xSemaphoreTake(dns_mutex, portMAX_DELAY);
+			for (int i = 0; i < SPOTIFY_DNS_MAX_HOSTS; i++) {
+				if (entries[i].host == host) {
+					// resolved_ms stays put so that the entry still expires past the max-stale limit
+					entries[i].next_attempt_ms = time_millis() + SPOTIFY_DNS_MIN_TTL_SEC * 1000;
+					entries[i].refreshing = false;
+				}
+			}
+			xSemaphoreGive(dns_mutex);
+		}
+	}
+}
+
+esp_err_t spotify_dns_init(void)
+{
+	if (dns_mutex != NULL)
+		return ESP_OK;
+
+	memset(entries, 0, sizeof(entries));
+	dns_mutex = xSemaphoreCreateMutex();
+	if (dns_mutex == NULL)
+		return ESP_ERR_NO_MEM;
+	if (xTaskCreate(&_dns_refresh_task, "spotify_dns", SPOTIFY_DNS_TASK_STACK, NULL,
+			SPOTIFY_DNS_TASK_PRIORITY, &dns_task) != pdPASS)
+		return ESP_ERR_NO_MEM;
+	return ESP_OK;
+}
+
+esp_err_t spotify_dns_resolve(const char *host, char *ip, size_t size)
+{
+	bool found = false;
+	uint32_t addr = 0;
+	uint32_t now = time_millis();
+	xSemaphoreTake(dns_mutex, portMAX_DELAY);
+	for (int i = 0; i < SPOTIFY_DNS_MAX_HOSTS; i++) {
+		if (entries[i].host == NULL || strcmp(entries[i].host, host) != 0)
+			continue;
+		// Stale entries are still served while the refresh task works on them, up to a limit.
+		if (now - entries[i].resolved_ms < entries[i].ttl_ms + SPOTIFY_DNS_MAX_STALE_SEC * 1000) {
+			addr = entries[i].addr;
+			found = true;
+		}
+		break;
+	}
+	xSemaphoreGive(dns_mutex);
+
+	if (!found) {
+		uint32_t ttl_sec;
+		uint32_t start = time_millis();
+		if (_dns_lookup(host, &addr, &ttl_sec) != ESP_OK) {
+			ESP_LOGW(TAG, "Could not resolve %s", host);
+			return ESP_FAIL;
+		}
+		ESP_LOGD(TAG, "Resolved %s in %u ms", host, time_millis() - start);
+		_dns_store(host, addr, ttl_sec);
+		xTaskNotifyGive(dns_task);
+	}
+
+	const uint8_t *octets = (const uint8_t*)&addr;
+	snprintf(ip, size, "%u.%u.%u.%u", octets[0], octets[1], octets[2], octets[3]);
+	return ESP_OK;
+}
+
+void spotify_dns_invalidate(const char *host)
+{
+	xSemaphoreTake(dns_mutex, portMAX_DELAY);
+	for (int i = 0; i < SPOTIFY_DNS_MAX_HOSTS; i++) {
+		if (entries[i].host != NULL && strcmp(entries[i].host, host) == 0 && !entries[i].refreshing)
+			memset(&entries[i], 0, sizeof(spotify_dns_entry_t));
+	}
+	xSemaphoreGive(dns_mutex);
+}
@@ -0,0 +1,105 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "spotify_events.h"
+
+typedef struct spotify_events_sub_t
+{
+	volatile bool active;
+	uint32_t mask;
+	TaskHandle_t task;
+	uint32_t notify_bits;
+	uint32_t head;      /* written by the producer only */
+	uint32_t tail;      /* written by the consumer only */
+	uint32_t dropped;
+	spotify_event_t ring[SPOTIFY_EVENTS_RING_SIZE];
+} spotify_events_sub_t;
+
+static const char *TAG = "SpotifyEvents";
+static spotify_events_sub_t subscribers[SPOTIFY_EVENTS_MAX_SUBSCRIBERS];
+static SemaphoreHandle_t subscribe_mutex = NULL;
+
+
+esp_err_t spotify_events_init(void)
+{
+	if (subscribe_mutex != NULL)
+		return ESP_OK;
+	subscribe_mutex = xSemaphoreCreateMutex();
+	return subscribe_mutex != NULL ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+int spotify_events_subscribe(uint32_t mask, TaskHandle_t task, uint32_t notify_bits)
+{
+	int id = -1;
+	xSemaphoreTake(subscribe_mutex, portMAX_DELAY);
+	for (int i = 0; i < SPOTIFY_EVENTS_MAX_SUBSCRIBERS && id < 0; i++) {
+		if (!subscribers[i].active)
+			id = i;
+	}
+	if (id >= 0) {
+		spotify_events_sub_t *sub = &subscribers[id];
+		sub->mask = mask;
+		sub->task = task;
+		sub->notify_bits = notify_bits;
+		sub->head = 0;
+		sub->tail = 0;
+		sub->dropped = 0;
+		// The producer must see the fields above before it sees the slot active.
+		__atomic_store_n(&sub->active, true, __ATOMIC_RELEASE);
+	}
+	xSemaphoreGive(subscribe_mutex);
+	if (id < 0)
+		ESP_LOGW(TAG, "No free subscriber slot");
+	return id;
+}
+
+void spotify_events_unsubscribe(int id)
+{
+	if (id < 0 || id >= SPOTIFY_EVENTS_MAX_SUBSCRIBERS)
+		return;
+	xSemaphoreTake(subscribe_mutex, portMAX_DELAY);
+	__atomic_store_n(&subscribers[id].active, false, __ATOMIC_RELEASE);
+	xSemaphoreGive(subscribe_mutex);
+}
+
+bool spotify_events_receive(int id, spotify_event_t *event)
+{
+	if (id < 0 || id >= SPOTIFY_EVENTS_MAX_SUBSCRIBERS)
+		return false;
+	spotify_events_sub_t *sub = &subscribers[id];
+	uint32_t tail = sub->tail;
+	if (tail == __atomic_load_n(&sub->head, __ATOMIC_ACQUIRE))
+		return false;
+	*event = sub->ring[tail & (SPOTIFY_EVENTS_RING_SIZE - 1)];
+	// The slot may be reused once the new tail is visible.
+	__atomic_store_n(&sub->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+uint32_t spotify_events_dropped(int id)
+{
+	if (id < 0 || id >= SPOTIFY_EVENTS_MAX_SUBSCRIBERS)
+		return 0;
+	return __atomic_load_n(&subscribers[id].dropped, __ATOMIC_RELAXED);
+}
+
+void spotify_events_publish(const spotify_event_t *event)
+{
+	for (int i = 0; i < SPOTIFY_EVENTS_MAX_SUBSCRIBERS; i++) {
+		spotify_events_sub_t *sub = &subscribers[i];
+		if (!__atomic_load_n(&sub->active, __ATOMIC_ACQUIRE) || !(sub->mask & event->type))
+			continue;
+		uint32_t head = sub->head;
+		if (head - __atomic_load_n(&sub->tail, __ATOMIC_ACQUIRE) >= SPOTIFY_EVENTS_RING_SIZE) {
+			__atomic_store_n(&sub->dropped, sub->dropped + 1, __ATOMIC_RELAXED);
+			ESP_LOGD(TAG, "Subscriber %d is full, dropping event %d", i, event->type);
+		} else {
+			sub->ring[head & (SPOTIFY_EVENTS_RING_SIZE - 1)] = *event;
+			__atomic_store_n(&sub->head, head + 1, __ATOMIC_RELEASE);
+		}
+		// Notified even when full, so a subscriber that fell behind still drains its ring.
+		xTaskNotify(sub->task, sub->notify_bits, eSetBits);
+	}
+}
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "spotify_history.h"
+#include "spotify_storage.h"
+#include "spotify_stream.h"
+
+#define SPOTIFY_HISTORY_NVS_KEY "history"
+
+/* persisted as a single blob; head is the slot of the oldest play */
+typedef struct spotify_history_t
+{
+	uint32_t account;       /* spotify_account_get_id of the account the plays belong to */
+	int64_t cursor;
+	uint16_t head;
+	uint16_t count;
+	spotify_history_entry_t entries[SPOTIFY_HISTORY_SIZE];
+} spotify_history_t;
+
+typedef struct spotify_history_fetch_t
+{
+	spotify_history_entry_t *entries;
+	int count;
+} spotify_history_fetch_t;
+
+static const char *TAG = "SpotifyHistory";
+static spotify_history_t history;
+static SemaphoreHandle_t history_mutex = NULL;
+static SemaphoreHandle_t refresh_mutex = NULL;
+
+
+static int64_t _history_days_from_civil(int y, int m, int d)
+{
+	y -= m <= 2;
+	int era = (y >= 0 ? y : y - 399) / 400;
+	int yoe = y - era * 400;
+	int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return (int64_t)era * 146097 + doe - 719468;
+}
+
+/* "2016-12-13T20:44:04.589Z" to Unix milliseconds, 0 if malformed */
+static int64_t _history_parse_time(const char *iso)
+{
+	int year, month, day, hour, minute, second;
+	if (iso == NULL || sscanf(iso, "%d-%d-%dT%d:%d:%d", &year, &month, &day, &hour, &minute, &second) != 6)
+		return 0;
+	int millis = 0;
+	const char *fraction = strchr(iso, '.');
+	for (int i = 0, scale = 100; fraction && i < 3 && fraction[i + 1] >= '0' && fraction[i + 1] <= '9'; i++, scale /= 10)
+		millis += (fraction[i + 1] - '0') * scale;
+
+	int64_t seconds = _history_days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+	return seconds * 1000 + millis;
+}
+
+static void _history_on_item(void *ctx, int index, cJSON *item)
+{
+	spotify_history_fetch_t *fetch = (spotify_history_fetch_t*)ctx;
+	if (index >= SPOTIFY_HISTORY_SIZE)
+		return;
+
+	spotify_track_t track;
+	spotify_parse_track(cJSON_GetObjectItem(item, "track"), &track);
+	cJSON *played_at = cJSON_GetObjectItem(item, "played_at");
+	spotify_history_entry_t *entry = &fetch->entries[fetch->count];
+	spotify_track_record_from_track(&track, &entry->track);
+	entry->played_at = _history_parse_time(cJSON_IsString(played_at) ? played_at->valuestring : NULL);
+	if (entry->played_at != 0 && entry->track.track_id[0] != '\0')
+		fetch->count++;
+}
+
+esp_err_t spotify_history_init(void)
+{
+	if (history_mutex == NULL) {
+		history_mutex = xSemaphoreCreateMutex();
+		refresh_mutex = xSemaphoreCreateMutex();
+		if (history_mutex == NULL || refresh_mutex == NULL)
+			return ESP_ERR_NO_MEM;
+	}
+
+	size_t sz = sizeof(spotify_history_t);
+	esp_err_t err = spotify_storage_get_blob(SPOTIFY_HISTORY_NVS_KEY, &history, &sz);
+	// A ring saved with another SPOTIFY_HISTORY_SIZE or layout is dropped; the next refresh rebuilds it.
+	if (err != ESP_OK || sz != sizeof(spotify_history_t) || history.head >= SPOTIFY_HISTORY_SIZE
+			|| history.count > SPOTIFY_HISTORY_SIZE) {
+		memset(&history, 0, sizeof(history));
+		return err == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : err;
+	}
+	for (int i = 0; i < history.count; i++) {
+		const spotify_history_entry_t *entry = &history.entries[(history.head + i) % SPOTIFY_HISTORY_SIZE];
+		if (!spotify_record_check(&entry->track, SPOTIFY_RECORD_TRACK, sizeof(spotify_track_record_t))) {
+			ESP_LOGW(TAG, "Saved plays are damaged, dropping them");
+			memset(&history, 0, sizeof(history));
+			return ESP_ERR_INVALID_CRC;
+		}
+	}
+	ESP_LOGI(TAG, "Restored %u plays", history.count);
+	return ESP_OK;
+}
+
+esp_err_t spotify_history_refresh(void)
+{
+	char path[96];
+	spotify_response_t response;
+	spotify_stream_t stream;
+	spotify_history_fetch_t fetch = { 0 };
+	char *item_buf = NULL;
+	esp_err_t err = ESP_ERR_NO_MEM;
+
+	xSemaphoreTake(refresh_mutex, portMAX_DELAY);
+	fetch.entries = (spotify_history_entry_t*)malloc(sizeof(spotify_history_entry_t) * SPOTIFY_HISTORY_SIZE);
+	item_buf = (char*)malloc(SPOTIFY_HISTORY_ITEM_BUF_SIZE);
+	if (fetch.entries == NULL || item_buf == NULL)
+		goto cleanup;
+
+	// The cursor is the newest play of one account: after a switch it would skip the plays of
+	// the new account made before it, so that account starts from an empty ring.
+	uint32_t account = spotify_account_get_id();
+	bool switched = false;
+	xSemaphoreTake(history_mutex, portMAX_DELAY);
+	if (history.account != account) {
+		switched = history.count > 0 || history.cursor > 0;
+		memset(&history, 0, sizeof(history));
+		history.account = account;
+	}
+	int64_t cursor = history.cursor;
+	xSemaphoreGive(history_mutex);
+	if (switched)
+		ESP_LOGI(TAG, "Account changed, dropping the plays of the previous one");
+	if (cursor > 0)
+		snprintf(path, sizeof(path), "%s?limit=%d&after=%lld", SPOTIFY_RECENTLY_PLAYED_ENDPOINT, SPOTIFY_HISTORY_SIZE, cursor);
+	else
+		snprintf(path, sizeof(path), "%s?limit=%d", SPOTIFY_RECENTLY_PLAYED_ENDPOINT, SPOTIFY_HISTORY_SIZE);
+
+	spotify_stream_init(&stream, item_buf, SPOTIFY_HISTORY_ITEM_BUF_SIZE, _history_on_item, &fetch);
+	spotify_request_t request = {
+		.path = path,
+		.method = HTTP_METHOD_GET,
+		.priority = SPOTIFY_PRIORITY_POLL,
+		.on_data = spotify_stream_feed,
+		.ctx = &stream,
+	};
+	err = spotify_api_request(&request, &response);
+	if (err == ESP_OK && response.status_code != 200)
+		err = ESP_FAIL;
+	spotify_pool_release(&response);
+	if (err != ESP_OK) {
+		ESP_LOGW(TAG, "Could not fetch recently played: %s", esp_err_to_name(err));
+		goto cleanup;
+	}
+
+	// Append oldest first, overwriting the oldest slots.
+	for (int i = 1; i < fetch.count; i++) {
+		spotify_history_entry_t entry = fetch.entries[i];
+		int j = i - 1;
+		while (j >= 0 && fetch.entries[j].played_at > entry.played_at) {
+			fetch.entries[j + 1] = fetch.entries[j];
+			j--;
+		}
+		fetch.entries[j + 1] = entry;
+	}
+	int added = 0;
+	xSemaphoreTake(history_mutex, portMAX_DELAY);
+	for (int i = 0; i < fetch.count; i++) {
+		if (fetch.entries[i].played_at <= history.cursor)
+			continue;
+		int slot = (history.head + history.count) % SPOTIFY_HISTORY_SIZE;
+		history.entries[slot] = fetch.entries[i];
+		if (history.count < SPOTIFY_HISTORY_SIZE)
+			history.count++;
+		else
+			history.head = (history.head + 1) % SPOTIFY_HISTORY_SIZE;
+		history.cursor = fetch.entries[i].played_at;
+		added++;
+	}
+	xSemaphoreGive(history_mutex);
+
+	ESP_LOGD(TAG, "%d new plays", added);
+	if (added > 0 || switched) {
+		// The blob is written outside history_mutex: readers never wait on flash.
+		spotify_history_t *copy = (spotify_history_t*)malloc(sizeof(spotify_history_t));
+		if (copy != NULL) {
+			xSemaphoreTake(history_mutex, portMAX_DELAY);
+			*copy = history;
+			xSemaphoreGive(history_mutex);
+			spotify_storage_set_blob(SPOTIFY_HISTORY_NVS_KEY, copy, sizeof(spotify_history_t));
+			free(copy);
+		}
+	}
+cleanup:
+	free(item_buf);
+	free(fetch.entries);
+	xSemaphoreGive(refresh_mutex);
+	return err;
+}
+
+int spotify_history_get(spotify_history_entry_t *entries, int max)
+{
+	xSemaphoreTake(history_mutex, portMAX_DELAY);
+	int count = history.count < max ? history.count : max;
+	for (int i = 0; i < count; i++)
+		entries[i] = history.entries[(history.head + history.count - 1 - i) % SPOTIFY_HISTORY_SIZE];
+	xSemaphoreGive(history_mutex);
+	return count;
+}
@@ -0,0 +1,222 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "lwip/sockets.h"
+
+#include "spotify_lan.h"
+
+#ifdef CONFIG_SPOTIFY_LAN_SHARING
+
+_Static_assert(SPOTIFY_LAN_ID_LENGTH == MAX_SONG_ID_LENGTH, "LAN snapshot id length");
+_Static_assert(SPOTIFY_LAN_NAME_LENGTH == MAX_SONG_TITLE_LENGTH, "LAN snapshot name length");
+_Static_assert(SPOTIFY_LAN_URL_LENGTH == SPOTIFY_URL_CHAR_LENGTH, "LAN snapshot url length");
+
+static const char *TAG = "SpotifyLan";
+static spotify_lan_election_t election;
+static SemaphoreHandle_t lan_mutex = NULL;
+static int lan_socket = -1;
+static struct sockaddr_in group_addr;
+static uint32_t group_id = 0;
+static uint32_t settled_at = 0;
+static uint32_t seq = 0;
+static volatile bool is_leader = false;
+
+
+static void _lan_to_snapshot(const now_playing_t *now_playing, spotify_lan_snapshot_t *snapshot)
+{
+	memset(snapshot, 0, sizeof(spotify_lan_snapshot_t));
+	memcpy(snapshot->track_id, now_playing->track_id, sizeof(snapshot->track_id));
+	memcpy(snapshot->track_name, now_playing->track_name, sizeof(snapshot->track_name));
+	if (now_playing->num_artists > 0)
+		memcpy(snapshot->artist_name, now_playing->artists[0], sizeof(snapshot->artist_name));
+	memcpy(snapshot->album_image_url, now_playing->album_image_url, sizeof(snapshot->album_image_url));
+	snapshot->is_playing = now_playing->is_playing;
+	snapshot->progress_ms = now_playing->progress_ms;
+	snapshot->duration_ms = now_playing->duration_ms;
+}
+
+static void _lan_from_snapshot(const spotify_lan_snapshot_t *snapshot, now_playing_t *now_playing)
+{
+	memset(now_playing, 0, sizeof(now_playing_t));
+	memcpy(now_playing->track_id, snapshot->track_id, sizeof(now_playing->track_id));
+	memcpy(now_playing->track_name, snapshot->track_name, sizeof(now_playing->track_name));
+	if (snapshot->artist_name[0] != '\0') {
+		memcpy(now_playing->artists[0], snapshot->artist_name, sizeof(now_playing->artists[0]));
+		now_playing->num_artists = 1;
+	}
+	memcpy(now_playing->album_image_url, snapshot->album_image_url, sizeof(now_playing->album_image_url));
+	now_playing->is_playing = snapshot->is_playing;
+	now_playing->progress_ms = snapshot->progress_ms;
+	now_playing->duration_ms = snapshot->duration_ms;
+	// LAN latency is well below the display resolution: the leader's progress is taken as of now.
+	now_playing->timestamp = time_millis();
+}
+
+static void _lan_send(spotify_lan_packet_type_t type, const now_playing_t *now_playing)
+{
+	uint8_t buf[SPOTIFY_LAN_MAX_PACKET];
+	spotify_lan_snapshot_t snapshot;
+	if (now_playing != NULL)
+		_lan_to_snapshot(now_playing, &snapshot);
+	xSemaphoreTake(lan_mutex, portMAX_DELAY);
+	spotify_lan_header_t header = {
+		.type = type,
+		.node_id = election.self_id,
+		.group_id = group_id,
+		.seq = seq++,
+	};
+	size_t len = spotify_lan_encode(buf, sizeof(buf), &header, now_playing ? &snapshot : NULL);
+	if (len > 0 && lan_socket >= 0)
+		sendto(lan_socket, buf, len, 0, (struct sockaddr*)&group_addr, sizeof(group_addr));
+	xSemaphoreGive(lan_mutex);
+}
+
+static int _lan_open_socket(void)
+{
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0)
+		return -1;
+	int reuse = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(SPOTIFY_LAN_PORT),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	struct ip_mreq mreq = { 0 };
+	mreq.imr_multiaddr.s_addr = inet_addr(SPOTIFY_LAN_GROUP);
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	// Stay on the local segment. Looped-back copies let several nodes share one host; our own
+	// packets are recognised by their node id.
+	uint8_t ttl = 1;
+	uint8_t loop = 1;
+	struct timeval timeout = { .tv_sec = 0, .tv_usec = 200 * 1000 };
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0
+			|| setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0
+			|| setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0
+			|| setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0
+			|| setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static void _lan_task(void *pvParameter)
+{
+	uint8_t buf[SPOTIFY_LAN_MAX_PACKET];
+	spotify_lan_header_t header;
+	spotify_lan_snapshot_t snapshot;
+	uint32_t last_heartbeat = 0;
+
+	spotify_wait_for_network(portMAX_DELAY);
+	int sock = _lan_open_socket();
+	if (sock < 0) {
+		ESP_LOGE(TAG, "Could not join %s:%d, polling on our own", SPOTIFY_LAN_GROUP, SPOTIFY_LAN_PORT);
+		is_leader = true;
+		vTaskDelete(NULL);
+		return;
+	}
+	xSemaphoreTake(lan_mutex, portMAX_DELAY);
+	lan_socket = sock;
+	settled_at = time_millis() + SPOTIFY_LAN_HEARTBEAT_MS + SPOTIFY_LAN_HEARTBEAT_MS / 2;
+	xSemaphoreGive(lan_mutex);
+	_lan_send(SPOTIFY_LAN_HEARTBEAT, NULL);
+	ESP_LOGI(TAG, "Node %08x joined %s:%d", election.self_id, SPOTIFY_LAN_GROUP, SPOTIFY_LAN_PORT);
+
+	for (;;) {
+		int len = recv(sock, buf, sizeof(buf), 0);
+		uint32_t now = time_millis();
+		uint32_t account = spotify_account_get_id();
+		xSemaphoreTake(lan_mutex, portMAX_DELAY);
+		if (account != group_id) {
+			// Switched accounts: the units of the old one are no longer our group.
+			group_id = account;
+			spotify_lan_election_reset(&election);
+			settled_at = now + SPOTIFY_LAN_HEARTBEAT_MS + SPOTIFY_LAN_HEARTBEAT_MS / 2;
+		}
+		bool apply = false;
+		if (len > 0 && spotify_lan_decode(buf, len, &header, &snapshot) && header.group_id == group_id
+				&& header.node_id != election.self_id) {
+			spotify_lan_election_seen(&election, header.node_id, now);
+			apply = header.type == SPOTIFY_LAN_SNAPSHOT;
+		}
+		uint32_t leader = spotify_lan_election_leader(&election, now);
+		bool leading = leader == election.self_id && (int32_t)(now - settled_at) >= 0;
+		apply = apply && header.node_id == leader;
+		xSemaphoreGive(lan_mutex);
+
+		if (leading != is_leader) {
+			ESP_LOGI(TAG, leading ? "Leading, polling Spotify" : "Following node %08x", leader);
+			is_leader = leading;
+		}
+		if (apply && !leading) {
+			now_playing_t now_playing;
+			_lan_from_snapshot(&snapshot, &now_playing);
+			spotify_set_now_playing(&now_playing);
+		}
+		if (now - last_heartbeat >= SPOTIFY_LAN_HEARTBEAT_MS) {
+			now_playing_t now_playing;
+			// The leader's heartbeat carries its state, so a follower that missed a snapshot catches up.
+			if (leading && spotify_get_now_playing(&now_playing))
+				_lan_send(SPOTIFY_LAN_SNAPSHOT, &now_playing);
+			else
+				_lan_send(SPOTIFY_LAN_HEARTBEAT, NULL);
+			last_heartbeat = now;
+		}
+	}
+}
+
+esp_err_t spotify_lan_init(void)
+{
+	if (lan_mutex != NULL)
+		return ESP_OK;
+	lan_mutex = xSemaphoreCreateMutex();
+	if (lan_mutex == NULL)
+		return ESP_ERR_NO_MEM;
+
+	uint8_t mac[6];
+	esp_efuse_mac_get_default(mac);
+	spotify_lan_election_init(&election, (mac[2] << 24) | (mac[3] << 16) | (mac[4] << 8) | mac[5],
+			SPOTIFY_LAN_TIMEOUT_MS);
+	group_id = spotify_account_get_id();
+	memset(&group_addr, 0, sizeof(group_addr));
+	group_addr.sin_family = AF_INET;
+	group_addr.sin_port = htons(SPOTIFY_LAN_PORT);
+	group_addr.sin_addr.s_addr = inet_addr(SPOTIFY_LAN_GROUP);
+	if (xTaskCreate(&_lan_task, "spotify_lan", SPOTIFY_LAN_TASK_STACK, NULL, SPOTIFY_LAN_TASK_PRIORITY, NULL) != pdPASS)
+		return ESP_ERR_NO_MEM;
+	return ESP_OK;
+}
+
+bool spotify_lan_should_poll(void)
+{
+	return is_leader;
+}
+
+void spotify_lan_publish(const now_playing_t *snapshot)
+{
+	if (is_leader)
+		_lan_send(SPOTIFY_LAN_SNAPSHOT, snapshot);
+}
+
+#else
+
+esp_err_t spotify_lan_init(void)
+{
+	return ESP_OK;
+}
+
+bool spotify_lan_should_poll(void)
+{
+	return true;
+}
+
+void spotify_lan_publish(const now_playing_t *snapshot)
+{
+}
+
+#endif
@@ -0,0 +1,176 @@
+#include <string.h>
+
+#include "spotify_lan_proto.h"
+
+typedef struct spotify_lan_writer_t
+{
+	uint8_t *buf;
+	size_t size;
+	size_t len;
+	bool overflow;
+} spotify_lan_writer_t;
+
+typedef struct spotify_lan_reader_t
+{
+	const uint8_t *buf;
+	size_t len;
+	size_t pos;
+	bool underflow;
+} spotify_lan_reader_t;
+
+
+static void _lan_put(spotify_lan_writer_t *w, const void *data, size_t len)
+{
+	if (w->len + len > w->size) {
+		w->overflow = true;
+		return;
+	}
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+}
+
+static void _lan_put_u32(spotify_lan_writer_t *w, uint32_t value)
+{
+	uint8_t bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+	_lan_put(w, bytes, sizeof(bytes));
+}
+
+/* length-prefixed, without the terminator */
+static void _lan_put_str(spotify_lan_writer_t *w, const char *value, size_t max)
+{
+	uint8_t len = 0;
+	while (len < max && value[len])
+		len++;
+	_lan_put(w, &len, 1);
+	_lan_put(w, value, len);
+}
+
+static const uint8_t* _lan_get(spotify_lan_reader_t *r, size_t len)
+{
+	if (r->pos + len > r->len) {
+		r->underflow = true;
+		return NULL;
+	}
+	const uint8_t *data = r->buf + r->pos;
+	r->pos += len;
+	return data;
+}
+
+static uint32_t _lan_get_u32(spotify_lan_reader_t *r)
+{
+	const uint8_t *b = _lan_get(r, 4);
+	return b ? b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24) : 0;
+}
+
+static void _lan_get_str(spotify_lan_reader_t *r, char *value, size_t size)
+{
+	const uint8_t *len = _lan_get(r, 1);
+	const uint8_t *data = len ? _lan_get(r, *len) : NULL;
+	if (data == NULL || *len >= size) {
+		r->underflow = true;
+		value[0] = '\0';
+		return;
+	}
+	memcpy(value, data, *len);
+	value[*len] = '\0';
+}
+
+void spotify_lan_election_init(spotify_lan_election_t *election, uint32_t self_id, uint32_t timeout_ms)
+{
+	memset(election, 0, sizeof(spotify_lan_election_t));
+	election->self_id = self_id;
+	election->timeout_ms = timeout_ms;
+}
+
+void spotify_lan_election_reset(spotify_lan_election_t *election)
+{
+	election->num_peers = 0;
+}
+
+void spotify_lan_election_seen(spotify_lan_election_t *election, uint32_t node_id, uint32_t now_ms)
+{
+	if (node_id == election->self_id)
+		return;
+	int oldest = 0;
+	for (int i = 0; i < election->num_peers; i++) {
+		if (election->peers[i].node_id == node_id) {
+			election->peers[i].last_seen_ms = now_ms;
+			return;
+		}
+		if (now_ms - election->peers[i].last_seen_ms > now_ms - election->peers[oldest].last_seen_ms)
+			oldest = i;
+	}
+	// A full table gives up the peer heard from the longest ago.
+	int slot = election->num_peers < (int)SPOTIFY_LAN_MAX_PEERS ? election->num_peers++ : oldest;
+	election->peers[slot].node_id = node_id;
+	election->peers[slot].last_seen_ms = now_ms;
+}
+
+uint32_t spotify_lan_election_leader(spotify_lan_election_t *election, uint32_t now_ms)
+{
+	uint32_t leader = election->self_id;
+	for (int i = 0; i < election->num_peers;) {
+		if (now_ms - election->peers[i].last_seen_ms > election->timeout_ms) {
+			election->peers[i] = election->peers[--election->num_peers];
+			continue;
+		}
+		if (election->peers[i].node_id < leader)
+			leader = election->peers[i].node_id;
+		i++;
+	}
+	return leader;
+}
+
+size_t spotify_lan_encode(uint8_t *buf, size_t size, const spotify_lan_header_t *header,
+		const spotify_lan_snapshot_t *snapshot)
+{
+	spotify_lan_writer_t w = { .buf = buf, .size = size };
+	uint8_t version = SPOTIFY_LAN_VERSION;
+	_lan_put_u32(&w, SPOTIFY_LAN_MAGIC);
+	_lan_put(&w, &version, 1);
+	_lan_put(&w, &header->type, 1);
+	_lan_put_u32(&w, header->node_id);
+	_lan_put_u32(&w, header->group_id);
+	_lan_put_u32(&w, header->seq);
+	if (header->type == SPOTIFY_LAN_SNAPSHOT) {
+		uint8_t is_playing = snapshot->is_playing;
+		_lan_put_str(&w, snapshot->track_id, SPOTIFY_LAN_ID_LENGTH);
+		_lan_put_str(&w, snapshot->track_name, SPOTIFY_LAN_NAME_LENGTH);
+		_lan_put_str(&w, snapshot->artist_name, SPOTIFY_LAN_NAME_LENGTH);
+		_lan_put_str(&w, snapshot->album_image_url, SPOTIFY_LAN_URL_LENGTH - 1);
+		_lan_put(&w, &is_playing, 1);
+		_lan_put_u32(&w, snapshot->progress_ms);
+		_lan_put_u32(&w, snapshot->duration_ms);
+	}
+	return w.overflow ? 0 : w.len;
+}
+
+bool spotify_lan_decode(const uint8_t *buf, size_t len, spotify_lan_header_t *header,
+		spotify_lan_snapshot_t *snapshot)
+{
+	spotify_lan_reader_t r = { .buf = buf, .len = len };
+	if (_lan_get_u32(&r) != SPOTIFY_LAN_MAGIC)
+		return false;
+	const uint8_t *version = _lan_get(&r, 1);
+	const uint8_t *type = _lan_get(&r, 1);
+	if (version == NULL || type == NULL || *version != SPOTIFY_LAN_VERSION)
+		return false;
+	header->type = *type;
+	header->node_id = _lan_get_u32(&r);
+	header->group_id = _lan_get_u32(&r);
+	header->seq = _lan_get_u32(&r);
+	if (header->type == SPOTIFY_LAN_SNAPSHOT) {
+		memset(snapshot, 0, sizeof(spotify_lan_snapshot_t));
+		_lan_get_str(&r, snapshot->track_id, sizeof(snapshot->track_id));
+		_lan_get_str(&r, snapshot->track_name, sizeof(snapshot->track_name));
+		_lan_get_str(&r, snapshot->artist_name, sizeof(snapshot->artist_name));
+		_lan_get_str(&r, snapshot->album_image_url, sizeof(snapshot->album_image_url));
+		const uint8_t *is_playing = _lan_get(&r, 1);
+		snapshot->is_playing = is_playing && *is_playing;
+		snapshot->progress_ms = _lan_get_u32(&r);
+		snapshot->duration_ms = _lan_get_u32(&r);
+	} else if (header->type != SPOTIFY_LAN_HEARTBEAT) {
+		return false;
+	}
+	return !r.underflow;
+}
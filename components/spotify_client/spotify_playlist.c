@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "spotify_playlist.h"
+#include "spotify_storage.h"
+#include "spotify_stream.h"
+#include "time_manager.h"
+
+#define SPOTIFY_PLAYLIST_INDEX_KEY  "pl_index"
+#define SPOTIFY_PLAYLIST_SLOTS_KEY  "pl_slots"
+#define SPOTIFY_PLAYLIST_TRACKS_KEY "pl_t%d"
+
+typedef struct spotify_playlist_index_t
+{
+	uint16_t count;
+	spotify_playlist_t playlists[SPOTIFY_PLAYLIST_MAX];
+} spotify_playlist_index_t;
+
+/* a cached track list, valid for the snapshot it was downloaded at */
+typedef struct spotify_playlist_slot_t
+{
+	char id[MAX_PLAYLIST_ID_LENGTH + 1];
+	char snapshot_id[SPOTIFY_SNAPSHOT_ID_LENGTH + 1];
+	uint16_t track_count;
+	uint32_t last_used;
+} spotify_playlist_slot_t;
+
+typedef struct spotify_playlist_page_t
+{
+	void *entries;
+	int offset;
+	int count;
+	int received;
+	int max;
+} spotify_playlist_page_t;
+
+static const char *TAG = "SpotifyPlaylist";
+static spotify_playlist_index_t playlist_index;
+static spotify_playlist_slot_t slots[SPOTIFY_PLAYLIST_CACHE_SLOTS];
+static char item_buf[SPOTIFY_PLAYLIST_ITEM_BUF_SIZE];
+static SemaphoreHandle_t playlist_mutex = NULL;
+static SemaphoreHandle_t sync_mutex = NULL;
+
+
+static void _playlist_on_playlist(void *ctx, int position, cJSON *item)
+{
+	spotify_playlist_page_t *page = (spotify_playlist_page_t*)ctx;
+	page->received++;
+	if (page->count >= page->max)
+		return;
+
+	spotify_playlist_t *playlist = &((spotify_playlist_t*)page->entries)[page->count];
+	cJSON *id = cJSON_GetObjectItem(item, "id");
+	cJSON *name = cJSON_GetObjectItem(item, "name");
+	cJSON *snapshot_id = cJSON_GetObjectItem(item, "snapshot_id");
+	if (!cJSON_IsString(id) || !cJSON_IsString(snapshot_id))
+		return;
+	memset(playlist, 0, sizeof(spotify_playlist_t));
+	snprintf(playlist->id, sizeof(playlist->id), "%s", id->valuestring);
+	snprintf(playlist->name, sizeof(playlist->name), "%s", cJSON_IsString(name) ? name->valuestring : "");
+	snprintf(playlist->snapshot_id, sizeof(playlist->snapshot_id), "%s", snapshot_id->valuestring);
+	playlist->total_tracks = cJSON_GetNumberValue(cJSON_GetObjectItem(cJSON_GetObjectItem(item, "tracks"), "total"));
+	page->count++;
+}
+
+static void _playlist_on_track(void *ctx, int position, cJSON *item)
+{
+	spotify_playlist_page_t *page = (spotify_playlist_page_t*)ctx;
+	page->received++;
+	if (page->count >= page->max)
+		return;
+
+	spotify_track_t track;
+	cJSON *track_json = cJSON_GetObjectItem(item, "track");
+	// local files and tracks no longer available come back as null
+	if (!cJSON_IsObject(track_json))
+		return;
+	spotify_parse_track(track_json, &track);
+	if (track.track_id[0] == '\0')
+		return;
+	spotify_track_record_from_track(&track, &((spotify_playlist_track_t*)page->entries)[page->count]);
+	page->count++;
+}
+
+/**
+ * Walks a paged collection one SPOTIFY_PLAYLIST_PAGE_SIZE page at a time, streaming each page
+ * through on_item, until a short page or max entries. path_fmt takes the offset.
+ */
+static esp_err_t _playlist_fetch_pages(const char *path_fmt, const char *id, spotify_stream_item_cb_t on_item,
+		void *entries, int max, int *count)
+{
+	char path[192];
+	spotify_playlist_page_t page = {
+		.entries = entries,
+		.max = max,
+	};
+	esp_err_t err = ESP_OK;
+	do {
+		page.received = 0;
+		if (id != NULL)
+			snprintf(path, sizeof(path), path_fmt, id, SPOTIFY_PLAYLIST_PAGE_SIZE, page.offset);
+		else
+			snprintf(path, sizeof(path), path_fmt, SPOTIFY_PLAYLIST_PAGE_SIZE, page.offset);
+
+		spotify_stream_t stream;
+		spotify_stream_init(&stream, item_buf, sizeof(item_buf), on_item, &page);
+		spotify_request_t request = {
+			.path = path,
+			.method = HTTP_METHOD_GET,
+			.priority = SPOTIFY_PRIORITY_POLL,
+			.on_data = spotify_stream_feed,
+			.ctx = &stream,
+		};
+		spotify_response_t response;
+		err = spotify_api_request(&request, &response);
+		if (err == ESP_OK && response.status_code != 200)
+			err = ESP_FAIL;
+		spotify_pool_release(&response);
+		page.offset += SPOTIFY_PLAYLIST_PAGE_SIZE;
+	} while (err == ESP_OK && page.received == SPOTIFY_PLAYLIST_PAGE_SIZE && page.count < max);
+
+	*count = page.count;
+	return err;
+}
+
+static esp_err_t _playlist_save_tracks(int slot, const spotify_playlist_track_t *tracks, int count)
+{
+	char key[16];
+	snprintf(key, sizeof(key), SPOTIFY_PLAYLIST_TRACKS_KEY, slot);
+	return spotify_storage_set_blob(key, tracks, count * sizeof(spotify_playlist_track_t));
+}
+
+static esp_err_t _playlist_load_tracks(int slot, spotify_playlist_track_t *tracks, int count)
+{
+	char key[16];
+	snprintf(key, sizeof(key), SPOTIFY_PLAYLIST_TRACKS_KEY, slot);
+	size_t sz = SPOTIFY_PLAYLIST_MAX_TRACKS * sizeof(spotify_playlist_track_t);
+	esp_err_t err = spotify_storage_get_blob(key, tracks, &sz);
+	if (err == ESP_OK && sz != count * sizeof(spotify_playlist_track_t))
+		return ESP_ERR_INVALID_SIZE;
+	// One damaged record spoils the copy: the caller downloads the playlist again.
+	for (int i = 0; err == ESP_OK && i < count; i++) {
+		if (!spotify_record_check(&tracks[i], SPOTIFY_RECORD_TRACK, sizeof(spotify_playlist_track_t)))
+			err = ESP_ERR_INVALID_CRC;
+	}
+	return err;
+}
+
+/* downloads the tracks of playlist into slot; call with sync_mutex held */
+static int _playlist_download(int slot, const spotify_playlist_t *playlist, spotify_playlist_track_t *tracks)
+{
+	char path_fmt[160];
+	int count = 0;
+	snprintf(path_fmt, sizeof(path_fmt), "%s?fields=%s,total&limit=%%d&offset=%%d",
+			SPOTIFY_PLAYLIST_TRACKS_ENDPOINT, SPOTIFY_PLAYLIST_TRACKS_FIELDS);
+	uint32_t start = time_millis();
+	esp_err_t err = _playlist_fetch_pages(path_fmt, playlist->id, _playlist_on_track, tracks,
+			SPOTIFY_PLAYLIST_MAX_TRACKS, &count);
+	if (err != ESP_OK) {
+		ESP_LOGW(TAG, "Could not download %s: %s", playlist->id, esp_err_to_name(err));
+		return -1;
+	}
+	ESP_LOGI(TAG, "Downloaded %d tracks of %s in %u ms", count, playlist->name, time_millis() - start);
+
+	// The slot only moves to the new snapshot once its tracks are in flash, and nobody reads it
+	// while they are overwritten. If the write fails the slots in flash still describe the tracks
+	// that are there, and the next open downloads again.
+	xSemaphoreTake(playlist_mutex, portMAX_DELAY);
+	slots[slot].id[0] = '\0';
+	xSemaphoreGive(playlist_mutex);
+	err = _playlist_save_tracks(slot, tracks, count);
+	if (err != ESP_OK) {
+		ESP_LOGW(TAG, "Could not cache %s: %s", playlist->id, esp_err_to_name(err));
+		return count;
+	}
+	xSemaphoreTake(playlist_mutex, portMAX_DELAY);
+	memcpy(slots[slot].id, playlist->id, sizeof(slots[slot].id));
+	memcpy(slots[slot].snapshot_id, playlist->snapshot_id, sizeof(slots[slot].snapshot_id));
+	slots[slot].track_count = count;
+	slots[slot].last_used = time_millis();
+	xSemaphoreGive(playlist_mutex);
+	spotify_storage_set_blob(SPOTIFY_PLAYLIST_SLOTS_KEY, slots, sizeof(slots));
+	return count;
+}
+
+esp_err_t spotify_playlist_init(void)
+{
+	if (playlist_mutex == NULL) {
+		playlist_mutex = xSemaphoreCreateMutex();
+		sync_mutex = xSemaphoreCreateMutex();
+		if (playlist_mutex == NULL || sync_mutex == NULL)
+			return ESP_ERR_NO_MEM;
+	}
+
+	size_t sz = sizeof(playlist_index);
+	if (spotify_storage_get_blob(SPOTIFY_PLAYLIST_INDEX_KEY, &playlist_index, &sz) != ESP_OK || sz != sizeof(playlist_index)
+			|| playlist_index.count > SPOTIFY_PLAYLIST_MAX)
+		memset(&playlist_index, 0, sizeof(playlist_index));
+	sz = sizeof(slots);
+	if (spotify_storage_get_blob(SPOTIFY_PLAYLIST_SLOTS_KEY, slots, &sz) != ESP_OK || sz != sizeof(slots))
+		memset(slots, 0, sizeof(slots));
+	// last_used is relative to the previous boot
+	for (int i = 0; i < SPOTIFY_PLAYLIST_CACHE_SLOTS; i++)
+		slots[i].last_used = 0;
+	ESP_LOGI(TAG, "Restored %u playlists", playlist_index.count);
+	return ESP_OK;
+}
+
+esp_err_t spotify_playlists_sync(void)
+{
+	spotify_playlist_t *playlists = NULL;
+	spotify_playlist_track_t *tracks = NULL;
+	int count = 0;
+	esp_err_t err = ESP_ERR_NO_MEM;
+
+	xSemaphoreTake(sync_mutex, portMAX_DELAY);
+	playlists = (spotify_playlist_t*)malloc(sizeof(spotify_playlist_t) * SPOTIFY_PLAYLIST_MAX);
+	tracks = (spotify_playlist_track_t*)malloc(sizeof(spotify_playlist_track_t) * SPOTIFY_PLAYLIST_MAX_TRACKS);
+	if (playlists == NULL || tracks == NULL)
+		goto cleanup;
+
+	err = _playlist_fetch_pages(SPOTIFY_USER_PLAYLISTS_ENDPOINT "?limit=%d&offset=%d", NULL,
+			_playlist_on_playlist, playlists, SPOTIFY_PLAYLIST_MAX, &count);
+	if (err != ESP_OK) {
+		ESP_LOGW(TAG, "Could not list playlists: %s", esp_err_to_name(err));
+		goto cleanup;
+	}
+
+	xSemaphoreTake(playlist_mutex, portMAX_DELAY);
+	bool changed = playlist_index.count != count || memcmp(playlist_index.playlists, playlists, count * sizeof(spotify_playlist_t)) != 0;
+	playlist_index.count = count;
+	memcpy(playlist_index.playlists, playlists, count * sizeof(spotify_playlist_t));
+	xSemaphoreGive(playlist_mutex);
+	if (changed)
+		spotify_storage_set_blob(SPOTIFY_PLAYLIST_INDEX_KEY, &playlist_index, sizeof(playlist_index));
+
+	// Only cached playlists whose snapshot moved are downloaded again.
+	for (int slot = 0; slot < SPOTIFY_PLAYLIST_CACHE_SLOTS; slot++) {
+		const spotify_playlist_t *listed = NULL;
+		for (int i = 0; i < count && slots[slot].id[0] != '\0'; i++) {
+			if (strcmp(playlists[i].id, slots[slot].id) == 0)
+				listed = &playlists[i];
+		}
+		if (listed == NULL || strcmp(listed->snapshot_id, slots[slot].snapshot_id) == 0)
+			continue;
+		ESP_LOGD(TAG, "%s changed, refreshing", listed->name);
+		_playlist_download(slot, listed, tracks);
+	}
+	ESP_LOGD(TAG, "Synced %d playlists", count);
+cleanup:
+	free(tracks);
+	free(playlists);
+	xSemaphoreGive(sync_mutex);
+	return err;
+}
+
+int spotify_playlists_get(spotify_playlist_t *playlists, int max)
+{
+	xSemaphoreTake(playlist_mutex, portMAX_DELAY);
+	int count = playlist_index.count < max ? playlist_index.count : max;
+	memcpy(playlists, playlist_index.playlists, count * sizeof(spotify_playlist_t));
+	xSemaphoreGive(playlist_mutex);
+	return count;
+}
+
+int spotify_playlist_open(const char *playlist_id, spotify_playlist_track_t *tracks)
+{
+	spotify_playlist_t playlist;
+	bool listed = false;
+	int cached = -1;
+	int count = 0;
+	xSemaphoreTake(playlist_mutex, portMAX_DELAY);
+	for (int i = 0; i < playlist_index.count && !listed; i++) {
+		if (strcmp(playlist_index.playlists[i].id, playlist_id) == 0) {
+			playlist = playlist_index.playlists[i];
+			listed = true;
+		}
+	}
+	for (int i = 0; i < SPOTIFY_PLAYLIST_CACHE_SLOTS && listed && cached < 0; i++) {
+		if (strcmp(slots[i].id, playlist_id) == 0 && strcmp(slots[i].snapshot_id, playlist.snapshot_id) == 0) {
+			cached = i;
+			count = slots[i].track_count;
+			slots[i].last_used = time_millis();
+		}
+	}
+	xSemaphoreGive(playlist_mutex);
+	if (!listed) {
+		ESP_LOGW(TAG, "Unknown playlist %s", playlist_id);
+		return -1;
+	}
+	// Common case: the cached copy matches the listed snapshot, no network.
+	if (cached >= 0 && _playlist_load_tracks(cached, tracks, count) == ESP_OK)
+		return count;
+
+	xSemaphoreTake(sync_mutex, portMAX_DELAY);
+	int slot = 0;
+	xSemaphoreTake(playlist_mutex, portMAX_DELAY);
+	for (int i = 0; i < SPOTIFY_PLAYLIST_CACHE_SLOTS; i++) {
+		if (strcmp(slots[i].id, playlist_id) == 0) {
+			slot = i;
+			break;
+		}
+		if (slots[i].last_used < slots[slot].last_used)
+			slot = i;
+	}
+	xSemaphoreGive(playlist_mutex);
+	count = _playlist_download(slot, &playlist, tracks);
+	xSemaphoreGive(sync_mutex);
+	return count;
+}
+
+int spotify_playlist_get_cached(int slot, spotify_playlist_track_t *tracks)
+{
+	if (slot < 0 || slot >= SPOTIFY_PLAYLIST_CACHE_SLOTS)
+		return -1;
+	xSemaphoreTake(playlist_mutex, portMAX_DELAY);
+	int count = slots[slot].id[0] != '\0' ? slots[slot].track_count : -1;
+	xSemaphoreGive(playlist_mutex);
+	if (count < 0 || _playlist_load_tracks(slot, tracks, count) != ESP_OK)
+		return -1;
+	return count;
+}
@@ -0,0 +1,578 @@
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/task.h"
+
+#include "spotify_pool.h"
+#include "spotify_breaker.h"
+#include "spotify_dns.h"
+#include "time_manager.h"
+
+#define SPOTIFY_POOL_DEFAULT_TIMEOUT_MS 5000
+
+static const char *TAG = "SpotifyPool";
+static spotify_conn_t pool[SPOTIFY_POOL_SIZE];
+static SemaphoreHandle_t pool_mutex = NULL;
+static SemaphoreHandle_t pool_free = NULL;
+static spotify_latency_stats_t latency_stats;
+static uint32_t latency_samples[SPOTIFY_HEDGE_SAMPLES];
+static uint32_t latency_sample_count = 0;
+#ifdef CONFIG_SPOTIFY_POLL_PREEMPTION
+static volatile bool preemption_enabled = true;
+#endif
+
+typedef enum hedge_leg_state_t
+{
+	HEDGE_LEG_IDLE,
+	HEDGE_LEG_RUNNING,
+	HEDGE_LEG_DONE,
+	HEDGE_LEG_ABANDONED
+} hedge_leg_state_t;
+
+typedef struct spotify_hedge_leg_t
+{
+	TaskHandle_t worker;
+	hedge_leg_state_t state;
+	spotify_request_t request;
+	char path[SPOTIFY_URL_MAX_LENGTH];
+	char authorization[SPOTIFY_HEDGE_AUTH_LENGTH];
+	volatile bool cancel;
+	spotify_response_t response;
+	esp_err_t err;
+} spotify_hedge_leg_t;
+
+static spotify_hedge_leg_t hedge_legs[2];
+static SemaphoreHandle_t hedge_mutex = NULL;
+static SemaphoreHandle_t hedge_state_mutex = NULL;
+static SemaphoreHandle_t hedge_done = NULL;
+
+
+static esp_err_t _pool_event_handler(esp_http_client_event_t *evt)
+{
+	switch(evt->event_id) {
+		case HTTP_EVENT_ERROR:
+			ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
+			break;
+		case HTTP_EVENT_ON_CONNECTED:
+			ESP_LOGD(TAG, "HTTP_EVENT_ON_CONNECTED");
+			break;
+		case HTTP_EVENT_DISCONNECTED:
+			ESP_LOGD(TAG, "HTTP_EVENT_DISCONNECTED");
+			break;
+		case HTTP_EVENT_ON_HEADER:
+			if (evt->user_data != NULL && strcasecmp(evt->header_key, "Retry-After") == 0)
+				((spotify_conn_t*)evt->user_data)->retry_after_sec = strtoul(evt->header_value, NULL, 10);
+			break;
+		default:
+			break;
+	}
+	return ESP_OK;
+}
+
+esp_err_t spotify_pool_init(void)
+{
+	if (pool_mutex != NULL)
+		return ESP_OK;
+
+	pool_mutex = xSemaphoreCreateMutex();
+	pool_free = xSemaphoreCreateCounting(SPOTIFY_POOL_SIZE, SPOTIFY_POOL_SIZE);
+	if (pool_mutex == NULL || pool_free == NULL)
+		return ESP_ERR_NO_MEM;
+
+	for (int i = 0; i < SPOTIFY_POOL_SIZE; i++) {
+		memset(&pool[i], 0, sizeof(spotify_conn_t));
+		pool[i].response_buf = (char*)calloc(1, SPOTIFY_RESPONSE_BUF_SIZE);
+		if (pool[i].response_buf == NULL)
+			return ESP_ERR_NO_MEM;
+	}
+	memset(&latency_stats, 0, sizeof(latency_stats));
+
+	hedge_mutex = xSemaphoreCreateMutex();
+	hedge_state_mutex = xSemaphoreCreateMutex();
+	hedge_done = xSemaphoreCreateBinary();
+	if (hedge_mutex == NULL || hedge_state_mutex == NULL || hedge_done == NULL)
+		return ESP_ERR_NO_MEM;
+	return ESP_OK;
+}
+
+static void _pool_preempt_polls(void)
+{
+	xSemaphoreTake(pool_mutex, portMAX_DELAY);
+	for (int i = 0; i < SPOTIFY_POOL_SIZE; i++) {
+		if (pool[i].in_use && pool[i].priority == SPOTIFY_PRIORITY_POLL && !pool[i].abort) {
+			pool[i].abort = true;
+			latency_stats.preemptions++;
+			ESP_LOGD(TAG, "Preempting poll on connection %d", i);
+		}
+	}
+	xSemaphoreGive(pool_mutex);
+}
+
+static spotify_conn_t* _pool_acquire(const char *host, spotify_priority_t priority, TickType_t ticks_to_wait)
+{
+#ifdef CONFIG_SPOTIFY_POLL_PREEMPTION
+	if (priority != SPOTIFY_PRIORITY_POLL && preemption_enabled)
+		_pool_preempt_polls();
+#endif
+	if (xSemaphoreTake(pool_free, ticks_to_wait) != pdTRUE)
+		return NULL;
+
+	spotify_conn_t *conn = NULL;
+	xSemaphoreTake(pool_mutex, portMAX_DELAY);
+	// Prefer a connection that is already open to the same host, then an unused slot.
+	for (int i = 0; i < SPOTIFY_POOL_SIZE && conn == NULL; i++) {
+		if (!pool[i].in_use && pool[i].host != NULL && strcmp(pool[i].host, host) == 0)
+			conn = &pool[i];
+	}
+	for (int i = 0; i < SPOTIFY_POOL_SIZE && conn == NULL; i++) {
+		if (!pool[i].in_use && pool[i].client == NULL)
+			conn = &pool[i];
+	}
+	for (int i = 0; i < SPOTIFY_POOL_SIZE && conn == NULL; i++) {
+		if (!pool[i].in_use)
+			conn = &pool[i];
+	}
+	conn->in_use = true;
+	conn->priority = priority;
+	conn->abort = false;
+	xSemaphoreGive(pool_mutex);
+	return conn;
+}
+
+void spotify_pool_release(spotify_response_t *response)
+{
+	spotify_conn_t *conn = response->conn;
+	if (conn == NULL)
+		return;
+
+	memset(conn->response_buf, 0, response->data_len + 1);
+	xSemaphoreTake(pool_mutex, portMAX_DELAY);
+	conn->in_use = false;
+	conn->abort = false;
+	xSemaphoreGive(pool_mutex);
+	xSemaphoreGive(pool_free);
+	response->conn = NULL;
+	response->data = NULL;
+}
+
+static bool _pool_cancelled(spotify_conn_t *conn, const spotify_request_t *request)
+{
+	return conn->abort || (request->cancel != NULL && *request->cancel);
+}
+
+static void _pool_record_latency(spotify_priority_t priority, esp_err_t err, uint32_t elapsed_us, uint32_t wait_us)
+{
+	xSemaphoreTake(pool_mutex, portMAX_DELAY);
+	latency_stats.commands++;
+	latency_stats.last_us = elapsed_us;
+	if (elapsed_us > latency_stats.worst_us)
+		latency_stats.worst_us = elapsed_us;
+	if (wait_us > latency_stats.worst_wait_us)
+		latency_stats.worst_wait_us = wait_us;
+	if (priority == SPOTIFY_PRIORITY_CRITICAL && err == ESP_OK) {
+		latency_samples[latency_sample_count % SPOTIFY_HEDGE_SAMPLES] = elapsed_us / 1000;
+		latency_sample_count++;
+	}
+	xSemaphoreGive(pool_mutex);
+}
+
+static spotify_breaker_outcome_t _pool_breaker_outcome(esp_err_t err, const spotify_response_t *response)
+{
+	// Cancelled requests say nothing about the health of the host.
+	if (response->aborted)
+		return SPOTIFY_BREAKER_NEUTRAL;
+	if (err != ESP_OK && response->status_code == 0)
+		return SPOTIFY_BREAKER_FAILURE;
+	if (response->status_code >= 500)
+		return SPOTIFY_BREAKER_FAILURE;
+	return SPOTIFY_BREAKER_SUCCESS;
+}
+
+/**
+ * A request that can be cancelled waits for its headers in SPOTIFY_CANCEL_SLICE_MS slices rather
+ * than in one esp_http_client_fetch_headers call that may block for the whole timeout; the client
+ * resumes parsing where the previous slice stopped. A slice that fails before its end is a real
+ * error, one that runs to its end only means nothing arrived yet.
+ */
+static esp_err_t _pool_fetch_headers(spotify_conn_t *conn, const spotify_request_t *request, int timeout_ms,
+		spotify_response_t *response)
+{
+	if (request->priority != SPOTIFY_PRIORITY_POLL && request->cancel == NULL)
+		return esp_http_client_fetch_headers(conn->client) < 0 ? ESP_FAIL : ESP_OK;
+
+	esp_err_t err = ESP_ERR_TIMEOUT;
+	uint32_t start = time_millis();
+	esp_http_client_set_timeout_ms(conn->client, SPOTIFY_CANCEL_SLICE_MS);
+	for (;;) {
+		if (_pool_cancelled(conn, request)) {
+			response->aborted = true;
+			err = ESP_ERR_INVALID_STATE;
+			break;
+		}
+		uint32_t slice_start = time_millis();
+		if (esp_http_client_fetch_headers(conn->client) >= 0) {
+			err = ESP_OK;
+			break;
+		}
+		if (time_millis() - slice_start < SPOTIFY_CANCEL_SLICE_MS / 2) {
+			err = ESP_FAIL;
+			break;
+		}
+		if (time_millis() - start >= (uint32_t)timeout_ms)
+			break;
+	}
+	// the body is read with the full timeout
+	esp_http_client_set_timeout_ms(conn->client, timeout_ms);
+	return err;
+}
+
+static esp_err_t _pool_send(spotify_conn_t *conn, const spotify_request_t *request, int timeout_ms,
+		spotify_response_t *response)
+{
+	int body_len = request->body ? strlen(request->body) : 0;
+	esp_err_t err = esp_http_client_open(conn->client, body_len);
+	if (err != ESP_OK)
+		return err;
+	if (body_len > 0 && esp_http_client_write(conn->client, request->body, body_len) != body_len)
+		return ESP_FAIL;
+	return _pool_fetch_headers(conn, request, timeout_ms, response);
+}
+
+esp_err_t spotify_pool_request(const spotify_request_t *request, spotify_response_t *response)
+{
+	uint32_t start_us = time_micros();
+	int timeout_ms = request->timeout_ms > 0 ? request->timeout_ms : SPOTIFY_POOL_DEFAULT_TIMEOUT_MS;
+	char url[SPOTIFY_URL_MAX_LENGTH];
+	memset(response, 0, sizeof(spotify_response_t));
+
+	if (!spotify_breaker_allow(request->host)) {
+		ESP_LOGD(TAG, "Circuit for %s is open, failing fast", request->host);
+		return SPOTIFY_ERR_CIRCUIT_OPEN;
+	}
+	const char *target = request->host;
+#ifdef CONFIG_SPOTIFY_DNS_CACHE
+	// Connect to the cached address; TLS still uses the host name for SNI and verification.
+	char ip[SPOTIFY_DNS_IP_LENGTH];
+	if (spotify_dns_resolve(request->host, ip, sizeof(ip)) == ESP_OK)
+		target = ip;
+#endif
+	snprintf(url, sizeof(url), "https://%s%s", target, request->path);
+	spotify_conn_t *conn = _pool_acquire(request->host, request->priority, pdMS_TO_TICKS(timeout_ms));
+	if (conn == NULL) {
+		ESP_LOGW(TAG, "No pooled connection available for %s", request->host);
+		spotify_breaker_report(request->host, SPOTIFY_BREAKER_NEUTRAL);
+		return ESP_ERR_TIMEOUT;
+	}
+	uint32_t wait_us = time_micros() - start_us;
+	response->conn = conn;
+	response->data = conn->response_buf;
+
+	if (conn->client != NULL && (conn->host == NULL || strcmp(conn->host, request->host) != 0)) {
+		// The TLS server name is fixed at init, so a connection switching hosts starts over.
+		esp_http_client_cleanup(conn->client);
+		conn->client = NULL;
+	}
+	bool reused = conn->client != NULL;
+	if (conn->client == NULL) {
+		esp_http_client_config_t config = {
+			.url = url,
+			.common_name = request->host,
+			.transport_type = HTTP_TRANSPORT_OVER_SSL,
+			// the request line of a batched lookup carries up to 50 IDs
+			.buffer_size_tx = SPOTIFY_TX_BUF_SIZE,
+			.event_handler = _pool_event_handler,
+			.user_data = conn,
+			.timeout_ms = timeout_ms,
+		};
+		conn->client = esp_http_client_init(&config);
+		if (conn->client == NULL) {
+			spotify_pool_release(response);
+			spotify_breaker_report(request->host, SPOTIFY_BREAKER_NEUTRAL);
+			return ESP_ERR_NO_MEM;
+		}
+	} else {
+		esp_http_client_set_url(conn->client, url);
+		esp_http_client_set_timeout_ms(conn->client, timeout_ms);
+	}
+	conn->host = request->host;
+
+	esp_http_client_set_method(conn->client, request->method);
+	esp_http_client_set_header(conn->client, "Host", request->host);
+	esp_http_client_set_header(conn->client, "Accept", request->accept ? request->accept : "application/json");
+	esp_http_client_set_header(conn->client, "Content-Type", request->content_type ? request->content_type : "application/json");
+	if (request->authorization)
+		esp_http_client_set_header(conn->client, "Authorization", request->authorization);
+	else
+		esp_http_client_delete_header(conn->client, "Authorization");
+
+	esp_err_t err = ESP_OK;
+	// Nothing was written yet, so the connection goes back to the pool untouched.
+	if (_pool_cancelled(conn, request)) {
+		response->aborted = true;
+		err = ESP_ERR_INVALID_STATE;
+		goto done;
+	}
+	conn->retry_after_sec = 0;
+	err = _pool_send(conn, request, timeout_ms, response);
+	if (err != ESP_OK && reused && !response->aborted) {
+		// The server may have closed an idle keep-alive connection; reconnect once.
+		ESP_LOGD(TAG, "Stale pooled connection to %s, reconnecting", request->host);
+		esp_http_client_close(conn->client);
+		err = _pool_send(conn, request, timeout_ms, response);
+	}
+	if (response->aborted) {
+		ESP_LOGD(TAG, "Request to %s%s aborted before its headers", request->host, request->path);
+		goto drop;
+	}
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG, "Request to %s failed: %s", request->host, esp_err_to_name(err));
+		goto drop;
+	}
+	response->status_code = esp_http_client_get_status_code(conn->client);
+	response->retry_after_sec = conn->retry_after_sec;
+
+	// Successful bodies of streamed requests go to the callback chunk by chunk, errors are buffered.
+	bool streamed = request->on_data != NULL && response->status_code >= 200 && response->status_code < 300;
+
+	// Read one chunk at a time so a preempted poll is abandoned at the next read boundary.
+	while (!esp_http_client_is_complete_data_received(conn->client)) {
+		if (_pool_cancelled(conn, request)) {
+			ESP_LOGD(TAG, "Request to %s%s aborted", request->host, request->path);
+			response->aborted = true;
+			err = ESP_ERR_INVALID_STATE;
+			goto drop;
+		}
+		if (response->data_len >= SPOTIFY_RESPONSE_BUF_SIZE - 1 && request->allow_truncated) {
+			// The caller only needs the head of the document: stop here, the rest is discarded.
+			response->truncated = true;
+			goto drop;
+		}
+		if (response->data_len >= SPOTIFY_RESPONSE_BUF_SIZE - 1) {
+			ESP_LOGW(TAG, "Response from %s does not fit in %d bytes", request->path, SPOTIFY_RESPONSE_BUF_SIZE);
+			err = ESP_ERR_INVALID_SIZE;
+			goto drop;
+		}
+		int data_read = esp_http_client_read(conn->client, response->data + response->data_len,
+				SPOTIFY_RESPONSE_BUF_SIZE - 1 - response->data_len);
+		if (data_read < 0) {
+			err = ESP_FAIL;
+			goto drop;
+		}
+		if (data_read == 0)
+			break;
+		if (!streamed) {
+			response->data_len += data_read;
+			continue;
+		}
+		response->data[data_read] = '\0';
+		err = request->on_data(request->ctx, response->data, data_read);
+		if (err != ESP_OK)
+			goto drop;
+	}
+	if (esp_http_client_is_complete_data_received(conn->client))
+		goto done;
+	// A read of 0 before the end of the body is a read timeout or an early close by the peer:
+	// the body is cut short and must not reach the caller as a complete one.
+	ESP_LOGW(TAG, "Response from %s%s ended before the end of its body", request->host, request->path);
+	err = ESP_ERR_TIMEOUT;
+
+drop:
+	// A half-read response leaves the stream in an unknown state: drop the socket, keep the slot.
+	esp_http_client_close(conn->client);
+done:
+	response->data[response->data_len] = '\0';
+	if (err != ESP_OK && response->status_code == 0 && !response->aborted)
+		spotify_dns_invalidate(request->host);
+	spotify_breaker_report(request->host, _pool_breaker_outcome(err, response));
+	// Hedge legs are accounted for once, by spotify_pool_request_hedged.
+	if (request->priority != SPOTIFY_PRIORITY_POLL && request->cancel == NULL) {
+		uint32_t elapsed_us = time_micros() - start_us;
+		_pool_record_latency(request->priority, err, elapsed_us, wait_us);
+		ESP_LOGD(TAG, "Command %s took %u us (waited %u us for a connection)", request->path, elapsed_us, wait_us);
+	}
+	return err;
+}
+
+static uint32_t _hedge_threshold_ms(void)
+{
+	uint32_t sorted[SPOTIFY_HEDGE_SAMPLES];
+	xSemaphoreTake(pool_mutex, portMAX_DELAY);
+	uint32_t count = latency_sample_count < SPOTIFY_HEDGE_SAMPLES ? latency_sample_count : SPOTIFY_HEDGE_SAMPLES;
+	memcpy(sorted, latency_samples, count * sizeof(uint32_t));
+	xSemaphoreGive(pool_mutex);
+	if (count < SPOTIFY_HEDGE_MIN_SAMPLES)
+		return CONFIG_SPOTIFY_HEDGE_DELAY_MS;
+
+	for (uint32_t i = 1; i < count; i++) {
+		uint32_t value = sorted[i];
+		int j = i - 1;
+		while (j >= 0 && sorted[j] > value) {
+			sorted[j + 1] = sorted[j];
+			j--;
+		}
+		sorted[j + 1] = value;
+	}
+	return sorted[(count * 95) / 100];
+}
+
+static void _hedge_worker(void *pvParameter)
+{
+	spotify_hedge_leg_t *leg = (spotify_hedge_leg_t*)pvParameter;
+	for(;;) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		esp_err_t err = spotify_pool_request(&leg->request, &leg->response);
+		xSemaphoreTake(hedge_state_mutex, portMAX_DELAY);
+		leg->err = err;
+		if (leg->state == HEDGE_LEG_ABANDONED) {
+			// The other leg already answered the caller.
+			spotify_pool_release(&leg->response);
+			leg->state = HEDGE_LEG_IDLE;
+		} else {
+			leg->state = HEDGE_LEG_DONE;
+			xSemaphoreGive(hedge_done);
+		}
+		xSemaphoreGive(hedge_state_mutex);
+	}
+}
+
+static bool _hedge_start_workers(void)
+{
+	for (int i = 0; i < 2; i++) {
+		if (hedge_legs[i].worker != NULL)
+			continue;
+		hedge_legs[i].state = HEDGE_LEG_IDLE;
+		if (xTaskCreate(&_hedge_worker, "spotify_hedge", SPOTIFY_HEDGE_TASK_STACK, &hedge_legs[i],
+				SPOTIFY_HEDGE_TASK_PRIORITY, &hedge_legs[i].worker) != pdPASS) {
+			hedge_legs[i].worker = NULL;
+			return false;
+		}
+	}
+	return true;
+}
+
+static void _hedge_dispatch(spotify_hedge_leg_t *leg, const spotify_request_t *request)
+{
+	leg->request = *request;
+	snprintf(leg->path, sizeof(leg->path), "%s", request->path);
+	snprintf(leg->authorization, sizeof(leg->authorization), "%s", request->authorization ? request->authorization : "");
+	leg->request.path = leg->path;
+	leg->request.authorization = request->authorization ? leg->authorization : NULL;
+	leg->request.cancel = &leg->cancel;
+	leg->cancel = false;
+	leg->state = HEDGE_LEG_RUNNING;
+	xTaskNotifyGive(leg->worker);
+}
+
+esp_err_t spotify_pool_request_hedged(const spotify_request_t *request, spotify_response_t *response)
+{
+#ifdef CONFIG_SPOTIFY_HEDGED_REQUESTS
+	// Only idempotent requests without a body can safely be sent twice.
+	if (SPOTIFY_POOL_SIZE < 2 || request->body != NULL || request->priority != SPOTIFY_PRIORITY_CRITICAL
+			|| (request->authorization && strlen(request->authorization) >= SPOTIFY_HEDGE_AUTH_LENGTH))
+		return spotify_pool_request(request, response);
+
+	uint32_t start_us = time_micros();
+	xSemaphoreTake(hedge_mutex, portMAX_DELAY);
+	if (!_hedge_start_workers()) {
+		xSemaphoreGive(hedge_mutex);
+		return spotify_pool_request(request, response);
+	}
+
+	// A loser from a previous call may still be draining on one of the workers.
+	spotify_hedge_leg_t *primary = NULL;
+	spotify_hedge_leg_t *secondary = NULL;
+	xSemaphoreTake(hedge_state_mutex, portMAX_DELAY);
+	for (int i = 0; i < 2; i++) {
+		if (hedge_legs[i].state != HEDGE_LEG_IDLE)
+			continue;
+		if (primary == NULL)
+			primary = &hedge_legs[i];
+		else
+			secondary = &hedge_legs[i];
+	}
+	if (primary != NULL)
+		_hedge_dispatch(primary, request);
+	xSemaphoreGive(hedge_state_mutex);
+	if (primary == NULL) {
+		xSemaphoreGive(hedge_mutex);
+		return spotify_pool_request(request, response);
+	}
+
+	uint32_t threshold_ms = _hedge_threshold_ms();
+	bool hedged = false;
+	spotify_hedge_leg_t *winner = NULL;
+	while (winner == NULL) {
+		TickType_t wait = (!hedged && secondary != NULL) ? pdMS_TO_TICKS(threshold_ms) : portMAX_DELAY;
+		bool woke = xSemaphoreTake(hedge_done, wait) == pdTRUE;
+
+		xSemaphoreTake(hedge_state_mutex, portMAX_DELAY);
+		bool primary_done = primary->state == HEDGE_LEG_DONE;
+		bool secondary_done = hedged && secondary->state == HEDGE_LEG_DONE;
+		if (primary_done && primary->err == ESP_OK)
+			winner = primary;
+		else if (secondary_done && secondary->err == ESP_OK)
+			winner = secondary;
+		else if (primary_done && (secondary == NULL || secondary_done))
+			winner = primary;
+		// No answer within the threshold, or a fast failure: send the second copy.
+		if (winner == NULL && !hedged && secondary != NULL && (!woke || primary_done)) {
+			ESP_LOGD(TAG, "No response to %s after %u ms, hedging", request->path, threshold_ms);
+			_hedge_dispatch(secondary, request);
+			hedged = true;
+			// Same lock order as spotify_pool_release() under hedge_state_mutex.
+			xSemaphoreTake(pool_mutex, portMAX_DELAY);
+			latency_stats.hedges_sent++;
+			xSemaphoreGive(pool_mutex);
+		}
+		if (winner != NULL) {
+			*response = winner->response;
+			winner->state = HEDGE_LEG_IDLE;
+			spotify_hedge_leg_t *loser = winner == primary ? secondary : primary;
+			if (loser != NULL && loser->state == HEDGE_LEG_RUNNING) {
+				loser->cancel = true;
+				loser->state = HEDGE_LEG_ABANDONED;
+			} else if (loser != NULL && loser->state == HEDGE_LEG_DONE) {
+				spotify_pool_release(&loser->response);
+				loser->state = HEDGE_LEG_IDLE;
+			}
+			// Drop a completion signalled by the loser before it was abandoned.
+			xSemaphoreTake(hedge_done, 0);
+			if (winner == secondary)
+				latency_stats.hedges_won++;
+		}
+		xSemaphoreGive(hedge_state_mutex);
+	}
+	esp_err_t err = winner->err;
+	xSemaphoreGive(hedge_mutex);
+
+	uint32_t elapsed_us = time_micros() - start_us;
+	_pool_record_latency(request->priority, err, elapsed_us, 0);
+	ESP_LOGD(TAG, "Critical command %s took %u us (hedge threshold %u ms)", request->path, elapsed_us, threshold_ms);
+	return err;
+#else
+	return spotify_pool_request(request, response);
+#endif
+}
+
+void spotify_pool_get_latency_stats(spotify_latency_stats_t *stats)
+{
+	xSemaphoreTake(pool_mutex, portMAX_DELAY);
+	*stats = latency_stats;
+	xSemaphoreGive(pool_mutex);
+	stats->hedge_threshold_ms = _hedge_threshold_ms();
+}
+
+void spotify_pool_set_preemption(bool enabled)
+{
+#ifdef CONFIG_SPOTIFY_POLL_PREEMPTION
+	preemption_enabled = enabled;
+#endif
+}
+
+void spotify_pool_reset_latency_stats(void)
+{
+	xSemaphoreTake(pool_mutex, portMAX_DELAY);
+	memset(&latency_stats, 0, sizeof(latency_stats));
+	latency_sample_count = 0;
+	xSemaphoreGive(pool_mutex);
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+
+#include "spotify_record.h"
+#include "time_manager.h"
+
+_Static_assert(sizeof(spotify_track_record_t) == 168, "spotify_track_record_t layout changed");
+_Static_assert(sizeof(spotify_artist_record_t) == 96, "spotify_artist_record_t layout changed");
+_Static_assert(sizeof(spotify_album_record_t) == 168, "spotify_album_record_t layout changed");
+
+static const char *TAG = "SpotifyRecord";
+
+
+/* the CRC is the last member of every record */
+static uint32_t _record_crc(const void *record, size_t size)
+{
+	return esp_rom_crc32_le(0, (const uint8_t*)record, size - sizeof(uint32_t));
+}
+
+static void _record_copy_id(char *id, size_t size, cJSON *uri)
+{
+	// "spotify:artist:<id>"
+	const char *value = cJSON_IsString(uri) ? uri->valuestring : "";
+	const char *colon = strrchr(value, ':');
+	snprintf(id, size, "%s", colon ? colon + 1 : value);
+}
+
+void spotify_record_seal(void *record, spotify_record_type_t type, size_t size)
+{
+	spotify_record_header_t *header = (spotify_record_header_t*)record;
+	header->type = type;
+	header->version = SPOTIFY_RECORD_VERSION;
+	header->length = size;
+	uint32_t crc = _record_crc(record, size);
+	memcpy((uint8_t*)record + size - sizeof(uint32_t), &crc, sizeof(uint32_t));
+}
+
+bool spotify_record_check(const void *record, spotify_record_type_t type, size_t size)
+{
+	const spotify_record_header_t *header = (const spotify_record_header_t*)record;
+	if (header->type != type || header->version != SPOTIFY_RECORD_VERSION || header->length != size)
+		return false;
+	uint32_t crc;
+	memcpy(&crc, (const uint8_t*)record + size - sizeof(uint32_t), sizeof(uint32_t));
+	return crc == _record_crc(record, size);
+}
+
+void spotify_track_record_from_track(const spotify_track_t *track, spotify_track_record_t *record)
+{
+	memset(record, 0, sizeof(spotify_track_record_t));
+	record->duration_ms = track->duration_ms;
+	memcpy(record->track_id, track->track_id, sizeof(record->track_id));
+	memcpy(record->track_name, track->track_name, sizeof(record->track_name));
+	if (track->num_artists > 0)
+		memcpy(record->artist_name, track->artists[0], sizeof(record->artist_name));
+	record->num_artists = track->num_artists;
+	spotify_record_seal(record, SPOTIFY_RECORD_TRACK, sizeof(spotify_track_record_t));
+}
+
+void spotify_artist_record_from_json(cJSON *artist, spotify_artist_record_t *record)
+{
+	memset(record, 0, sizeof(spotify_artist_record_t));
+	cJSON *name = cJSON_GetObjectItem(artist, "name");
+	_record_copy_id(record->artist_id, sizeof(record->artist_id), cJSON_GetObjectItem(artist, "uri"));
+	snprintf(record->artist_name, sizeof(record->artist_name), "%s", cJSON_IsString(name) ? name->valuestring : "");
+	spotify_record_seal(record, SPOTIFY_RECORD_ARTIST, sizeof(spotify_artist_record_t));
+}
+
+void spotify_album_record_from_json(cJSON *album, spotify_album_record_t *record)
+{
+	memset(record, 0, sizeof(spotify_album_record_t));
+	cJSON *name = cJSON_GetObjectItem(album, "name");
+	_record_copy_id(record->album_id, sizeof(record->album_id), cJSON_GetObjectItem(album, "uri"));
+	snprintf(record->album_name, sizeof(record->album_name), "%s", cJSON_IsString(name) ? name->valuestring : "");
+	// Spotify lists the images largest first; the smallest is the one the display can hold.
+	cJSON *images = cJSON_GetObjectItem(album, "images");
+	cJSON *url = cJSON_GetObjectItem(cJSON_GetArrayItem(images, cJSON_GetArraySize(images) - 1), "url");
+	if (cJSON_IsString(url))
+		snprintf(record->image_url, sizeof(record->image_url), "%s", url->valuestring);
+	spotify_record_seal(record, SPOTIFY_RECORD_ALBUM, sizeof(spotify_album_record_t));
+}
+
+#if CONFIG_DEBUG_SPOTIFY_CLIENT > 0
+static const char *bench_track_json =
+	"{\"uri\":\"spotify:track:4iV5W9uYEdYUVa79Axb7Rh\",\"name\":\"Never Gonna Give You Up\","
+	"\"duration_ms\":213573,\"artists\":[{\"name\":\"Rick Astley\",\"uri\":\"spotify:artist:0gxyHStUsqpMadRV0Di1Qt\"}],"
+	"\"album\":{\"name\":\"Whenever You Need Somebody\",\"uri\":\"spotify:album:6N9PS4QXF1D0OWPk0Sxtb4\","
+	"\"images\":[{\"height\":64,\"width\":64,\"url\":\"https://i.scdn.co/image/ab67616d00004851baf89eb11ec7c657805d2da0\"}]}}";
+
+void spotify_record_benchmark(void)
+{
+	spotify_track_t track;
+	cJSON *json = cJSON_Parse(bench_track_json);
+	if (json == NULL)
+		return;
+	spotify_parse_track(json, &track);
+	cJSON_Delete(json);
+
+	// JSON path: what handing a track to another task costs without a binary form.
+	uint32_t start = time_micros();
+	size_t json_len = 0;
+	for (int i = 0; i < SPOTIFY_RECORD_BENCH_ROUNDS; i++) {
+		cJSON *root = cJSON_Parse(bench_track_json);
+		char *text = cJSON_PrintUnformatted(root);
+		cJSON_Delete(root);
+		json_len = strlen(text);
+		root = cJSON_Parse(text);
+		spotify_parse_track(root, &track);
+		cJSON_Delete(root);
+		free(text);
+	}
+	uint32_t json_us = time_micros() - start;
+
+	spotify_track_record_t record;
+	spotify_track_record_t copy;
+	int valid = 0;
+	start = time_micros();
+	for (int i = 0; i < SPOTIFY_RECORD_BENCH_ROUNDS; i++) {
+		spotify_track_record_from_track(&track, &record);
+		memcpy(&copy, &record, sizeof(copy));
+		valid += spotify_record_check(&copy, SPOTIFY_RECORD_TRACK, sizeof(copy));
+	}
+	uint32_t record_us = time_micros() - start;
+
+	ESP_LOGI(TAG, "JSON round trip: %u us/track, %u bytes", json_us / SPOTIFY_RECORD_BENCH_ROUNDS, json_len);
+	ESP_LOGI(TAG, "Record seal+copy+check: %u us/track, %u bytes (%d/%d valid)", record_us / SPOTIFY_RECORD_BENCH_ROUNDS,
+			sizeof(spotify_track_record_t), valid, SPOTIFY_RECORD_BENCH_ROUNDS);
+}
+#else
+void spotify_record_benchmark(void)
+{
+}
+#endif
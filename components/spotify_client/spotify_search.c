@@ -0,0 +1,480 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "spotify_search.h"
+#include "spotify_history.h"
+#include "spotify_playlist.h"
+#include "spotify_storage.h"
+#include "spotify_stream.h"
+#include "time_manager.h"
+
+#define SPOTIFY_SEARCH_NVS_KEY  "search_idx"
+#define SPOTIFY_SEARCH_VERSION  1
+#define SPOTIFY_TRACK_URI_PREFIX "spotify:track:"
+
+typedef struct spotify_search_entry_t
+{
+	uint16_t id;
+	uint16_t title;
+	uint16_t artist;
+} spotify_search_entry_t;
+
+typedef struct spotify_search_token_t
+{
+	uint16_t offset;
+	uint16_t entry;
+} spotify_search_token_t;
+
+/* serialized as this header followed by the used part of each array */
+typedef struct spotify_search_header_t
+{
+	uint16_t version;
+	uint16_t entry_count;
+	uint16_t token_count;
+	uint16_t pool_len;
+} spotify_search_header_t;
+
+typedef struct spotify_search_index_t
+{
+	spotify_search_header_t header;
+	spotify_search_entry_t entries[SPOTIFY_SEARCH_MAX_ENTRIES];
+	spotify_search_token_t tokens[SPOTIFY_SEARCH_MAX_TOKENS];
+	char pool[SPOTIFY_SEARCH_POOL_SIZE];
+} spotify_search_index_t;
+
+typedef struct spotify_search_word_t
+{
+	const char *text;
+	int len;
+} spotify_search_word_t;
+
+typedef struct spotify_search_remote_t
+{
+	search_result_t *results;
+	int max;
+	int count;
+	char *cursor;
+	const char *end;
+} spotify_search_remote_t;
+
+static const char *TAG = "SpotifySearch";
+static spotify_search_index_t search_index;
+static SemaphoreHandle_t search_mutex = NULL;
+static const char *sort_pool = NULL;
+
+
+static bool _search_is_word(char c)
+{
+	return isalnum((unsigned char)c) || (unsigned char)c >= 0x80;
+}
+
+static int _search_fold(char c)
+{
+	return tolower((unsigned char)c);
+}
+
+/* compares the token at a with the token at b, case-insensitively */
+static int _search_token_cmp(const void *a, const void *b)
+{
+	const char *x = sort_pool + ((const spotify_search_token_t*)a)->offset;
+	const char *y = sort_pool + ((const spotify_search_token_t*)b)->offset;
+	while (_search_is_word(*x) && _search_is_word(*y)) {
+		int diff = _search_fold(*x) - _search_fold(*y);
+		if (diff != 0)
+			return diff;
+		x++;
+		y++;
+	}
+	return _search_is_word(*x) - _search_is_word(*y);
+}
+
+/* 0 if word is a prefix of the token at token, otherwise the sort order of token against word */
+static int _search_prefix_cmp(const char *token, const spotify_search_word_t *word)
+{
+	for (int i = 0; i < word->len; i++) {
+		if (!_search_is_word(token[i]))
+			return -1;
+		int diff = _search_fold(token[i]) - _search_fold(word->text[i]);
+		if (diff != 0)
+			return diff;
+	}
+	return 0;
+}
+
+static int _search_split(const char *query, spotify_search_word_t *words)
+{
+	int count = 0;
+	const char *p = query;
+	while (*p && count < SPOTIFY_SEARCH_MAX_WORDS) {
+		while (*p && !_search_is_word(*p))
+			p++;
+		if (!*p)
+			break;
+		words[count].text = p;
+		while (_search_is_word(*p))
+			p++;
+		words[count].len = p - words[count].text;
+		count++;
+	}
+	return count;
+}
+
+static uint16_t _search_intern(spotify_search_index_t *index, const char *text)
+{
+	size_t len = strlen(text) + 1;
+	if (index->header.pool_len + len > SPOTIFY_SEARCH_POOL_SIZE)
+		return UINT16_MAX;
+	uint16_t offset = index->header.pool_len;
+	memcpy(&index->pool[offset], text, len);
+	index->header.pool_len += len;
+	return offset;
+}
+
+static void _search_tokenize(spotify_search_index_t *index, uint16_t offset, uint16_t entry)
+{
+	const char *text = &index->pool[offset];
+	for (int i = 0; text[i] && index->header.token_count < SPOTIFY_SEARCH_MAX_TOKENS; i++) {
+		if (_search_is_word(text[i]) && (i == 0 || !_search_is_word(text[i - 1]))) {
+			index->tokens[index->header.token_count].offset = offset + i;
+			index->tokens[index->header.token_count].entry = entry;
+			index->header.token_count++;
+		}
+	}
+}
+
+static void _search_add(spotify_search_index_t *index, const char *id, const char *title, const char *artist)
+{
+	if (id[0] == '\0' || index->header.entry_count >= SPOTIFY_SEARCH_MAX_ENTRIES)
+		return;
+	for (int i = 0; i < index->header.entry_count; i++) {
+		if (strcmp(&index->pool[index->entries[i].id], id) == 0)
+			return;
+	}
+	uint16_t pool_len = index->header.pool_len;
+	spotify_search_entry_t entry = {
+		.id = _search_intern(index, id),
+		.title = _search_intern(index, title),
+		.artist = _search_intern(index, artist),
+	};
+	if (entry.id == UINT16_MAX || entry.title == UINT16_MAX || entry.artist == UINT16_MAX) {
+		index->header.pool_len = pool_len;
+		return;
+	}
+	uint16_t n = index->header.entry_count++;
+	index->entries[n] = entry;
+	_search_tokenize(index, entry.title, n);
+	_search_tokenize(index, entry.artist, n);
+}
+
+/* best weight of word among the words of text: exact word beats prefix, leading word gets a bonus */
+static int _search_word_score(const char *text, const spotify_search_word_t *word, int weight)
+{
+	int best = 0;
+	for (int i = 0; text[i]; i++) {
+		if (!_search_is_word(text[i]) || (i > 0 && _search_is_word(text[i - 1])))
+			continue;
+		if (_search_prefix_cmp(&text[i], word) != 0)
+			continue;
+		int score = weight * (_search_is_word(text[i + word->len]) ? 1 : 2) + (i == 0 ? 1 : 0);
+		if (score > best)
+			best = score;
+	}
+	return best;
+}
+
+static int _search_score(const spotify_search_entry_t *entry, const spotify_search_word_t *words, int count,
+		const char *query)
+{
+	const char *title = &search_index.pool[entry->title];
+	const char *artist = &search_index.pool[entry->artist];
+	int total = 0;
+	for (int i = 0; i < count; i++) {
+		int title_score = _search_word_score(title, &words[i], 3);
+		int artist_score = _search_word_score(artist, &words[i], 2);
+		int score = title_score > artist_score ? title_score : artist_score;
+		if (score == 0)
+			return -1;
+		total += score;
+	}
+	if (strcasecmp(title, query) == 0)
+		total += 10;
+	return total;
+}
+
+static const char* _search_store(char **cursor, const char *end, const char *prefix, const char *value)
+{
+	int len = snprintf(*cursor, end - *cursor, "%s%s", prefix, value);
+	if (len < 0 || *cursor + len >= end)
+		return "";
+	const char *stored = *cursor;
+	*cursor += len + 1;
+	return stored;
+}
+
+static esp_err_t _search_save(const spotify_search_index_t *index)
+{
+	size_t entries_len = index->header.entry_count * sizeof(spotify_search_entry_t);
+	size_t tokens_len = index->header.token_count * sizeof(spotify_search_token_t);
+	size_t len = sizeof(spotify_search_header_t) + entries_len + tokens_len + index->header.pool_len;
+	uint8_t *blob = (uint8_t*)malloc(len);
+	if (blob == NULL)
+		return ESP_ERR_NO_MEM;
+	uint8_t *p = blob;
+	memcpy(p, &index->header, sizeof(spotify_search_header_t));
+	p += sizeof(spotify_search_header_t);
+	memcpy(p, index->entries, entries_len);
+	p += entries_len;
+	memcpy(p, index->tokens, tokens_len);
+	p += tokens_len;
+	memcpy(p, index->pool, index->header.pool_len);
+	esp_err_t err = spotify_storage_set_blob(SPOTIFY_SEARCH_NVS_KEY, blob, len);
+	free(blob);
+	return err;
+}
+
+static esp_err_t _search_load(spotify_search_index_t *index)
+{
+	size_t len = sizeof(spotify_search_index_t);
+	uint8_t *blob = (uint8_t*)malloc(len);
+	if (blob == NULL)
+		return ESP_ERR_NO_MEM;
+	esp_err_t err = spotify_storage_get_blob(SPOTIFY_SEARCH_NVS_KEY, blob, &len);
+	if (err != ESP_OK)
+		goto cleanup;
+
+	spotify_search_header_t header;
+	memcpy(&header, blob, sizeof(header));
+	size_t entries_len = header.entry_count * sizeof(spotify_search_entry_t);
+	size_t tokens_len = header.token_count * sizeof(spotify_search_token_t);
+	if (header.version != SPOTIFY_SEARCH_VERSION || header.entry_count > SPOTIFY_SEARCH_MAX_ENTRIES
+			|| header.token_count > SPOTIFY_SEARCH_MAX_TOKENS || header.pool_len > SPOTIFY_SEARCH_POOL_SIZE
+			|| len != sizeof(header) + entries_len + tokens_len + header.pool_len) {
+		err = ESP_ERR_INVALID_SIZE;
+		goto cleanup;
+	}
+	const uint8_t *p = blob + sizeof(header);
+	index->header = header;
+	memcpy(index->entries, p, entries_len);
+	p += entries_len;
+	memcpy(index->tokens, p, tokens_len);
+	p += tokens_len;
+	memcpy(index->pool, p, header.pool_len);
+cleanup:
+	free(blob);
+	return err;
+}
+
+esp_err_t spotify_search_init(void)
+{
+	if (search_mutex == NULL) {
+		search_mutex = xSemaphoreCreateMutex();
+		if (search_mutex == NULL)
+			return ESP_ERR_NO_MEM;
+	}
+	memset(&search_index.header, 0, sizeof(spotify_search_header_t));
+	if (_search_load(&search_index) != ESP_OK) {
+		memset(&search_index.header, 0, sizeof(spotify_search_header_t));
+		return ESP_OK;
+	}
+	ESP_LOGI(TAG, "Restored index of %u tracks", search_index.header.entry_count);
+	return ESP_OK;
+}
+
+esp_err_t spotify_search_rebuild(void)
+{
+	spotify_search_index_t *index = (spotify_search_index_t*)calloc(1, sizeof(spotify_search_index_t));
+	spotify_history_entry_t *history = (spotify_history_entry_t*)malloc(sizeof(spotify_history_entry_t) * SPOTIFY_HISTORY_SIZE);
+	spotify_playlist_track_t *tracks = (spotify_playlist_track_t*)malloc(sizeof(spotify_playlist_track_t) * SPOTIFY_PLAYLIST_MAX_TRACKS);
+	esp_err_t err = ESP_ERR_NO_MEM;
+	if (index == NULL || history == NULL || tracks == NULL)
+		goto cleanup;
+
+	uint32_t start = time_micros();
+	index->header.version = SPOTIFY_SEARCH_VERSION;
+	// Most recent plays first: on equal scores earlier entries rank higher.
+	int count = spotify_history_get(history, SPOTIFY_HISTORY_SIZE);
+	for (int i = 0; i < count; i++)
+		_search_add(index, history[i].track.track_id, history[i].track.track_name,
+				history[i].track.artist_name);
+	for (int slot = 0; slot < SPOTIFY_PLAYLIST_CACHE_SLOTS; slot++) {
+		count = spotify_playlist_get_cached(slot, tracks);
+		for (int i = 0; i < count; i++)
+			_search_add(index, tracks[i].track_id, tracks[i].track_name, tracks[i].artist_name);
+	}
+
+	xSemaphoreTake(search_mutex, portMAX_DELAY);
+	sort_pool = index->pool;
+	qsort(index->tokens, index->header.token_count, sizeof(spotify_search_token_t), _search_token_cmp);
+	// Unchanged library: keep the copy in flash as it is.
+	bool changed = memcmp(&index->header, &search_index.header, sizeof(spotify_search_header_t)) != 0
+			|| memcmp(index->pool, search_index.pool, index->header.pool_len) != 0;
+	if (changed)
+		memcpy(&search_index, index, sizeof(spotify_search_index_t));
+	xSemaphoreGive(search_mutex);
+	ESP_LOGD(TAG, "Indexed %u tracks, %u words in %u us", index->header.entry_count,
+			index->header.token_count, time_micros() - start);
+
+	err = changed ? _search_save(index) : ESP_OK;
+cleanup:
+	free(tracks);
+	free(history);
+	free(index);
+	return err;
+}
+
+int spotify_search_local(const char *query, search_result_t *results, int max, char *strings, size_t size)
+{
+	spotify_search_word_t words[SPOTIFY_SEARCH_MAX_WORDS];
+	int word_count = _search_split(query, words);
+	if (word_count == 0 || max <= 0)
+		return 0;
+	// The longest word selects the fewest tokens.
+	int probe = 0;
+	for (int i = 1; i < word_count; i++) {
+		if (words[i].len > words[probe].len)
+			probe = i;
+	}
+
+	uint32_t start = time_micros();
+	uint32_t seen[(SPOTIFY_SEARCH_MAX_ENTRIES + 31) / 32] = { 0 };
+	int top_entry[max];
+	int top_score[max];
+	int count = 0;
+	xSemaphoreTake(search_mutex, portMAX_DELAY);
+	int lo = 0;
+	int hi = search_index.header.token_count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (_search_prefix_cmp(&search_index.pool[search_index.tokens[mid].offset], &words[probe]) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (int i = lo; i < search_index.header.token_count; i++) {
+		if (_search_prefix_cmp(&search_index.pool[search_index.tokens[i].offset], &words[probe]) != 0)
+			break;
+		int entry = search_index.tokens[i].entry;
+		if (seen[entry / 32] & (1u << (entry % 32)))
+			continue;
+		seen[entry / 32] |= 1u << (entry % 32);
+		int score = _search_score(&search_index.entries[entry], words, word_count, query);
+		if (score < 0 || (count == max && score <= top_score[count - 1]))
+			continue;
+		// insertion into the ranked list; ties keep index order
+		int pos = count < max ? count++ : max - 1;
+		while (pos > 0 && top_score[pos - 1] < score) {
+			top_score[pos] = top_score[pos - 1];
+			top_entry[pos] = top_entry[pos - 1];
+			pos--;
+		}
+		top_score[pos] = score;
+		top_entry[pos] = entry;
+	}
+
+	char *cursor = strings;
+	const char *end = strings + size;
+	for (int i = 0; i < count; i++) {
+		const spotify_search_entry_t *entry = &search_index.entries[top_entry[i]];
+		search_result_t *result = &results[i];
+		memset(result, 0, sizeof(search_result_t));
+		result->track_uri = _search_store(&cursor, end, SPOTIFY_TRACK_URI_PREFIX, &search_index.pool[entry->id]);
+		result->track_name = _search_store(&cursor, end, "", &search_index.pool[entry->title]);
+		result->num_artists = 1;
+		result->artists[0].artist_name = _search_store(&cursor, end, "", &search_index.pool[entry->artist]);
+		result->artists[0].artist_uri = "";
+		result->album.album_name = "";
+		result->album.album_uri = "";
+		result->album.album_type = "";
+	}
+	xSemaphoreGive(search_mutex);
+	ESP_LOGD(TAG, "Local search for \"%s\": %d results in %u us", query, count, time_micros() - start);
+	return count;
+}
+
+static void _search_on_remote_item(void *ctx, int position, cJSON *item)
+{
+	spotify_search_remote_t *remote = (spotify_search_remote_t*)ctx;
+	if (remote->count >= remote->max)
+		return;
+	spotify_track_t track;
+	spotify_parse_track(item, &track);
+	if (track.track_id[0] == '\0')
+		return;
+
+	search_result_t *result = &remote->results[remote->count++];
+	memset(result, 0, sizeof(search_result_t));
+	result->track_uri = _search_store(&remote->cursor, remote->end, SPOTIFY_TRACK_URI_PREFIX, track.track_id);
+	result->track_name = _search_store(&remote->cursor, remote->end, "", track.track_name);
+	result->num_artists = track.num_artists;
+	for (int i = 0; i < track.num_artists; i++) {
+		result->artists[i].artist_name = _search_store(&remote->cursor, remote->end, "", track.artists[i]);
+		result->artists[i].artist_uri = "";
+	}
+	result->album.album_name = "";
+	result->album.album_uri = "";
+	result->album.album_type = "";
+	if (track.album_image_url[0] != '\0') {
+		result->album.num_images = 1;
+		result->album.album_images[0].url = _search_store(&remote->cursor, remote->end, "", track.album_image_url);
+	}
+}
+
+int spotify_search(const char *query, search_result_t *results, int max, char *strings, size_t size)
+{
+	if (max <= 0)
+		return 0;
+	int count = spotify_search_local(query, results, max, strings, size);
+	if (count > 0)
+		return count;
+
+	char encoded[SPOTIFY_SEARCH_MAX_QUERY * 3 + 1];
+	char path[sizeof(encoded) + 96];
+	int len = 0;
+	for (const char *p = query; *p && len < sizeof(encoded) - 4; p++) {
+		unsigned char c = *p;
+		if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+			encoded[len++] = c;
+		else
+			len += snprintf(&encoded[len], sizeof(encoded) - len, "%%%02X", c);
+	}
+	encoded[len] = '\0';
+	// the endpoint rejects a limit above SPOTIFY_SEARCH_REMOTE_LIMIT
+	int limit = max < (int)SPOTIFY_SEARCH_REMOTE_LIMIT ? max : (int)SPOTIFY_SEARCH_REMOTE_LIMIT;
+	snprintf(path, sizeof(path), "%s?q=%s&type=track&market=from_token&limit=%d", SPOTIFY_SEARCH_ENDPOINT, encoded, limit);
+
+	char *item_buf = (char*)malloc(SPOTIFY_SEARCH_ITEM_BUF_SIZE);
+	if (item_buf == NULL)
+		return -1;
+	spotify_search_remote_t remote = {
+		.results = results,
+		.max = limit,
+		.cursor = strings,
+		.end = strings + size,
+	};
+	spotify_stream_t stream;
+	spotify_stream_init(&stream, item_buf, SPOTIFY_SEARCH_ITEM_BUF_SIZE, _search_on_remote_item, &remote);
+	stream.array_depth = 3;
+	spotify_request_t request = {
+		.path = path,
+		.method = HTTP_METHOD_GET,
+		.priority = SPOTIFY_PRIORITY_COMMAND,
+		.on_data = spotify_stream_feed,
+		.ctx = &stream,
+	};
+	spotify_response_t response;
+	esp_err_t err = spotify_api_request(&request, &response);
+	if (err == ESP_OK && response.status_code != 200)
+		err = ESP_FAIL;
+	spotify_pool_release(&response);
+	free(item_buf);
+	if (err != ESP_OK) {
+		ESP_LOGW(TAG, "Remote search failed: %s", esp_err_to_name(err));
+		return -1;
+	}
+	return remote.count;
+}
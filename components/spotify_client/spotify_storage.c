@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "nvs_sync.h"
+#include "spotify_storage.h"
+
+static const char *TAG = "SpotifyStorage";
+
+
+esp_err_t spotify_storage_set_blob(const char *key, const void *data, size_t length)
+{
+	nvs_handle handle;
+	esp_err_t esp_err;
+	if (!nvs_sync_lock(portMAX_DELAY)) {
+		ESP_LOGE(TAG, "spotify_storage_set_blob failed to acquire nvs_sync mutex");
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	esp_err = nvs_open(SPOTIFY_NVS_NAMESPACE, NVS_READWRITE, &handle);
+	if (esp_err != ESP_OK) {
+		nvs_sync_unlock();
+		return esp_err;
+	}
+	esp_err = nvs_set_blob(handle, key, data, length);
+	if (esp_err == ESP_OK)
+		esp_err = nvs_commit(handle);
+	nvs_close(handle);
+	nvs_sync_unlock();
+
+	if (esp_err != ESP_OK)
+		ESP_LOGW(TAG, "Failed to save %s: %s", key, esp_err_to_name(esp_err));
+	return esp_err;
+}
+
+esp_err_t spotify_storage_get_blob(const char *key, void *data, size_t *length)
+{
+	nvs_handle handle;
+	esp_err_t esp_err;
+	if (!nvs_sync_lock(portMAX_DELAY))
+		return ESP_ERR_INVALID_STATE;
+
+	esp_err = nvs_open(SPOTIFY_NVS_NAMESPACE, NVS_READONLY, &handle);
+	if (esp_err != ESP_OK) {
+		nvs_sync_unlock();
+		return esp_err;
+	}
+	esp_err = nvs_get_blob(handle, key, data, length);
+	nvs_close(handle);
+	nvs_sync_unlock();
+	return esp_err;
+}
+
+static void _storage_account_key(char *key, size_t size, const char *name, int account)
+{
+	if (account == 0)
+		snprintf(key, size, "%s", name);
+	else
+		snprintf(key, size, "%s%d", name, account);
+}
+
+esp_err_t spotify_storage_save_token(int account, const char *access_token, int64_t expires_at)
+{
+	char key[NVS_KEY_NAME_MAX_SIZE];
+	_storage_account_key(key, sizeof(key), "token", account);
+	esp_err_t esp_err = spotify_storage_set_blob(key, access_token, strlen(access_token) + 1);
+	if (esp_err != ESP_OK)
+		return esp_err;
+	_storage_account_key(key, sizeof(key), "token_exp", account);
+	return spotify_storage_set_blob(key, &expires_at, sizeof(expires_at));
+}
+
+esp_err_t spotify_storage_load_token(int account, char *access_token, size_t size, int64_t *expires_at)
+{
+	char key[NVS_KEY_NAME_MAX_SIZE];
+	_storage_account_key(key, sizeof(key), "token", account);
+	size_t sz = size;
+	esp_err_t esp_err = spotify_storage_get_blob(key, access_token, &sz);
+	if (esp_err != ESP_OK)
+		return esp_err;
+	access_token[size - 1] = '\0';
+
+	_storage_account_key(key, sizeof(key), "token_exp", account);
+	sz = sizeof(int64_t);
+	return spotify_storage_get_blob(key, expires_at, &sz);
+}
+
+esp_err_t spotify_storage_save_account(int account, const spotify_access_t *access)
+{
+	char key[NVS_KEY_NAME_MAX_SIZE];
+	_storage_account_key(key, sizeof(key), "account", account);
+	return spotify_storage_set_blob(key, access, sizeof(spotify_access_t));
+}
+
+esp_err_t spotify_storage_load_account(int account, spotify_access_t *access)
+{
+	char key[NVS_KEY_NAME_MAX_SIZE];
+	_storage_account_key(key, sizeof(key), "account", account);
+	size_t sz = sizeof(spotify_access_t);
+	esp_err_t esp_err = spotify_storage_get_blob(key, access, &sz);
+	if (esp_err == ESP_OK && sz != sizeof(spotify_access_t))
+		return ESP_ERR_INVALID_SIZE;
+	return esp_err;
+}
+
+esp_err_t spotify_storage_erase_account(int account)
+{
+	nvs_handle handle;
+	char key[NVS_KEY_NAME_MAX_SIZE];
+	if (!nvs_sync_lock(portMAX_DELAY))
+		return ESP_ERR_INVALID_STATE;
+	esp_err_t esp_err = nvs_open(SPOTIFY_NVS_NAMESPACE, NVS_READWRITE, &handle);
+	if (esp_err != ESP_OK) {
+		nvs_sync_unlock();
+		return esp_err;
+	}
+	_storage_account_key(key, sizeof(key), "account", account);
+	esp_err = nvs_erase_key(handle, key);
+	_storage_account_key(key, sizeof(key), "token", account);
+	nvs_erase_key(handle, key);
+	_storage_account_key(key, sizeof(key), "token_exp", account);
+	nvs_erase_key(handle, key);
+	if (esp_err == ESP_OK)
+		esp_err = nvs_commit(handle);
+	nvs_close(handle);
+	nvs_sync_unlock();
+	return esp_err;
+}
+
+esp_err_t spotify_storage_save_now_playing(const now_playing_t *now_playing)
+{
+	return spotify_storage_set_blob("now_playing", now_playing, sizeof(now_playing_t));
+}
+
+esp_err_t spotify_storage_load_now_playing(now_playing_t *now_playing)
+{
+	size_t sz = sizeof(now_playing_t);
+	esp_err_t esp_err = spotify_storage_get_blob("now_playing", now_playing, &sz);
+	// A blob saved by a firmware with a different layout is useless.
+	if (esp_err == ESP_OK && sz != sizeof(now_playing_t))
+		return ESP_ERR_INVALID_SIZE;
+	return esp_err;
+}
@@ -0,0 +1,90 @@
+#include <string.h>
+#include "esp_log.h"
+
+#include "spotify_stream.h"
+
+static const char *TAG = "SpotifyStream";
+
+
+void spotify_stream_init(spotify_stream_t *stream, char *buf, int buf_size, spotify_stream_item_cb_t on_item, void *ctx)
+{
+	memset(stream, 0, sizeof(spotify_stream_t));
+	stream->buf = buf;
+	stream->buf_size = buf_size;
+	stream->on_item = on_item;
+	stream->ctx = ctx;
+	stream->array_depth = 2;
+}
+
+static void _stream_item(spotify_stream_t *stream)
+{
+	if (stream->overflow) {
+		ESP_LOGW(TAG, "Element %d does not fit in %d bytes, skipped", stream->index, stream->buf_size);
+		return;
+	}
+	stream->buf[stream->item_len] = '\0';
+	cJSON *item = cJSON_Parse(stream->buf);
+	if (item == NULL)
+		return;
+	stream->on_item(stream->ctx, stream->index, item);
+	cJSON_Delete(item);
+}
+
+static void _stream_byte(spotify_stream_t *stream, char c)
+{
+	if (stream->capturing) {
+		if (stream->item_len < stream->buf_size - 1)
+			stream->buf[stream->item_len++] = c;
+		else
+			stream->overflow = true;
+	}
+	if (stream->in_string) {
+		if (stream->escape)
+			stream->escape = false;
+		else if (c == '\\')
+			stream->escape = true;
+		else if (c == '"')
+			stream->in_string = false;
+		return;
+	}
+	switch (c) {
+		case '"':
+			stream->in_string = true;
+			break;
+		case '{':
+		case '[':
+			stream->depth++;
+			if (stream->depth == stream->array_depth && c == '[') {
+				stream->in_array = true;
+			} else if (stream->depth == stream->array_depth + 1 && stream->in_array && c == '{') {
+				stream->capturing = true;
+				stream->overflow = false;
+				stream->buf[0] = '{';
+				stream->item_len = 1;
+			}
+			break;
+		case '}':
+		case ']':
+			if (stream->capturing && stream->depth == stream->array_depth + 1) {
+				_stream_item(stream);
+				stream->capturing = false;
+			}
+			if (stream->depth == stream->array_depth && c == ']')
+				stream->in_array = false;
+			stream->depth--;
+			break;
+		case ',':
+			if (stream->depth == stream->array_depth && stream->in_array)
+				stream->index++;
+			break;
+		default:
+			break;
+	}
+}
+
+esp_err_t spotify_stream_feed(void *stream, const char *data, int len)
+{
+	for (int i = 0; i < len; i++)
+		_stream_byte((spotify_stream_t*)stream, data[i]);
+	return ESP_OK;
+}
@@ -4,6 +4,7 @@
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 
+#include <stdbool.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -15,3 +16,6 @@ uint32_t time_sleep(uint32_t seconds);
 int time_msleep(useconds_t msec);
 int time_usleep(useconds_t usec);
 int time_nanosleep(const struct timespec *req, struct timespec *rem);
+void time_sync_start();
+bool time_is_synced();
+int64_t time_epoch();
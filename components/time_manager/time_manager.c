@@ -1,4 +1,7 @@
 #include "time_manager.h"
+#include "esp_sntp.h"
+
+#define TIME_VALID_EPOCH 1600000000LL
 
 inline uint32_t time_seconds()
 {
@@ -45,4 +48,23 @@ inline int time_nanosleep(const struct timespec *req, struct timespec *rem)
     if (req == NULL)
         return -1;
     return time_usleep(1000000 * req->tv_sec + req->tv_nsec / 1000);
+}
+
+void time_sync_start()
+{
+    if (sntp_enabled())
+        return;
+    sntp_setoperatingmode(SNTP_OPMODE_POLL);
+    sntp_setservername(0, "pool.ntp.org");
+    sntp_init();
+}
+
+bool time_is_synced()
+{
+    return time_epoch() > TIME_VALID_EPOCH;
+}
+
+int64_t time_epoch()
+{
+    return (int64_t)time(NULL);
 }
\ No newline at end of file
@@ -23,6 +23,7 @@ function docReady(fn) {
 var selectedSSID = "";
 var refreshAPInterval = null;
 var checkStatusInterval = null;
+var etags = {};
 
 function stopCheckStatusInterval() {
   if (checkStatusInterval != null) {
@@ -225,6 +226,10 @@ async function performConnect(conntype) {
     body: { timestamp: Date.now() },
   });
 
+  //the status has to be read again even if it did not change, it now
+  //applies to the newly selected ssid
+  delete etags["status.json"];
+
   //now we can re-set the intervals regardless of result
   startCheckStatusInterval();
   startRefreshAPInterval();
@@ -242,10 +247,30 @@ function rssiToIcon(rssi) {
   }
 }
 
+// GET a json document, resolving to null when the server answers 304 because
+// it has not changed since the last time it was fetched.
+async function fetchIfChanged(url) {
+  var headers = {};
+  if (etags[url]) {
+    headers["If-None-Match"] = etags[url];
+  }
+  var res = await fetch(url, { headers: headers, cache: "no-store" });
+  if (res.status === 304) {
+    return null;
+  }
+  var etag = res.headers.get("ETag");
+  if (etag) {
+    etags[url] = etag;
+  }
+  return res.json();
+}
+
 async function refreshAP(url = "ap.json") {
   try {
-    var res = await fetch(url);
-    var access_points = await res.json();
+    var access_points = await fetchIfChanged(url);
+    if (access_points === null) {
+      return;
+    }
     if (access_points.length > 0) {
       //sort by signal strength
       access_points.sort((a, b) => {
@@ -274,8 +299,10 @@ function refreshAPHTML(data) {
 
 async function checkStatus(url = "status.json") {
   try {
-    var response = await fetch(url);
-    var data = await response.json();
+    var data = await fetchIfChanged(url);
+    if (data === null) {
+      return;
+    }
     if (data && data.hasOwnProperty("ssid") && data["ssid"] != "") {
       if (data["ssid"] === selectedSSID) {
         // Attempting connection
@@ -0,0 +1,154 @@
+/*
+ * Host check and benchmark of wifi_manager_filter_unique on synthetic scans of 100 to 300 APs,
+ * the range a busy 2.4 GHz environment returns. Each scan mixes mesh networks seen through
+ * several BSSIDs, the same SSID under two auth modes and hidden networks. The result is compared
+ * with a brute-force reference, then the filter is timed over many runs.
+ *
+ *   cmake -S components/wifi_manager/host -B build_host
+ *   cmake --build build_host && ctest --test-dir build_host --output-on-failure
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wifi_manager_scan.h"
+
+#define BENCH_RUNS          (2000)
+
+static uint32_t rng_state = 0x2545F491u;
+
+static uint32_t _rand(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static double _now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* about a third as many networks as APs, one in twenty hidden */
+static void _make_scan(wifi_ap_record_t *aps, uint16_t count)
+{
+	uint16_t networks = count / 3 + 1;
+	memset(aps, 0, count * sizeof(wifi_ap_record_t));
+	for (uint16_t i = 0; i < count; i++) {
+		uint32_t r = _rand();
+		uint16_t network = r % networks;
+		for (int b = 0; b < 6; b++)
+			aps[i].bssid[b] = (uint8_t)(_rand() >> 8);
+		if (network % 20 != 0)
+			snprintf((char*)aps[i].ssid, sizeof(aps[i].ssid), "network-%u", network);
+		// a few networks are also broadcast open, e.g. a guest SSID next to the WPA2 one
+		aps[i].authmode = (network % 7 == 0 && (r >> 16) & 1) ? WIFI_AUTH_OPEN : WIFI_AUTH_WPA2_PSK;
+		aps[i].primary = 1 + (r >> 8) % 13;
+		aps[i].rssi = -30 - (int8_t)((r >> 20) % 65);
+	}
+}
+
+static bool _same_network(const wifi_ap_record_t *a, const wifi_ap_record_t *b)
+{
+	return a->authmode == b->authmode && strncmp((const char*)a->ssid, (const char*)b->ssid, sizeof(a->ssid)) == 0;
+}
+
+/* strongest rssi of the network of ap in the unfiltered scan */
+static int8_t _strongest(const wifi_ap_record_t *scan, uint16_t count, const wifi_ap_record_t *ap)
+{
+	int8_t best = -128;
+	for (uint16_t i = 0; i < count; i++)
+		if (_same_network(&scan[i], ap) && scan[i].rssi > best)
+			best = scan[i].rssi;
+	return best;
+}
+
+static int _verify(const wifi_ap_record_t *scan, uint16_t count, const wifi_ap_record_t *filtered, uint16_t filtered_count)
+{
+	uint16_t expected = 0;
+	for (uint16_t i = 0; i < count; i++) {
+		if (scan[i].ssid[0] == 0)
+			continue;
+		bool first = true;
+		for (uint16_t j = 0; j < i && first; j++)
+			first = !_same_network(&scan[j], &scan[i]);
+		expected += first;
+	}
+	if (filtered_count != expected) {
+		printf("  %u networks kept, %u expected\n", filtered_count, expected);
+		return 1;
+	}
+	for (uint16_t i = 0; i < filtered_count; i++) {
+		const wifi_ap_record_t *ap = &filtered[i];
+		if (ap->ssid[0] == 0) {
+			printf("  hidden network kept at %u\n", i);
+			return 1;
+		}
+		if (i > 0 && ap->rssi > filtered[i - 1].rssi) {
+			printf("  not sorted by rssi at %u\n", i);
+			return 1;
+		}
+		for (uint16_t j = 0; j < i; j++) {
+			if (_same_network(&filtered[j], ap)) {
+				printf("  %s kept twice\n", (const char*)ap->ssid);
+				return 1;
+			}
+		}
+		if (ap->rssi != _strongest(scan, count, ap)) {
+			printf("  %s kept at %d dBm instead of its strongest AP\n", (const char*)ap->ssid, ap->rssi);
+			return 1;
+		}
+		// the whole record of the strongest AP is kept, not only its rssi
+		bool found = false;
+		for (uint16_t j = 0; j < count && !found; j++)
+			found = memcmp(&scan[j], ap, sizeof(wifi_ap_record_t)) == 0;
+		if (!found) {
+			printf("  %s is not a record of the scan\n", (const char*)ap->ssid);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(void)
+{
+	static const uint16_t sizes[] = { 100, 200, 300 };
+	int failures = 0;
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		uint16_t count = sizes[s];
+		wifi_ap_record_t *scan = malloc(count * sizeof(wifi_ap_record_t));
+		wifi_ap_record_t *work = malloc(count * sizeof(wifi_ap_record_t));
+		if (scan == NULL || work == NULL)
+			return 1;
+		_make_scan(scan, count);
+
+		uint16_t filtered = count;
+		memcpy(work, scan, count * sizeof(wifi_ap_record_t));
+		wifi_manager_filter_unique(work, &filtered);
+		int failed = _verify(scan, count, work, filtered);
+		failures += failed;
+
+		// the copy is outside the timed section, the filter works in place
+		double total_us = 0;
+		for (int run = 0; run < BENCH_RUNS; run++) {
+			memcpy(work, scan, count * sizeof(wifi_ap_record_t));
+			filtered = count;
+			double started = _now_us();
+			wifi_manager_filter_unique(work, &filtered);
+			total_us += _now_us() - started;
+		}
+		printf("%3u APs -> %3u networks: %7.2f us per filter%s\n", count, filtered, total_us / BENCH_RUNS,
+				failed ? "  <-- FAIL" : "");
+		free(scan);
+		free(work);
+	}
+	printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+	return failures == 0 ? 0 : 1;
+}
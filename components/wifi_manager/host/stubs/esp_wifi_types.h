@@ -0,0 +1,34 @@
+/* Host stand-in for the ESP-IDF header: only what wifi_manager_scan.c touches, same field types */
+#ifndef HOST_ESP_WIFI_TYPES_H
+#define HOST_ESP_WIFI_TYPES_H
+
+#include <stdint.h>
+
+typedef enum {
+	WIFI_AUTH_OPEN = 0,
+	WIFI_AUTH_WEP,
+	WIFI_AUTH_WPA_PSK,
+	WIFI_AUTH_WPA2_PSK,
+	WIFI_AUTH_WPA_WPA2_PSK,
+	WIFI_AUTH_WPA2_ENTERPRISE,
+	WIFI_AUTH_WPA3_PSK,
+	WIFI_AUTH_WPA2_WPA3_PSK,
+	WIFI_AUTH_MAX
+} wifi_auth_mode_t;
+
+/* same size order as the IDF record (about 80 bytes), which matters for the memcpy and qsort costs */
+typedef struct {
+	uint8_t bssid[6];
+	uint8_t ssid[33];
+	uint8_t primary;
+	int     second;
+	int8_t  rssi;
+	wifi_auth_mode_t authmode;
+	int     pairwise_cipher;
+	int     group_cipher;
+	int     ant;
+	uint32_t phy_flags;
+	uint8_t country[12];
+} wifi_ap_record_t;
+
+#endif
@@ -34,6 +34,7 @@ function to process requests, decode URLs, serve files, etc. etc.
 #include <esp_event.h>
 #include <esp_log.h>
 #include <esp_system.h>
+#include <esp_timer.h>
 #include "esp_netif.h"
 #include <esp_http_server.h>
 
@@ -76,6 +77,7 @@ extern const uint8_t index_html_end[] asm("_binary_index_html_end");
 /* const httpd related values stored in ROM */
 const static char http_200_hdr[] = "200 OK";
 const static char http_302_hdr[] = "302 Found";
+const static char http_304_hdr[] = "304 Not Modified";
 const static char http_400_hdr[] = "400 Bad Request";
 const static char http_404_hdr[] = "404 Not Found";
 const static char http_503_hdr[] = "503 Service Unavailable";
@@ -89,9 +91,44 @@ const static char http_cache_control_no_cache[] = "no-store, no-cache, must-reva
 const static char http_cache_control_cache[] = "public, max-age=31536000";
 const static char http_pragma_hdr[] = "Pragma";
 const static char http_pragma_no_cache[] = "no-cache";
+const static char http_etag_hdr[] = "ETag";
+const static char http_if_none_match_hdr[] = "If-None-Match";
+const static char http_age_hdr[] = "Age";
 
 
 
+/**
+ * @brief Sends a json document published by the wifi_manager, or a bodyless 304 if the client already has this version.
+ * The ETag is a hash of the content, so a scan that found the same networks keeps the same tag.
+ */
+static esp_err_t http_app_send_json(httpd_req_t *req, const wifi_manager_json_t *json){
+
+	char etag[11]; /* 8 hex digits and quotes */
+	char age[11];
+	char if_none_match[64];
+
+	snprintf(etag, sizeof(etag), "\"%08x\"", (unsigned int)json->etag);
+
+	httpd_resp_set_type(req, http_content_type_json);
+	httpd_resp_set_hdr(req, http_cache_control_hdr, http_cache_control_no_cache);
+	httpd_resp_set_hdr(req, http_pragma_hdr, http_pragma_no_cache);
+	httpd_resp_set_hdr(req, http_etag_hdr, etag);
+	if(json->created_at != 0){
+		snprintf(age, sizeof(age), "%u", (unsigned int)((esp_timer_get_time() - json->created_at) / 1000000));
+		httpd_resp_set_hdr(req, http_age_hdr, age);
+	}
+
+	if(httpd_req_get_hdr_value_str(req, http_if_none_match_hdr, if_none_match, sizeof(if_none_match)) == ESP_OK &&
+			strstr(if_none_match, etag) != NULL){
+		httpd_resp_set_status(req, http_304_hdr);
+		return httpd_resp_send(req, NULL, 0);
+	}
+
+	httpd_resp_set_status(req, http_200_hdr);
+	return httpd_resp_send(req, json->json, json->length);
+}
+
+
 esp_err_t http_app_set_handler_hook( httpd_method_t method,  esp_err_t (*handler)(httpd_req_t *r)  ){
 
 	if(method == HTTP_GET){
@@ -261,48 +298,33 @@ static esp_err_t http_server_get_handler(httpd_req_t *req){
 		/* GET /ap.json */
 		else if(strcmp(req->uri, http_ap_url) == 0){
 
-			/* if we can get the mutex, write the last version of the AP list */
-			if(wifi_manager_lock_json_buffer(( TickType_t ) 10)){
-
-				httpd_resp_set_status(req, http_200_hdr);
-				httpd_resp_set_type(req, http_content_type_json);
-				httpd_resp_set_hdr(req, http_cache_control_hdr, http_cache_control_no_cache);
-				httpd_resp_set_hdr(req, http_pragma_hdr, http_pragma_no_cache);
-				char* ap_buf = wifi_manager_get_ap_list_json();
-				httpd_resp_send(req, ap_buf, strlen(ap_buf));
-				wifi_manager_unlock_json_buffer();
+			/* the list is a snapshot: it is sent as it was when the request came in, however long the client takes */
+			const wifi_manager_json_t *ap_list = wifi_manager_acquire_ap_list_json();
+			if(ap_list){
+				/* scanning takes the radio off the SoftAP channel: only do it when the list is getting old.
+				 * A list that did not come from a scan has no creation time and is always refreshed */
+				if(ap_list->created_at == 0 || esp_timer_get_time() - ap_list->created_at > (int64_t)WIFI_MANAGER_SCAN_MAX_AGE * 1000){
+					wifi_manager_scan_async();
+				}
+				http_app_send_json(req, ap_list);
+				wifi_manager_release_json(ap_list);
 			}
 			else{
 				httpd_resp_set_status(req, http_503_hdr);
 				httpd_resp_send(req, NULL, 0);
-				ESP_LOGE(TAG, "http_server_netconn_serve: GET /ap.json failed to obtain mutex");
 			}
-
-			/* request a wifi scan */
-			wifi_manager_scan_async();
 		}
 		/* GET /status.json */
 		else if(strcmp(req->uri, http_status_url) == 0){
 
-			if(wifi_manager_lock_json_buffer(( TickType_t ) 10)){
-				char *buff = wifi_manager_get_ip_info_json();
-				if(buff){
-					httpd_resp_set_status(req, http_200_hdr);
-					httpd_resp_set_type(req, http_content_type_json);
-					httpd_resp_set_hdr(req, http_cache_control_hdr, http_cache_control_no_cache);
-					httpd_resp_set_hdr(req, http_pragma_hdr, http_pragma_no_cache);
-					httpd_resp_send(req, buff, strlen(buff));
-					wifi_manager_unlock_json_buffer();
-				}
-				else{
-					httpd_resp_set_status(req, http_503_hdr);
-					httpd_resp_send(req, NULL, 0);
-				}
+			const wifi_manager_json_t *ip_info = wifi_manager_acquire_ip_info_json();
+			if(ip_info){
+				http_app_send_json(req, ip_info);
+				wifi_manager_release_json(ip_info);
 			}
 			else{
 				httpd_resp_set_status(req, http_503_hdr);
 				httpd_resp_send(req, NULL, 0);
-				ESP_LOGE(TAG, "http_server_netconn_serve: GET /status.json failed to obtain mutex");
 			}
 		}
 		else{
@@ -23,17 +23,56 @@ OTHER DEALINGS IN THE SOFTWARE.
 #ifndef JSON_H_INCLUDED
 #define JSON_H_INCLUDED
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /**
- * @brief Render the cstring provided to a JSON escaped version that can be printed.
- * @param input the input buffer to be escaped.
- * @param output_buffer the output buffer to write to. You must ensure it is big enough to contain the final string.
+ * @brief Worst case length of a JSON string escaped from n input bytes, quotes included:
+ * every byte may become a 6 character \uXXXX sequence.
+ */
+#define JSON_STRING_MAX_LENGTH(n)		((n) * 6 + 2)
+
+/**
+ * @brief Bounded writer appending JSON to a caller provided buffer in a single pass.
+ *
+ * The buffer is always null terminated. A write that does not fit is dropped whole and sets overflow,
+ * after which every write is a no-op until json_writer_rewind is called.
+ */
+typedef struct json_writer_t{
+	char *buffer;
+	size_t size;
+	size_t length;
+	bool overflow;
+} json_writer_t;
+
+void json_writer_init(json_writer_t *writer, char *buffer, size_t size);
+
+/**
+ * @brief Truncate the output back to length, e.g. to drop a partially written element after an overflow, and clear overflow.
+ */
+void json_writer_rewind(json_writer_t *writer, size_t length);
+
+/**
+ * @brief Append characters that need no escaping.
+ */
+bool json_writer_raw(json_writer_t *writer, const char *raw);
+bool json_writer_int(json_writer_t *writer, int value);
+
+/**
+ * @brief Append input as a quoted, escaped JSON string.
+ * @param max_length input is read up to its null terminator or max_length bytes, whichever comes first. wifi_config_t ssids are not null terminated when 32 characters long.
  * @see cJSON equivlaent static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffer * const output_buffer)
  */
-bool json_print_string(const unsigned char *input, unsigned char *output_buffer);
+bool json_writer_string(json_writer_t *writer, const unsigned char *input, size_t max_length);
+
+/**
+ * @brief Length json_writer_string would write for input, quotes included and null terminator excluded.
+ */
+size_t json_string_length(const unsigned char *input, size_t max_length);
 
 #ifdef __cplusplus
 }
@@ -27,6 +27,7 @@ Contains the freeRTOS task and all necessary support
 #define WIFI_MANAGER_H_INCLUDED
 
 #include <stdbool.h>
+#include "wifi_manager_scan.h" /* for wifi_manager_filter_unique */
 
 
 #ifdef __cplusplus
@@ -48,10 +49,10 @@ extern "C" {
 
 
 /**
- * @brief Defines the maximum number of access points that can be scanned.
+ * @brief Defines the initial number of access points the scan list can hold.
  *
- * To save memory and avoid nasty out of memory errors,
- * we can limit the number of APs detected in a wifi scan.
+ * The list grows when a scan returns more APs than that, so this only sets
+ * the memory reserved up front.
  */
 #define MAX_AP_NUM 							15
 
@@ -62,12 +63,52 @@ extern "C" {
  */
 #define WIFI_MANAGER_MAX_RETRY_START_AP		CONFIG_WIFI_MANAGER_MAX_RETRY_START_AP
 
+/**
+ * @brief Depth of the message queue of the wifi_manager task.
+ */
+#define WIFI_MANAGER_QUEUE_SIZE				CONFIG_WIFI_MANAGER_QUEUE_SIZE
+
+/**
+ * @brief Total number of callbacks that can be registered.
+ */
+#define WIFI_MANAGER_MAX_SUBSCRIBERS		CONFIG_WIFI_MANAGER_MAX_SUBSCRIBERS
+
+/**
+ * @brief Whether callbacks subscribed with WIFI_MANAGER_CALLBACK_ASYNC run on a worker task (1) or inline (0).
+ */
+#ifdef CONFIG_WIFI_MANAGER_ASYNC_CALLBACKS
+#define WIFI_MANAGER_ASYNC_CALLBACKS		1
+#else
+#define WIFI_MANAGER_ASYNC_CALLBACKS		0
+#endif
+
+/**
+ * @brief Stack size of the task running the asynchronous callbacks.
+ */
+#define WIFI_MANAGER_CALLBACK_TASK_STACK	4096
+
+/**
+ * @brief Inline callbacks taking longer than this (in us) are logged as holding up the wifi_manager.
+ */
+#define WIFI_MANAGER_CALLBACK_SLOW_US		20000
+
 /**
  * @brief Time (in ms) between each retry attempt
  * Defines the time to wait before an attempt to re-connect to a saved wifi is made after connection is lost or another unsuccesful attempt is made.
  */
 #define WIFI_MANAGER_RETRY_TIMER			CONFIG_WIFI_MANAGER_RETRY_TIMER
 
+/**
+ * @brief Upper bound (in ms) of the exponential backoff between reconnection attempts.
+ */
+#define WIFI_MANAGER_RETRY_MAX_TIMER		CONFIG_WIFI_MANAGER_RETRY_MAX_TIMER
+
+/**
+ * @brief After a beacon timeout, the first WIFI_MANAGER_FAST_RETRIES attempts are made after only WIFI_MANAGER_FAST_RETRY_TIMER ms.
+ */
+#define WIFI_MANAGER_FAST_RETRIES			3
+#define WIFI_MANAGER_FAST_RETRY_TIMER		250
+
 
 /**
  * @brief Time (in ms) to wait before shutting down the AP
@@ -76,6 +117,30 @@ extern "C" {
 #define WIFI_MANAGER_SHUTDOWN_AP_TIMER		CONFIG_WIFI_MANAGER_SHUTDOWN_AP_TIMER
 
 
+/**
+ * @brief Number of networks remembered. On restore, a single scan picks the strongest of them in range.
+ */
+#define WIFI_MANAGER_MAX_PROFILES			CONFIG_WIFI_MANAGER_MAX_PROFILES
+
+
+/**
+ * @brief Age (in ms) past which a request for the AP list triggers a new scan.
+ * Scanning takes the radio away from the SoftAP channel, so a portal polling /ap.json should not cause back to back scans.
+ */
+#define WIFI_MANAGER_SCAN_MAX_AGE			CONFIG_WIFI_MANAGER_SCAN_MAX_AGE
+
+
+/**
+ * @brief When enabled, the BSSID and channel of the last successful association are saved and a restore
+ * first attempts a direct single-channel connection to that AP before falling back to a full scan.
+ */
+#ifdef CONFIG_WIFI_MANAGER_FAST_RECONNECT
+#define WIFI_MANAGER_FAST_RECONNECT			1
+#else
+#define WIFI_MANAGER_FAST_RECONNECT			0
+#endif
+
+
 /** @brief Defines the task priority of the wifi_manager.
  *
  * Tasks spawn by the manager will have a priority of WIFI_MANAGER_TASK_PRIORITY-1.
@@ -154,30 +219,30 @@ extern "C" {
 #define DEFAULT_STA_POWER_SAVE 				WIFI_PS_NONE
 
 /**
- * @brief Defines the maximum length in bytes of a JSON representation of an access point.
+ * @brief Defines the maximum length in bytes of a JSON representation of an access point, list separator included.
  *
- *  maximum ap string length with full 32 char ssid: 75 + \\n + \0 = 77\n
  *  example: {"ssid":"abcdefghijklmnopqrstuvwxyz012345","chan":12,"rssi":-100,"auth":4},\n
- *  BUT: we need to escape JSON. Imagine a ssid full of \" ? so it's 32 more bytes hence 77 + 32 = 99.\n
+ *  BUT: we need to escape JSON. Imagine a ssid full of control characters? Each of them becomes \u00XX,
+ *  so the quoted ssid can be 32 * 6 + 2 = 194 bytes. The rest is at most 45 bytes with 3 digit numbers, hence 239.
  *  this is an edge case but I don't think we should crash in a catastrophic manner just because
- *  someone decided to have a funny wifi name.
+ *  someone decided to have a funny wifi name. The AP list is sized from the actual ssids, this is only the upper bound.
  */
-#define JSON_ONE_APP_SIZE					99
+#define JSON_ONE_APP_SIZE					239
 
 /**
  * @brief Defines the maximum length in bytes of a JSON representation of the IP information
  * assuming all ips are 4*3 digits, and all characters in the ssid require to be escaped.
  * example: {"ssid":"abcdefghijklmnopqrstuvwxyz012345","ip":"192.168.1.119","netmask":"255.255.255.0","gw":"192.168.1.1","urc":99}
- * Run this JS (browser console is easiest) to come to the conclusion that 159 is the worst case.
+ * Run this JS (browser console is easiest) to come to the conclusion that 288 is the worst case.
  * ```
  * var a = {"ssid":"abcdefghijklmnopqrstuvwxyz012345","ip":"255.255.255.255","netmask":"255.255.255.255","gw":"255.255.255.255","urc":99};
- * // Replace all ssid characters with a double quote which will have to be escaped
- * a.ssid = a.ssid.split('').map(() => '"').join('');
- * console.log(JSON.stringify(a).length); // => 158 +1 for null
+ * // Replace all ssid characters with a control character which will have to be escaped as \u00XX
+ * a.ssid = a.ssid.split('').map(() => '\x01').join('');
+ * console.log(JSON.stringify(a).length); // => 286 +1 for \n +1 for null
  * console.log(JSON.stringify(a)); // print it
  * ```
  */
-#define JSON_IP_INFO_SIZE 					159
+#define JSON_IP_INFO_SIZE 					288
 
 
 /**
@@ -190,11 +255,11 @@ extern "C" {
  * @brief Defines the complete list of all messages that the wifi_manager can process.
  *
  * Some of these message are events ("EVENT"), and some of them are action ("ORDER")
- * Each of these messages can trigger a callback function and each callback function is stored
- * in a function pointer array for convenience. Because of this behavior, it is extremely important
- * to maintain a strict sequence and the top level special element 'MESSAGE_CODE_COUNT'
+ * Each of these messages can trigger callback functions. Because message codes are used to
+ * validate subscriptions, it is extremely important to maintain a strict sequence and the
+ * top level special element 'MESSAGE_CODE_COUNT'
  *
- * @see wifi_manager_set_callback
+ * @see wifi_manager_subscribe
  */
 typedef enum message_code_t {
 	NONE = 0,
@@ -251,13 +316,79 @@ struct wifi_settings_t{
 };
 extern struct wifi_settings_t wifi_settings;
 
+/**
+ * @brief A known network, saved in NVS as part of the "profiles" blob.
+ * bssid and channel are those of the AP the station last associated with, channel 0 if there is no such hint.
+ * A disconnect requested by the user forgets all of them.
+ */
+struct wifi_manager_profile_t{
+	uint8_t ssid[MAX_SSID_SIZE];
+	uint8_t password[MAX_PASSWORD_SIZE];
+	uint8_t bssid[6];
+	uint8_t channel;
+};
+
+
+/**
+ * @brief Callback run when a message is processed. The parameter is the driver event for WM_EVENT_SCAN_DONE,
+ * WM_EVENT_STA_DISCONNECTED and WM_EVENT_STA_GOT_IP, NULL otherwise, and is only valid until the callback returns.
+ */
+typedef void (*wifi_manager_cb_t)(void*);
+
+/**
+ * @brief Subscription flag: run the callback on the callback worker task rather than on the wifi_manager task.
+ * For anything slow, such as opening a TLS connection on WM_EVENT_STA_GOT_IP.
+ */
+#define WIFI_MANAGER_CALLBACK_ASYNC			(1 << 0)
+
+/**
+ * @brief Execution time of one subscribed callback.
+ */
+typedef struct wifi_manager_callback_stats_t{
+	uint32_t calls;
+	uint32_t dropped;				/**< asynchronous calls lost because the worker queue was full */
+	uint32_t max_us;
+	uint64_t total_us;
+} wifi_manager_callback_stats_t;
+
+/**
+ * @brief A json document published by the wifi_manager for the HTTP server. Reference counted, never modified once published.
+ */
+typedef struct wifi_manager_json_t{
+	uint32_t references;
+	uint32_t etag;			/**< hash of the content */
+	int64_t created_at;		/**< esp_timer time the document was generated, 0 for placeholders such as the empty AP list */
+	size_t length;
+	char json[];
+} wifi_manager_json_t;
+
+/**
+ * @brief Counters of the automatic reconnections since boot.
+ */
+typedef struct wifi_manager_reconnect_stats_t{
+	uint32_t attempts;				/**< connection attempts not requested by the user */
+	uint32_t reconnections;			/**< connections obtained after at least one failure */
+	uint32_t consecutive_failures;	/**< failures since the last connection, drives the backoff */
+	uint32_t auth_failures;
+	uint32_t no_ap_found;
+	uint32_t beacon_timeouts;
+	uint32_t other_failures;
+	uint32_t last_delay_ms;			/**< delay before the last scheduled retry */
+	uint8_t last_reason;			/**< wifi_err_reason_t of the last failure */
+} wifi_manager_reconnect_stats_t;
 
 /**
  * @brief Structure used to store one message in the queue.
+ * Driver events are carried by value so that nothing is allocated between the event handler and the wifi_manager task.
  */
 typedef struct{
 	message_code_t code;
-	void *param;
+	union{
+		void *param;									/**< orders */
+		wifi_event_sta_scan_done_t scan_done;			/**< WM_EVENT_SCAN_DONE */
+		wifi_event_sta_disconnected_t sta_disconnected;	/**< WM_EVENT_STA_DISCONNECTED */
+		ip_event_got_ip_t got_ip;						/**< WM_EVENT_STA_GOT_IP */
+	};
 } queue_message;
 
 
@@ -282,19 +413,12 @@ void wifi_manager_start();
  */
 void wifi_manager_destroy();
 
-/**
- * Filters the AP scan list to unique SSIDs
- */
-void filter_unique( wifi_ap_record_t * aplist, uint16_t * ap_num);
-
 /**
  * Main task for the wifi_manager
  */
 void wifi_manager( void * pvParameters );
 
 
-char* wifi_manager_get_ap_list_json();
-char* wifi_manager_get_ip_info_json();
 
 
 void wifi_manager_scan_async();
@@ -330,50 +454,53 @@ void wifi_manager_scan_awifi_manager_send_messagesync();
 void wifi_manager_disconnect_async();
 
 /**
- * @brief Tries to get access to json buffer mutex.
- *
- * The HTTP server can try to access the json to serve clients while the wifi manager thread can try
- * to update it. These two tasks are synchronized through a mutex.
+ * @brief Takes a reference to the current access point list json. Never blocks.
  *
- * The mutex is used by both the access point list json and the connection status json.\n
- * These two resources should technically have their own mutex but we lose some flexibility to save
- * on memory.
- *
- * This is a simple wrapper around freeRTOS function xSemaphoreTake.
- *
- * @param xTicksToWait The time in ticks to wait for the semaphore to become available.
- * @return true in success, false otherwise.
+ * The document is immutable and stays valid until wifi_manager_release_json is called, even if a newer
+ * list is published in the meantime.
+ * @return the document, or NULL if the wifi_manager is not started.
+ */
+const wifi_manager_json_t* wifi_manager_acquire_ap_list_json();
+
+/**
+ * @brief Takes a reference to the current connection status json. Never blocks.
+ * @see wifi_manager_acquire_ap_list_json
  */
-bool wifi_manager_lock_json_buffer(TickType_t xTicksToWait);
+const wifi_manager_json_t* wifi_manager_acquire_ip_info_json();
 
 /**
- * @brief Releases the json buffer mutex.
+ * @brief Drops a reference taken by one of the acquire functions. NULL is ignored.
  */
-void wifi_manager_unlock_json_buffer();
+void wifi_manager_release_json(const wifi_manager_json_t *json);
 
 /**
  * @brief Generates the connection status json: ssid and IP addresses.
- * @note This is not thread-safe and should be called only if wifi_manager_lock_json_buffer call is successful.
+ * @note The new document replaces the published one atomically.
  */
 void wifi_manager_generate_ip_info_json(update_reason_code_t update_reason_code);
 /**
  * @brief Clears the connection status json.
- * @note This is not thread-safe and should be called only if wifi_manager_lock_json_buffer call is successful.
+ * @note The new document replaces the published one atomically.
  */
 void wifi_manager_clear_ip_info_json();
 
 /**
  * @brief Generates the list of access points after a wifi scan.
- * @note This is not thread-safe and should be called only if wifi_manager_lock_json_buffer call is successful.
+ * @note The new document replaces the published one atomically.
  */
 void wifi_manager_generate_acess_points_json();
 
 /**
  * @brief Clear the list of access points.
- * @note This is not thread-safe and should be called only if wifi_manager_lock_json_buffer call is successful.
+ * @note The new document replaces the published one atomically.
  */
 void wifi_manager_clear_access_points_json();
 
+/**
+ * @brief Size of a buffer large enough for wifi_manager_generate_acess_points_json to print the given list, null terminator included.
+ */
+size_t wifi_manager_access_points_json_size(const wifi_ap_record_t *aplist, uint16_t aps);
+
 
 /**
  * @brief Start the mDNS service
@@ -389,17 +516,54 @@ void wifi_manager_unlock_sta_ip_string();
  */
 char* wifi_manager_get_sta_ip_string();
 
+/**
+ * @brief true once the STA got an IP and until it disconnects. Lets a module that subscribes to
+ * WM_EVENT_STA_GOT_IP late find out it already missed it.
+ */
+bool wifi_manager_is_sta_connected();
+
 /**
  * @brief thread safe char representation of the STA IP update
  */
 void wifi_manager_safe_update_sta_ip_string(uint32_t ip);
 
 
+/**
+ * @brief Copies the reconnection statistics. Safe to call from any task.
+ */
+void wifi_manager_get_reconnect_stats(wifi_manager_reconnect_stats_t *stats);
+
+/**
+ * @brief Number of driver events dropped since boot because the message queue was full.
+ */
+uint32_t wifi_manager_get_queue_overflows();
+
 /**
  * @brief Register a callback to a custom function when specific event message_code happens.
+ * Replaces the callback previously set with this function for the same message, NULL removes it.
+ * Callbacks set this way run inline with priority 0.
  */
 void wifi_manager_set_callback(message_code_t message_code, void (*func_ptr)(void*) );
 
+/**
+ * @brief Adds func to the callbacks of message_code. Callbacks are called by decreasing priority, in order
+ * of subscription for equal priorities. Subscribing the same function again updates its priority and flags.
+ * @param flags 0 or WIFI_MANAGER_CALLBACK_ASYNC
+ * @return ESP_ERR_NO_MEM when WIFI_MANAGER_MAX_SUBSCRIBERS callbacks are already registered.
+ */
+esp_err_t wifi_manager_subscribe(message_code_t message_code, wifi_manager_cb_t func, int8_t priority, uint32_t flags);
+
+/**
+ * @brief Removes func from the callbacks of message_code.
+ */
+void wifi_manager_unsubscribe(message_code_t message_code, wifi_manager_cb_t func);
+
+/**
+ * @brief Copies the execution time statistics of a subscribed callback.
+ * @return ESP_ERR_NOT_FOUND if func is not subscribed to message_code.
+ */
+esp_err_t wifi_manager_get_callback_stats(message_code_t message_code, wifi_manager_cb_t func, wifi_manager_callback_stats_t *stats);
+
 
 BaseType_t wifi_manager_send_message(message_code_t code, void *param);
 BaseType_t wifi_manager_send_message_to_front(message_code_t code, void *param);
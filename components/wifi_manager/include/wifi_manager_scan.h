@@ -0,0 +1,28 @@
+/**
+@file wifi_manager_scan.h
+@brief Post-processing of the AP scan list
+*/
+
+#ifndef WIFI_MANAGER_SCAN_H_INCLUDED
+#define WIFI_MANAGER_SCAN_H_INCLUDED
+
+#include <stdint.h>
+#include "esp_wifi_types.h" /* for wifi_ap_record_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * Filters the AP scan list to unique SSID+authmode pairs, keeping the strongest AP of each, and sorts it by decreasing RSSI.
+ * Runs in a single pass over the list with a hash table.
+ */
+void wifi_manager_filter_unique( wifi_ap_record_t * aplist, uint16_t * ap_num);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WIFI_MANAGER_SCAN_H_INCLUDED */
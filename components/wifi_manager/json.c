@@ -27,111 +27,146 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include "json.h"
 
 
-bool json_print_string(const unsigned char *input, unsigned char *output_buffer)
+/* length of the escape sequence of c, 1 if it is printed as is */
+static size_t json_escaped_char_length(unsigned char c)
 {
-	const unsigned char *input_pointer = NULL;
-	unsigned char *output = NULL;
-	unsigned char *output_pointer = NULL;
-	size_t output_length = 0;
-	/* numbers of additional characters needed for escaping */
-	size_t escape_characters = 0;
-
-	if (output_buffer == NULL)
+	if ((c > 31) && (c != '\"') && (c != '\\'))
 	{
-		return false;
+		return 1;
+	}
+	if (strchr("\"\\\b\f\n\r\t", c))
+	{
+		/* one character escape sequence */
+		return 2;
 	}
+	/* UTF-16 escape sequence \uXXXX */
+	return 6;
+}
+
+size_t json_string_length(const unsigned char *input, size_t max_length)
+{
+	size_t length = 2; /* quotes */
 
-	/* empty string */
-	if (input == NULL)
+	for (size_t i = 0; input != NULL && i < max_length && input[i] != '\0'; i++)
 	{
-		//output = ensure(output_buffer, sizeof("\"\""), hooks);
-		if (output == NULL)
-		{
-			return false;
-		}
-		strcpy((char*)output, "\"\"");
+		length += json_escaped_char_length(input[i]);
+	}
+
+	return length;
+}
 
-		return true;
+void json_writer_init(json_writer_t *writer, char *buffer, size_t size)
+{
+	writer->buffer = buffer;
+	writer->size = size;
+	writer->length = 0;
+	writer->overflow = (size == 0);
+	if (size > 0)
+	{
+		buffer[0] = '\0';
 	}
+}
 
-	/* set "flag" to 1 if something needs to be escaped */
-	for (input_pointer = input; *input_pointer; input_pointer++)
+void json_writer_rewind(json_writer_t *writer, size_t length)
+{
+	if (length <= writer->length)
 	{
-		if (strchr("\"\\\b\f\n\r\t", *input_pointer))
-		{
-			/* one character escape sequence */
-			escape_characters++;
-		}
-		else if (*input_pointer < 32)
-		{
-			/* UTF-16 escape sequence uXXXX */
-			escape_characters += 5;
-		}
+		writer->length = length;
+		writer->buffer[length] = '\0';
+		writer->overflow = false;
 	}
-	output_length = (size_t)(input_pointer - input) + escape_characters;
+}
 
-	/* in the original cJSON it is possible to realloc here in case output buffer is too small.
-	 * This is overkill for an embedded system. */
-	output = output_buffer;
+/* true if length more characters and the null terminator fit, otherwise the writer is marked as overflowed */
+static bool json_writer_reserve(json_writer_t *writer, size_t length)
+{
+	if (writer->overflow || length >= writer->size - writer->length)
+	{
+		writer->overflow = true;
+		return false;
+	}
+	return true;
+}
+
+bool json_writer_raw(json_writer_t *writer, const char *raw)
+{
+	size_t length = strlen(raw);
 
-	/* no characters have to be escaped */
-	if (escape_characters == 0)
+	if (!json_writer_reserve(writer, length))
 	{
-		output[0] = '\"';
-		memcpy(output + 1, input, output_length);
-		output[output_length + 1] = '\"';
-		output[output_length + 2] = '\0';
+		return false;
+	}
+	memcpy(writer->buffer + writer->length, raw, length + 1);
+	writer->length += length;
+
+	return true;
+}
 
-		return true;
+bool json_writer_int(json_writer_t *writer, int value)
+{
+	char number[12]; /* "-2147483648" */
+
+	snprintf(number, sizeof(number), "%d", value);
+	return json_writer_raw(writer, number);
+}
+
+bool json_writer_string(json_writer_t *writer, const unsigned char *input, size_t max_length)
+{
+	char *output_pointer = NULL;
+
+	/* the exact escaped length is known up front so a string is either written whole or not at all */
+	if (!json_writer_reserve(writer, json_string_length(input, max_length)))
+	{
+		return false;
 	}
 
-	output[0] = '\"';
-	output_pointer = output + 1;
-	/* copy the string */
-	for (input_pointer = input; *input_pointer != '\0'; (void)input_pointer++, output_pointer++)
+	output_pointer = writer->buffer + writer->length;
+	*output_pointer++ = '\"';
+	for (size_t i = 0; input != NULL && i < max_length && input[i] != '\0'; i++)
 	{
-		if ((*input_pointer > 31) && (*input_pointer != '\"') && (*input_pointer != '\\'))
+		unsigned char c = input[i];
+		if (json_escaped_char_length(c) == 1)
 		{
 			/* normal character, copy */
-			*output_pointer = *input_pointer;
+			*output_pointer++ = (char)c;
+			continue;
 		}
-		else
+
+		/* character needs to be escaped */
+		*output_pointer++ = '\\';
+		switch (c)
 		{
-			/* character needs to be escaped */
+		case '\\':
 			*output_pointer++ = '\\';
-			switch (*input_pointer)
-			{
-			case '\\':
-				*output_pointer = '\\';
-				break;
-			case '\"':
-				*output_pointer = '\"';
-				break;
-			case '\b':
-				*output_pointer = 'b';
-				break;
-			case '\f':
-				*output_pointer = 'f';
-				break;
-			case '\n':
-				*output_pointer = 'n';
-				break;
-			case '\r':
-				*output_pointer = 'r';
-				break;
-			case '\t':
-				*output_pointer = 't';
-				break;
-			default:
-				/* escape and print as unicode codepoint */
-				sprintf((char*)output_pointer, "u%04x", *input_pointer);
-				output_pointer += 4;
-				break;
-			}
+			break;
+		case '\"':
+			*output_pointer++ = '\"';
+			break;
+		case '\b':
+			*output_pointer++ = 'b';
+			break;
+		case '\f':
+			*output_pointer++ = 'f';
+			break;
+		case '\n':
+			*output_pointer++ = 'n';
+			break;
+		case '\r':
+			*output_pointer++ = 'r';
+			break;
+		case '\t':
+			*output_pointer++ = 't';
+			break;
+		default:
+			/* escape and print as unicode codepoint */
+			snprintf(output_pointer, 6, "u%04x", c);
+			output_pointer += 5;
+			break;
 		}
 	}
-	output[output_length + 1] = '\"';
-	output[output_length + 2] = '\0';
+	*output_pointer++ = '\"';
+	*output_pointer = '\0';
+	writer->length = (size_t)(output_pointer - writer->buffer);
 
 	return true;
 }
\ No newline at end of file
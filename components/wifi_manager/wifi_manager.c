@@ -40,6 +40,7 @@ Contains the freeRTOS task and all necessary support
 #include "esp_netif.h"
 #include "esp_wifi_types.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "mdns.h"
@@ -67,17 +68,52 @@ TimerHandle_t wifi_manager_retry_timer = NULL;
  * There is no point hogging a hardware timer for a functionality like this which only needs to be 'accurate enough' */
 TimerHandle_t wifi_manager_shutdown_ap_timer = NULL;
 
-SemaphoreHandle_t wifi_manager_json_mutex = NULL;
 SemaphoreHandle_t wifi_manager_sta_ip_mutex = NULL;
 char *wifi_manager_sta_ip = NULL;
 uint16_t ap_num = MAX_AP_NUM;
 wifi_ap_record_t *accessp_records;
-char *accessp_json = NULL;
-char *ip_info_json = NULL;
+
+/* @brief number of records accessp_records can hold. Grows with the scans, never shrinks. */
+static uint16_t accessp_records_capacity = MAX_AP_NUM;
+
+/* @brief currently published json documents. Each is replaced as a whole and freed by whoever drops the last reference,
+ * so a slow HTTP client sending an old version never holds up the wifi_manager task. */
+static wifi_manager_json_t *accessp_json = NULL;
+static wifi_manager_json_t *ip_info_json = NULL;
+
+/* @brief guards the swap of the two pointers above and the reference counts, only ever held for a few instructions */
+static portMUX_TYPE wifi_manager_json_mux = portMUX_INITIALIZER_UNLOCKED;
 wifi_config_t* wifi_manager_config_sta = NULL;
 
-/* @brief Array of callback function pointers */
-void (**cb_ptr_arr)(void*) = NULL;
+/* @brief set on the callbacks registered by wifi_manager_set_callback, which replace each other */
+#define WIFI_MANAGER_CALLBACK_LEGACY		(1u << 31)
+
+/* @brief a callback registered for one message */
+typedef struct wifi_manager_subscriber_t{
+	message_code_t code;
+	wifi_manager_cb_t func;
+	int8_t priority;
+	uint32_t flags;
+	wifi_manager_callback_stats_t stats;
+} wifi_manager_subscriber_t;
+
+/* @brief callbacks sorted by message code then by decreasing priority, guarded by subscribers_mux */
+static wifi_manager_subscriber_t subscribers[WIFI_MANAGER_MAX_SUBSCRIBERS];
+static uint8_t subscriber_count = 0;
+static portMUX_TYPE subscribers_mux = portMUX_INITIALIZER_UNLOCKED;
+
+#if WIFI_MANAGER_ASYNC_CALLBACKS
+/* @brief one call handed over to the callback worker, with its own copy of the message */
+typedef struct wifi_manager_async_call_t{
+	wifi_manager_cb_t func;
+	bool has_param;
+	queue_message msg;
+} wifi_manager_async_call_t;
+
+static QueueHandle_t callback_queue = NULL;
+static TaskHandle_t task_callback = NULL;
+static void wifi_manager_callback_task(void *pvParameters);
+#endif
 
 /* @brief tag used for ESP serial console messages */
 static const char TAG[] = "wifi_manager";
@@ -107,6 +143,31 @@ struct wifi_settings_t wifi_settings = {
 
 const char wifi_manager_nvs_namespace[] = "espwifimgr";
 
+/* @brief known networks, most recently connected first. The list ends at the first empty ssid. */
+static struct wifi_manager_profile_t profiles[WIFI_MANAGER_MAX_PROFILES];
+
+/* @brief request to connect with once the scan ranking the known networks is done, CONNECTION_REQUEST_NONE if no such scan is pending */
+static connection_request_made_by_code_t profile_scan_request = CONNECTION_REQUEST_NONE;
+
+/* @brief set when the next connection attempt must use the current network as is rather than rank the known networks again */
+static bool profile_scan_done = false;
+
+/* @brief true while the current connection attempt is pinned to the BSSID and channel saved in the network's profile */
+static bool ap_hint_in_use = false;
+
+/* @brief set once a direct connection failed, so that retries scan all channels until the next success */
+static bool ap_hint_failed = false;
+
+/* @brief reconnection statistics, see wifi_manager_get_reconnect_stats */
+static wifi_manager_reconnect_stats_t reconnect_stats;
+static portMUX_TYPE reconnect_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* @brief driver events dropped because the queue was full. Only written by the system event task */
+static volatile uint32_t queue_overflows = 0;
+
+/* @brief esp_timer time at which the current connection attempt started, 0 if none */
+static int64_t connect_started_at = 0;
+
 static EventGroupHandle_t wifi_manager_event_group;
 
 /* @brief indicate that the ESP32 is currently connected. */
@@ -177,20 +238,13 @@ void wifi_manager_start(){
 	ESP_ERROR_CHECK(nvs_sync_create()); /* semaphore for thread synchronization on NVS memory */
 
 	/* memory allocation */
-	wifi_manager_queue = xQueueCreate( 3, sizeof( queue_message) );
-	wifi_manager_json_mutex = xSemaphoreCreateMutex();
+	wifi_manager_queue = xQueueCreate( WIFI_MANAGER_QUEUE_SIZE, sizeof( queue_message) );
 	accessp_records = (wifi_ap_record_t*)malloc(sizeof(wifi_ap_record_t) * MAX_AP_NUM);
-	accessp_json = (char*)malloc(MAX_AP_NUM * JSON_ONE_APP_SIZE + 4); /* 4 bytes for json encapsulation of "[\n" and "]\0" */
 	wifi_manager_clear_access_points_json();
-	ip_info_json = (char*)malloc(sizeof(char) * JSON_IP_INFO_SIZE);
 	wifi_manager_clear_ip_info_json();
 	wifi_manager_config_sta = (wifi_config_t*)malloc(sizeof(wifi_config_t));
 	memset(wifi_manager_config_sta, 0x00, sizeof(wifi_config_t));
 	memset(&wifi_settings.sta_static_ip_config, 0x00, sizeof(esp_netif_ip_info_t));
-	cb_ptr_arr = malloc(sizeof(void (*)(void*)) * WM_MESSAGE_CODE_COUNT);
-	for(int i=0; i<WM_MESSAGE_CODE_COUNT; i++){
-		cb_ptr_arr[i] = NULL;
-	}
 	wifi_manager_sta_ip_mutex = xSemaphoreCreateMutex();
 	wifi_manager_sta_ip = (char*)malloc(sizeof(char) * IP4ADDR_STRLEN_MAX);
 	wifi_manager_safe_update_sta_ip_string((uint32_t)0);
@@ -202,6 +256,12 @@ void wifi_manager_start(){
 	/* create timer for to keep track of AP shutdown */
 	wifi_manager_shutdown_ap_timer = xTimerCreate( NULL, pdMS_TO_TICKS(WIFI_MANAGER_SHUTDOWN_AP_TIMER), pdFALSE, ( void * ) 0, wifi_manager_timer_shutdown_ap_cb);
 
+#if WIFI_MANAGER_ASYNC_CALLBACKS
+	/* worker for the callbacks that must not hold up the wifi_manager */
+	callback_queue = xQueueCreate( WIFI_MANAGER_QUEUE_SIZE, sizeof(wifi_manager_async_call_t) );
+	xTaskCreate(&wifi_manager_callback_task, "wifi_manager_cb", WIFI_MANAGER_CALLBACK_TASK_STACK, NULL, WIFI_MANAGER_TASK_PRIORITY-1, &task_callback);
+#endif
+
 	/* start wifi manager task */
 	xTaskCreate(&wifi_manager, "wifi_manager", 4096, NULL, WIFI_MANAGER_TASK_PRIORITY, &task_wifi_manager);
 }
@@ -266,7 +326,9 @@ esp_err_t wifi_manager_save_sta_config(){
 				tmp_settings.ap_bandwidth != wifi_settings.ap_bandwidth ||
 				tmp_settings.sta_only != wifi_settings.sta_only ||
 				tmp_settings.sta_power_save != wifi_settings.sta_power_save ||
-				tmp_settings.ap_channel != wifi_settings.ap_channel
+				tmp_settings.ap_channel != wifi_settings.ap_channel ||
+				tmp_settings.sta_static_ip != wifi_settings.sta_static_ip ||
+				memcmp(&tmp_settings.sta_static_ip_config, &wifi_settings.sta_static_ip_config, sizeof(esp_netif_ip_info_t)) != 0
 				)
 		){
 			esp_err = nvs_set_blob(handle, "settings", &wifi_settings, sizeof(wifi_settings));
@@ -384,8 +446,305 @@ bool wifi_manager_fetch_wifi_sta_config(){
 }
 
 
+static void wifi_manager_fetch_profiles(){
+
+	nvs_handle handle;
+	size_t sz = sizeof(profiles);
+
+	memset(profiles, 0x00, sizeof(profiles));
+	if(nvs_sync_lock( portMAX_DELAY )){
+		if(nvs_open(wifi_manager_nvs_namespace, NVS_READONLY, &handle) == ESP_OK){
+			/* a blob of another size was written with a different WIFI_MANAGER_MAX_PROFILES: keep what fits */
+			if(nvs_get_blob(handle, "profiles", NULL, &sz) == ESP_OK){
+				uint8_t *buff = (uint8_t*)malloc(sz);
+				if(buff && nvs_get_blob(handle, "profiles", buff, &sz) == ESP_OK){
+					memcpy(profiles, buff, sz < sizeof(profiles) ? sz - sz % sizeof(struct wifi_manager_profile_t) : sizeof(profiles));
+				}
+				free(buff);
+			}
+			nvs_close(handle);
+		}
+		nvs_sync_unlock();
+	}
+}
+
+static void wifi_manager_save_profiles(){
+
+	nvs_handle handle;
+
+	if(nvs_sync_lock( portMAX_DELAY )){
+		if(nvs_open(wifi_manager_nvs_namespace, NVS_READWRITE, &handle) == ESP_OK){
+			if(nvs_set_blob(handle, "profiles", profiles, sizeof(profiles)) == ESP_OK){
+				/* single network hint of older firmwares, superseded by the profiles */
+				nvs_erase_key(handle, "ap_hint");
+				nvs_commit(handle);
+			}
+			nvs_close(handle);
+		}
+		nvs_sync_unlock();
+	}
+}
+
+static int wifi_manager_profile_count(){
+	int count = 0;
+	while(count < WIFI_MANAGER_MAX_PROFILES && profiles[count].ssid[0] != '\0') count++;
+	return count;
+}
+
+static struct wifi_manager_profile_t* wifi_manager_find_profile(const uint8_t *ssid){
+	for(int i=0; i<wifi_manager_profile_count(); i++){
+		if(strncmp((const char*)profiles[i].ssid, (const char*)ssid, MAX_SSID_SIZE) == 0) return &profiles[i];
+	}
+	return NULL;
+}
+
+/**
+ * @brief Moves the network config just connected to to the front of the profiles, with the AP it landed on as the hint.
+ * The least recently used profile is dropped when the list is full. Flash is only written if something changed.
+ */
+static void wifi_manager_remember_profile(const wifi_config_t *config, const uint8_t *bssid, uint8_t channel){
+
+	struct wifi_manager_profile_t profile;
+	int count = wifi_manager_profile_count();
+	int index = count < WIFI_MANAGER_MAX_PROFILES ? count : WIFI_MANAGER_MAX_PROFILES - 1;
+
+	memset(&profile, 0x00, sizeof(profile));
+	memcpy(profile.ssid, config->sta.ssid, sizeof(profile.ssid));
+	memcpy(profile.password, config->sta.password, sizeof(profile.password));
+	if(bssid){
+		memcpy(profile.bssid, bssid, sizeof(profile.bssid));
+		profile.channel = channel;
+	}
+
+	struct wifi_manager_profile_t *known = wifi_manager_find_profile(profile.ssid);
+	if(known){
+		if(known == &profiles[0] && memcmp(known, &profile, sizeof(profile)) == 0) return;
+		index = known - profiles;
+	}
+	memmove(&profiles[1], &profiles[0], index * sizeof(struct wifi_manager_profile_t));
+	memcpy(&profiles[0], &profile, sizeof(profile));
+
+	wifi_manager_save_profiles();
+	ESP_LOGI(TAG, "wifi_manager_remember_profile: ssid:%s channel:%d (%d known networks)", profile.ssid, channel, wifi_manager_profile_count());
+}
+
+/**
+ * @brief Forgets every known network, so that the next boot stays in portal mode.
+ */
+static void wifi_manager_forget_profiles(){
+	memset(profiles, 0x00, sizeof(profiles));
+	wifi_manager_save_profiles();
+}
+
+/**
+ * @brief Loads the known network with the strongest AP in the scan list into the STA config, with that AP as the hint.
+ * @note the list must be sorted by decreasing RSSI, see wifi_manager_filter_unique
+ * @return true if a known network is in range.
+ */
+static bool wifi_manager_select_profile(const wifi_ap_record_t *aplist, uint16_t aps){
+
+	for(int i=0; i<aps; i++){
+		struct wifi_manager_profile_t *profile = wifi_manager_find_profile(aplist[i].ssid);
+		if(profile){
+			memcpy(profile->bssid, aplist[i].bssid, sizeof(profile->bssid));
+			profile->channel = aplist[i].primary;
+			memcpy(wifi_manager_config_sta->sta.ssid, profile->ssid, sizeof(wifi_manager_config_sta->sta.ssid));
+			memcpy(wifi_manager_config_sta->sta.password, profile->password, sizeof(wifi_manager_config_sta->sta.password));
+			ESP_LOGI(TAG, "Strongest known network: %s (rssi %d, channel %d)", profile->ssid, aplist[i].rssi, profile->channel);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * @brief Scans once to pick the strongest of the known networks, then connects to it with request.
+ */
+static void wifi_manager_scan_for_profiles(connection_request_made_by_code_t request, const wifi_scan_config_t *scan_config){
+
+	EventBits_t uxBits = xEventGroupGetBits(wifi_manager_event_group);
+
+	ESP_LOGI(TAG, "%d known networks: scanning to pick the strongest", wifi_manager_profile_count());
+	profile_scan_request = request;
+	/* a scan already in progress will do */
+	if(! (uxBits & WIFI_MANAGER_SCAN_BIT) ){
+		xEventGroupSetBits(wifi_manager_event_group, WIFI_MANAGER_SCAN_BIT);
+		if(esp_wifi_scan_start(scan_config, false) != ESP_OK){
+			/* connect to the current network the usual way rather than not at all */
+			xEventGroupClearBits(wifi_manager_event_group, WIFI_MANAGER_SCAN_BIT);
+			profile_scan_request = CONNECTION_REQUEST_NONE;
+			profile_scan_done = true;
+			wifi_manager_send_message(WM_ORDER_CONNECT_STA, (void*)request);
+		}
+	}
+}
+
+/**
+ * @brief true for the disconnect reasons that mean the AP rejected the credentials: retrying soon will not help.
+ */
+static bool wifi_manager_is_auth_failure(uint8_t reason){
+	switch(reason){
+	case WIFI_REASON_AUTH_FAIL:
+	case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+	case WIFI_REASON_HANDSHAKE_TIMEOUT:
+	case WIFI_REASON_802_1X_AUTH_FAILED:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * @brief Time to wait before the next reconnection attempt after the given number of consecutive failures.
+ *
+ * A beacon timeout usually means a short dropout while the AP itself is fine: the first retries are near immediate.
+ * Anything else, NO_AP_FOUND in particular, backs off exponentially from WIFI_MANAGER_RETRY_TIMER up to
+ * WIFI_MANAGER_RETRY_MAX_TIMER, with half of the delay randomized so that devices behind the same AP do not retry in lockstep.
+ * An authentication failure waits the maximum right away.
+ */
+static uint32_t wifi_manager_retry_delay(uint8_t reason, uint32_t failures){
+
+	uint32_t delay = WIFI_MANAGER_RETRY_MAX_TIMER;
+
+	if(reason == WIFI_REASON_BEACON_TIMEOUT && failures <= WIFI_MANAGER_FAST_RETRIES){
+		return WIFI_MANAGER_FAST_RETRY_TIMER;
+	}
+
+	if(!wifi_manager_is_auth_failure(reason)){
+		uint32_t shift = failures > 0 ? failures - 1 : 0;
+		if(shift < 16 && ((uint32_t)WIFI_MANAGER_RETRY_TIMER << shift) < WIFI_MANAGER_RETRY_MAX_TIMER){
+			delay = (uint32_t)WIFI_MANAGER_RETRY_TIMER << shift;
+		}
+	}
+
+	/* equal jitter: somewhere between half and all of the delay */
+	return delay / 2 + esp_random() % (delay / 2 + 1);
+}
+
+void wifi_manager_get_reconnect_stats(wifi_manager_reconnect_stats_t *stats){
+	portENTER_CRITICAL(&reconnect_stats_mux);
+	memcpy(stats, &reconnect_stats, sizeof(wifi_manager_reconnect_stats_t));
+	portEXIT_CRITICAL(&reconnect_stats_mux);
+}
+
+/**
+ * @brief Configure the STA netif for the next association: either the saved static address, with DHCP off so that
+ * GOT_IP is posted as soon as the link is up, or the DHCP client.
+ */
+static void wifi_manager_apply_sta_ip_config(){
+
+	if(wifi_settings.sta_static_ip && wifi_settings.sta_static_ip_config.ip.addr != 0){
+		/* DHCP client must be stopped before setting new IP information. It is already stopped on every attempt but the first. */
+		esp_netif_dhcpc_stop(esp_netif_sta);
+		if(esp_netif_set_ip_info(esp_netif_sta, &wifi_settings.sta_static_ip_config) != ESP_OK){
+			ESP_LOGE(TAG, "Could not apply the static IP configuration, using DHCP");
+			esp_netif_dhcpc_start(esp_netif_sta);
+			return;
+		}
+		/* without DHCP there is no DNS server either: the gateway is the best guess */
+		esp_netif_dns_info_t dns;
+		memset(&dns, 0x00, sizeof(dns));
+		dns.ip.u_addr.ip4.addr = wifi_settings.sta_static_ip_config.gw.addr;
+		dns.ip.type = ESP_IPADDR_TYPE_V4;
+		esp_netif_set_dns_info(esp_netif_sta, ESP_NETIF_DNS_MAIN, &dns);
+		ESP_LOGI(TAG, "Using static IP configuration");
+	}
+	else{
+		/* no-op when the client is already running */
+		esp_netif_dhcpc_start(esp_netif_sta);
+	}
+}
+
+
+/**
+ * @brief Allocates an unpublished json document that can hold size bytes, null terminator included.
+ */
+static wifi_manager_json_t* wifi_manager_json_alloc(size_t size){
+	wifi_manager_json_t *json = (wifi_manager_json_t*)malloc(sizeof(wifi_manager_json_t) + size);
+	if(json){
+		json->references = 1;
+		json->length = 0;
+		json->etag = 0;
+		json->created_at = 0;
+		json->json[0] = '\0';
+	}
+	else{
+		ESP_LOGE(TAG, "could not allocate %d bytes for a json document, keeping the previous one", (int)size);
+	}
+	return json;
+}
+
+/**
+ * @brief Replaces the document in *slot by json, which takes over the reference returned by wifi_manager_json_alloc.
+ */
+static void wifi_manager_json_publish(wifi_manager_json_t **slot, wifi_manager_json_t *json){
+	wifi_manager_json_t *previous;
+
+	if(json){
+		/* FNV-1a of the content: identical documents get identical tags */
+		uint32_t hash = 2166136261u;
+		for(size_t i=0; i<json->length; i++){
+			hash = (hash ^ (uint8_t)json->json[i]) * 16777619u;
+		}
+		json->etag = hash;
+	}
+
+	portENTER_CRITICAL(&wifi_manager_json_mux);
+	previous = *slot;
+	*slot = json;
+	portEXIT_CRITICAL(&wifi_manager_json_mux);
+
+	wifi_manager_release_json(previous);
+}
+
+static const wifi_manager_json_t* wifi_manager_json_acquire(wifi_manager_json_t **slot){
+	wifi_manager_json_t *json;
+
+	/* loading the pointer and taking the reference must be atomic, or the publisher could free it in between */
+	portENTER_CRITICAL(&wifi_manager_json_mux);
+	json = *slot;
+	if(json) json->references++;
+	portEXIT_CRITICAL(&wifi_manager_json_mux);
+
+	return json;
+}
+
+void wifi_manager_release_json(const wifi_manager_json_t *json){
+	bool last;
+
+	if(json == NULL) return;
+
+	portENTER_CRITICAL(&wifi_manager_json_mux);
+	last = --((wifi_manager_json_t*)json)->references == 0;
+	portEXIT_CRITICAL(&wifi_manager_json_mux);
+
+	if(last) free((void*)json);
+}
+
+const wifi_manager_json_t* wifi_manager_acquire_ap_list_json(){
+	return wifi_manager_json_acquire(&accessp_json);
+}
+
+const wifi_manager_json_t* wifi_manager_acquire_ip_info_json(){
+	return wifi_manager_json_acquire(&ip_info_json);
+}
+
+/**
+ * @brief Publishes a document holding a constant string.
+ */
+static void wifi_manager_json_publish_string(wifi_manager_json_t **slot, const char *str){
+	size_t length = strlen(str);
+	wifi_manager_json_t *json = wifi_manager_json_alloc(length + 1);
+	if(json){
+		memcpy(json->json, str, length + 1);
+		json->length = length;
+		wifi_manager_json_publish(slot, json);
+	}
+}
+
 void wifi_manager_clear_ip_info_json(){
-	strcpy(ip_info_json, "{}\n");
+	wifi_manager_json_publish_string(&ip_info_json, "{}\n");
 }
 
 
@@ -394,44 +753,47 @@ void wifi_manager_generate_ip_info_json(update_reason_code_t update_reason_code)
 	wifi_config_t *config = wifi_manager_get_wifi_sta_config();
 	if(config){
 
-		const char *ip_info_json_format = ",\"ip\":\"%s\",\"netmask\":\"%s\",\"gw\":\"%s\",\"urc\":%d}\n";
-
-		memset(ip_info_json, 0x00, JSON_IP_INFO_SIZE);
+		char ip[IP4ADDR_STRLEN_MAX] = "0"; /* note: IP4ADDR_STRLEN_MAX is defined in lwip */
+		char gw[IP4ADDR_STRLEN_MAX] = "0";
+		char netmask[IP4ADDR_STRLEN_MAX] = "0";
 
-		/* to avoid declaring a new buffer we copy the data directly into the buffer at its correct address */
-		strcpy(ip_info_json, "{\"ssid\":");
-		json_print_string(config->sta.ssid,  (unsigned char*)(ip_info_json+strlen(ip_info_json)) );
-
-		size_t ip_info_json_len = strlen(ip_info_json);
-		size_t remaining = JSON_IP_INFO_SIZE - ip_info_json_len;
 		if(update_reason_code == UPDATE_CONNECTION_OK){
-			/* rest of the information is copied after the ssid */
 			esp_netif_ip_info_t ip_info;
 			ESP_ERROR_CHECK(esp_netif_get_ip_info(esp_netif_sta, &ip_info));
 
-			char ip[IP4ADDR_STRLEN_MAX]; /* note: IP4ADDR_STRLEN_MAX is defined in lwip */
-			char gw[IP4ADDR_STRLEN_MAX];
-			char netmask[IP4ADDR_STRLEN_MAX];
-
 			esp_ip4addr_ntoa(&ip_info.ip, ip, IP4ADDR_STRLEN_MAX);
 			esp_ip4addr_ntoa(&ip_info.gw, gw, IP4ADDR_STRLEN_MAX);
 			esp_ip4addr_ntoa(&ip_info.netmask, netmask, IP4ADDR_STRLEN_MAX);
-
-
-			snprintf( (ip_info_json + ip_info_json_len), remaining, ip_info_json_format,
-					ip,
-					netmask,
-					gw,
-					(int)update_reason_code);
 		}
-		else{
-			/* notify in the json output the reason code why this was updated without a connection */
-			snprintf( (ip_info_json + ip_info_json_len), remaining, ip_info_json_format,
-								"0",
-								"0",
-								"0",
-								(int)update_reason_code);
+		/* otherwise the ips stay "0" and the json only notifies the reason code why this was updated without a connection */
+
+		wifi_manager_json_t *json = wifi_manager_json_alloc(JSON_IP_INFO_SIZE);
+		if(json == NULL) return;
+
+		json_writer_t writer;
+		json_writer_init(&writer, json->json, JSON_IP_INFO_SIZE);
+		json_writer_raw(&writer, "{\"ssid\":");
+		json_writer_string(&writer, config->sta.ssid, sizeof(config->sta.ssid));
+		json_writer_raw(&writer, ",\"ip\":\"");
+		json_writer_raw(&writer, ip);
+		json_writer_raw(&writer, "\",\"netmask\":\"");
+		json_writer_raw(&writer, netmask);
+		json_writer_raw(&writer, "\",\"gw\":\"");
+		json_writer_raw(&writer, gw);
+		json_writer_raw(&writer, "\",\"urc\":");
+		json_writer_int(&writer, (int)update_reason_code);
+		json_writer_raw(&writer, "}\n");
+
+		/* cannot happen as JSON_IP_INFO_SIZE is the worst case, but never publish a truncated document */
+		if(writer.overflow){
+			ESP_LOGE(TAG, "ip info json does not fit in %d bytes", JSON_IP_INFO_SIZE);
+			wifi_manager_release_json(json);
+			wifi_manager_clear_ip_info_json();
+			return;
 		}
+		json->length = writer.length;
+		json->created_at = esp_timer_get_time();
+		wifi_manager_json_publish(&ip_info_json, json);
 	}
 	else{
 		wifi_manager_clear_ip_info_json();
@@ -442,36 +804,62 @@ void wifi_manager_generate_ip_info_json(update_reason_code_t update_reason_code)
 
 
 void wifi_manager_clear_access_points_json(){
-	strcpy(accessp_json, "[]\n");
+	wifi_manager_json_publish_string(&accessp_json, "[]\n");
 }
-void wifi_manager_generate_acess_points_json(){
 
-	strcpy(accessp_json, "[");
+size_t wifi_manager_access_points_json_size(const wifi_ap_record_t *aplist, uint16_t aps){
 
+	/* "[", "]\n" and the null terminator */
+	size_t size = 4;
 
-	const char oneap_str[] = ",\"chan\":%d,\"rssi\":%d,\"auth\":%d}%c\n";
+	for(int i=0; i<aps; i++){
+		size += JSON_ONE_APP_SIZE - JSON_STRING_MAX_LENGTH(MAX_SSID_SIZE) + json_string_length(aplist[i].ssid, sizeof(aplist[i].ssid));
+	}
 
-	/* stack buffer to hold on to one AP until it's copied over to accessp_json */
-	char one_ap[JSON_ONE_APP_SIZE];
-	for(int i=0; i<ap_num;i++){
+	return size;
+}
 
-		wifi_ap_record_t ap = accessp_records[i];
+void wifi_manager_generate_acess_points_json(){
 
-		/* ssid needs to be json escaped. To save on heap memory it's directly printed at the correct address */
-		strcat(accessp_json, "{\"ssid\":");
-		json_print_string( (unsigned char*)ap.ssid,  (unsigned char*)(accessp_json+strlen(accessp_json)) );
+	json_writer_t writer;
+	size_t size = wifi_manager_access_points_json_size(accessp_records, ap_num);
+	wifi_manager_json_t *json = wifi_manager_json_alloc(size);
+	if(json == NULL) return;
 
-		/* print the rest of the json for this access point: no more string to escape */
-		snprintf(one_ap, (size_t)JSON_ONE_APP_SIZE, oneap_str,
-				ap.primary,
-				ap.rssi,
-				ap.authmode,
-				i==ap_num-1?']':',');
+	/* keep room for the closing "]\n" so that the list can always be terminated */
+	json_writer_init(&writer, json->json, size - 2);
+	json_writer_raw(&writer, "[");
 
-		/* add it to the list */
-		strcat(accessp_json, one_ap);
+	for(int i=0; i<ap_num;i++){
+
+		const wifi_ap_record_t *ap = &accessp_records[i];
+		size_t element_start = writer.length;
+
+		if(i > 0) json_writer_raw(&writer, ",\n");
+		json_writer_raw(&writer, "{\"ssid\":");
+		json_writer_string(&writer, ap->ssid, sizeof(ap->ssid));
+		json_writer_raw(&writer, ",\"chan\":");
+		json_writer_int(&writer, ap->primary);
+		json_writer_raw(&writer, ",\"rssi\":");
+		json_writer_int(&writer, ap->rssi);
+		json_writer_raw(&writer, ",\"auth\":");
+		json_writer_int(&writer, ap->authmode);
+		json_writer_raw(&writer, "}");
+
+		/* the list is sorted by rssi: if the buffer is full, drop this AP and every weaker one */
+		if(writer.overflow){
+			json_writer_rewind(&writer, element_start);
+			ESP_LOGW(TAG, "ap list json full, %d of %d access points published", i, ap_num);
+			break;
+		}
 	}
 
+	writer.size = size;
+	json_writer_raw(&writer, "]\n");
+
+	json->length = writer.length;
+	json->created_at = esp_timer_get_time();
+	wifi_manager_json_publish(&accessp_json, json);
 }
 
 
@@ -516,35 +904,34 @@ char* wifi_manager_get_sta_ip_string(){
 	return wifi_manager_sta_ip;
 }
 
+bool wifi_manager_is_sta_connected(){
+	return wifi_manager_event_group && (xEventGroupGetBits(wifi_manager_event_group) & WIFI_MANAGER_WIFI_CONNECTED_BIT);
+}
+
+
 
-bool wifi_manager_lock_json_buffer(TickType_t xTicksToWait){
-	if(wifi_manager_json_mutex){
-		if( xSemaphoreTake( wifi_manager_json_mutex, xTicksToWait ) == pdTRUE ) {
-			return true;
-		}
-		else{
-			return false;
-		}
-	}
-	else{
-		return false;
-	}
 
-}
-void wifi_manager_unlock_json_buffer(){
-	xSemaphoreGive( wifi_manager_json_mutex );
-}
 
-char* wifi_manager_get_ap_list_json(){
-	return accessp_json;
+/**
+ * @brief Posts a driver event without waiting: the system event task must never block on the wifi_manager.
+ */
+static void wifi_manager_post_event(const queue_message *msg){
+	if(xQueueSend( wifi_manager_queue, msg, 0) != pdTRUE){
+		queue_overflows++;
+		ESP_LOGW(TAG, "queue full, event %d dropped (%u so far)", msg->code, queue_overflows);
+	}
 }
 
+uint32_t wifi_manager_get_queue_overflows(){
+	return queue_overflows;
+}
 
 /**
  * @brief Standard wifi event handler
  */
 static void wifi_manager_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data){
 
+	queue_message msg;
 
 	if (event_base == WIFI_EVENT){
 
@@ -571,9 +958,9 @@ static void wifi_manager_event_handler(void* arg, esp_event_base_t event_base, i
 		case WIFI_EVENT_SCAN_DONE:
 			ESP_LOGD(TAG, "WIFI_EVENT_SCAN_DONE");
 	    	xEventGroupClearBits(wifi_manager_event_group, WIFI_MANAGER_SCAN_BIT);
-			wifi_event_sta_scan_done_t* event_sta_scan_done = (wifi_event_sta_scan_done_t*)malloc(sizeof(wifi_event_sta_scan_done_t));
-			*event_sta_scan_done = *((wifi_event_sta_scan_done_t*)event_data);
-	    	wifi_manager_send_message(WM_EVENT_SCAN_DONE, event_sta_scan_done);
+			msg.code = WM_EVENT_SCAN_DONE;
+			msg.scan_done = *((wifi_event_sta_scan_done_t*)event_data);
+	    	wifi_manager_post_event(&msg);
 			break;
 
 		/* If esp_wifi_start() returns ESP_OK and the current Wi-Fi mode is Station or AP+Station, then this event will
@@ -647,14 +1034,13 @@ static void wifi_manager_event_handler(void* arg, esp_event_base_t event_base, i
 		case WIFI_EVENT_STA_DISCONNECTED:
 			ESP_LOGI(TAG, "WIFI_EVENT_STA_DISCONNECTED");
 
-			wifi_event_sta_disconnected_t* wifi_event_sta_disconnected = (wifi_event_sta_disconnected_t*)malloc(sizeof(wifi_event_sta_disconnected_t));
-			*wifi_event_sta_disconnected =  *( (wifi_event_sta_disconnected_t*)event_data );
-
 			/* if a DISCONNECT message is posted while a scan is in progress this scan will NEVER end, causing scan to never work again. For this reason SCAN_BIT is cleared too */
 			xEventGroupClearBits(wifi_manager_event_group, WIFI_MANAGER_WIFI_CONNECTED_BIT | WIFI_MANAGER_SCAN_BIT);
 
 			/* post disconnect event with reason code */
-			wifi_manager_send_message(WM_EVENT_STA_DISCONNECTED, (void*)wifi_event_sta_disconnected );
+			msg.code = WM_EVENT_STA_DISCONNECTED;
+			msg.sta_disconnected = *( (wifi_event_sta_disconnected_t*)event_data );
+			wifi_manager_post_event(&msg);
 			break;
 
 		/* This event arises when the AP to which the station is connected changes its authentication mode, e.g., from no auth
@@ -717,9 +1103,9 @@ static void wifi_manager_event_handler(void* arg, esp_event_base_t event_base, i
 		case IP_EVENT_STA_GOT_IP:
 			ESP_LOGI(TAG, "IP_EVENT_STA_GOT_IP");
 	        xEventGroupSetBits(wifi_manager_event_group, WIFI_MANAGER_WIFI_CONNECTED_BIT);
-	        ip_event_got_ip_t* ip_event_got_ip = (ip_event_got_ip_t*)malloc(sizeof(ip_event_got_ip_t));
-			*ip_event_got_ip =  *( (ip_event_got_ip_t*)event_data );
-	        wifi_manager_send_message(WM_EVENT_STA_GOT_IP, (void*)(ip_event_got_ip) );
+			msg.code = WM_EVENT_STA_GOT_IP;
+			msg.got_ip = *( (ip_event_got_ip_t*)event_data );
+	        wifi_manager_post_event(&msg);
 			break;
 
 		/* This event arises when the IPV6 SLAAC support auto-configures an address for the ESP32, or when this address changes.
@@ -754,17 +1140,12 @@ void wifi_manager_connect_async(){
 	 * There'se a risk the front end sees an IP or a password error when in fact
 	 * it's a remnant from a previous connection
 	 */
-	if(wifi_manager_lock_json_buffer( portMAX_DELAY )){
-		wifi_manager_clear_ip_info_json();
-		wifi_manager_unlock_json_buffer();
-	}
+	wifi_manager_clear_ip_info_json();
 	wifi_manager_send_message(WM_ORDER_CONNECT_STA, (void*)CONNECTION_REQUEST_USER);
 }
 
 
-char* wifi_manager_get_ip_info_json(){
-	return ip_info_json;
-}
+
 
 
 void wifi_manager_destroy(){
@@ -775,10 +1156,9 @@ void wifi_manager_destroy(){
 	/* heap buffers */
 	free(accessp_records);
 	accessp_records = NULL;
-	free(accessp_json);
-	accessp_json = NULL;
-	free(ip_info_json);
-	ip_info_json = NULL;
+	/* documents still held by the HTTP server are freed when it releases them */
+	wifi_manager_json_publish(&accessp_json, NULL);
+	wifi_manager_json_publish(&ip_info_json, NULL);
 	free(wifi_manager_sta_ip);
 	wifi_manager_sta_ip = NULL;
 	if(wifi_manager_config_sta){
@@ -787,71 +1167,23 @@ void wifi_manager_destroy(){
 	}
 
 	/* RTOS objects */
-	vSemaphoreDelete(wifi_manager_json_mutex);
-	wifi_manager_json_mutex = NULL;
 	vSemaphoreDelete(wifi_manager_sta_ip_mutex);
 	wifi_manager_sta_ip_mutex = NULL;
 	vEventGroupDelete(wifi_manager_event_group);
 	wifi_manager_event_group = NULL;
 	vQueueDelete(wifi_manager_queue);
 	wifi_manager_queue = NULL;
+#if WIFI_MANAGER_ASYNC_CALLBACKS
+	vTaskDelete(task_callback);
+	task_callback = NULL;
+	vQueueDelete(callback_queue);
+	callback_queue = NULL;
+#endif
 
 
 }
 
 
-void wifi_manager_filter_unique( wifi_ap_record_t * aplist, uint16_t * aps) {
-	int total_unique;
-	wifi_ap_record_t * first_free;
-	total_unique=*aps;
-
-	first_free=NULL;
-
-	for(int i=0; i<*aps-1;i++) {
-		wifi_ap_record_t * ap = &aplist[i];
-
-		/* skip the previously removed APs */
-		if (ap->ssid[0] == 0) continue;
-
-		/* remove the identical SSID+authmodes */
-		for(int j=i+1; j<*aps;j++) {
-			wifi_ap_record_t * ap1 = &aplist[j];
-			if ( (strcmp((const char *)ap->ssid, (const char *)ap1->ssid)==0) && 
-			     (ap->authmode == ap1->authmode) ) { /* same SSID, different auth mode is skipped */
-				/* save the rssi for the display */
-				if ((ap1->rssi) > (ap->rssi)) ap->rssi=ap1->rssi;
-				/* clearing the record */
-				memset(ap1,0, sizeof(wifi_ap_record_t));
-			}
-		}
-	}
-	/* reorder the list so APs follow each other in the list */
-	for(int i=0; i<*aps;i++) {
-		wifi_ap_record_t * ap = &aplist[i];
-		/* skipping all that has no name */
-		if (ap->ssid[0] == 0) {
-			/* mark the first free slot */
-			if (first_free==NULL) first_free=ap;
-			total_unique--;
-			continue;
-		}
-		if (first_free!=NULL) {
-			memcpy(first_free, ap, sizeof(wifi_ap_record_t));
-			memset(ap,0, sizeof(wifi_ap_record_t));
-			/* find the next free slot */
-			for(int j=0; j<*aps;j++) {
-				if (aplist[j].ssid[0]==0) {
-					first_free=&aplist[j];
-					break;
-				}
-			}
-		}
-	}
-	/* update the length of the list */
-	*aps = total_unique;
-}
-
-
 BaseType_t wifi_manager_send_message_to_front(message_code_t code, void *param){
 	queue_message msg;
 	msg.code = code;
@@ -867,10 +1199,184 @@ BaseType_t wifi_manager_send_message(message_code_t code, void *param){
 }
 
 
+/**
+ * @brief Index of the subscription of func to code, -1 if none. Must be called with subscribers_mux held.
+ */
+static int wifi_manager_find_subscriber(message_code_t code, wifi_manager_cb_t func){
+	for(int i=0; i<subscriber_count; i++){
+		if(subscribers[i].code == code && subscribers[i].func == func) return i;
+	}
+	return -1;
+}
+
+/**
+ * @brief Must be called with subscribers_mux held.
+ */
+static void wifi_manager_remove_subscriber(int i){
+	memmove(&subscribers[i], &subscribers[i+1], (subscriber_count - i - 1) * sizeof(wifi_manager_subscriber_t));
+	subscriber_count--;
+}
+
+esp_err_t wifi_manager_subscribe(message_code_t message_code, wifi_manager_cb_t func, int8_t priority, uint32_t flags){
+
+	if(message_code >= WM_MESSAGE_CODE_COUNT || func == NULL) return ESP_ERR_INVALID_ARG;
+
+	wifi_manager_callback_stats_t stats;
+	memset(&stats, 0x00, sizeof(wifi_manager_callback_stats_t));
+	esp_err_t ret = ESP_OK;
+
+	portENTER_CRITICAL(&subscribers_mux);
+
+	/* subscribing again moves the callback to its new priority but keeps its statistics */
+	int i = wifi_manager_find_subscriber(message_code, func);
+	if(i >= 0){
+		stats = subscribers[i].stats;
+		wifi_manager_remove_subscriber(i);
+	}
+
+	if(subscriber_count == WIFI_MANAGER_MAX_SUBSCRIBERS){
+		ret = ESP_ERR_NO_MEM;
+	}
+	else{
+		/* after the callbacks of higher or equal priority, so that equal priorities run in order of subscription */
+		i = 0;
+		while(i < subscriber_count && (subscribers[i].code < message_code || (subscribers[i].code == message_code && subscribers[i].priority >= priority))) i++;
+		memmove(&subscribers[i+1], &subscribers[i], (subscriber_count - i) * sizeof(wifi_manager_subscriber_t));
+		subscribers[i].code = message_code;
+		subscribers[i].func = func;
+		subscribers[i].priority = priority;
+		subscribers[i].flags = flags;
+		subscribers[i].stats = stats;
+		subscriber_count++;
+	}
+
+	portEXIT_CRITICAL(&subscribers_mux);
+
+	if(ret != ESP_OK){
+		ESP_LOGE(TAG, "wifi_manager_subscribe: more than %d callbacks", WIFI_MANAGER_MAX_SUBSCRIBERS);
+	}
+	return ret;
+}
+
+void wifi_manager_unsubscribe(message_code_t message_code, wifi_manager_cb_t func){
+	portENTER_CRITICAL(&subscribers_mux);
+	int i = wifi_manager_find_subscriber(message_code, func);
+	if(i >= 0) wifi_manager_remove_subscriber(i);
+	portEXIT_CRITICAL(&subscribers_mux);
+}
+
 void wifi_manager_set_callback(message_code_t message_code, void (*func_ptr)(void*) ){
 
-	if(cb_ptr_arr && message_code < WM_MESSAGE_CODE_COUNT){
-		cb_ptr_arr[message_code] = func_ptr;
+	if(message_code >= WM_MESSAGE_CODE_COUNT) return;
+
+	/* there used to be a single callback per message: keep replacing the one set through this function */
+	portENTER_CRITICAL(&subscribers_mux);
+	for(int i=0; i<subscriber_count; i++){
+		if(subscribers[i].code == message_code && (subscribers[i].flags & WIFI_MANAGER_CALLBACK_LEGACY)){
+			wifi_manager_remove_subscriber(i);
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&subscribers_mux);
+
+	if(func_ptr){
+		wifi_manager_subscribe(message_code, func_ptr, 0, WIFI_MANAGER_CALLBACK_LEGACY);
+	}
+}
+
+esp_err_t wifi_manager_get_callback_stats(message_code_t message_code, wifi_manager_cb_t func, wifi_manager_callback_stats_t *stats){
+	esp_err_t ret = ESP_ERR_NOT_FOUND;
+	portENTER_CRITICAL(&subscribers_mux);
+	int i = wifi_manager_find_subscriber(message_code, func);
+	if(i >= 0){
+		*stats = subscribers[i].stats;
+		ret = ESP_OK;
+	}
+	portEXIT_CRITICAL(&subscribers_mux);
+	return ret;
+}
+
+/**
+ * @brief Accounts for one call of func, or for one call dropped if us is negative.
+ * The callback may have unsubscribed in the meantime, in which case there is nothing to update.
+ */
+static void wifi_manager_record_call(message_code_t code, wifi_manager_cb_t func, int64_t us){
+	portENTER_CRITICAL(&subscribers_mux);
+	int i = wifi_manager_find_subscriber(code, func);
+	if(i >= 0){
+		wifi_manager_callback_stats_t *stats = &subscribers[i].stats;
+		if(us < 0){
+			stats->dropped++;
+		}
+		else{
+			stats->calls++;
+			stats->total_us += us;
+			if(us > stats->max_us) stats->max_us = (uint32_t)us;
+		}
+	}
+	portEXIT_CRITICAL(&subscribers_mux);
+}
+
+#if WIFI_MANAGER_ASYNC_CALLBACKS
+static void wifi_manager_callback_task(void *pvParameters){
+	wifi_manager_async_call_t call;
+
+	for(;;){
+		if(xQueueReceive(callback_queue, &call, portMAX_DELAY) == pdTRUE){
+			int64_t start = esp_timer_get_time();
+			(*call.func)( call.has_param ? (void*)&call.msg.param : NULL );
+			wifi_manager_record_call(call.msg.code, call.func, esp_timer_get_time() - start);
+		}
+	}
+}
+#endif
+
+/**
+ * @brief Runs the callbacks of msg->code by decreasing priority.
+ * param is NULL or points into msg, which is how asynchronous callbacks get the same field of their own copy.
+ */
+static void wifi_manager_dispatch(const queue_message *msg, void *param){
+
+	/* snapshot so that callbacks run without the lock and may subscribe or unsubscribe */
+	wifi_manager_cb_t funcs[WIFI_MANAGER_MAX_SUBSCRIBERS];
+#if WIFI_MANAGER_ASYNC_CALLBACKS
+	uint32_t flags[WIFI_MANAGER_MAX_SUBSCRIBERS];
+#endif
+	int count = 0;
+
+	portENTER_CRITICAL(&subscribers_mux);
+	for(int i=0; i<subscriber_count; i++){
+		if(subscribers[i].code == msg->code){
+			funcs[count] = subscribers[i].func;
+#if WIFI_MANAGER_ASYNC_CALLBACKS
+			flags[count] = subscribers[i].flags;
+#endif
+			count++;
+		}
+	}
+	portEXIT_CRITICAL(&subscribers_mux);
+
+	for(int i=0; i<count; i++){
+#if WIFI_MANAGER_ASYNC_CALLBACKS
+		if(flags[i] & WIFI_MANAGER_CALLBACK_ASYNC){
+			wifi_manager_async_call_t call;
+			call.func = funcs[i];
+			call.has_param = (param != NULL);
+			call.msg = *msg;
+			if(xQueueSend(callback_queue, &call, 0) != pdTRUE){
+				ESP_LOGW(TAG, "callback queue full, callback %p for message %d dropped", funcs[i], msg->code);
+				wifi_manager_record_call(msg->code, funcs[i], -1);
+			}
+			continue;
+		}
+#endif
+		int64_t start = esp_timer_get_time();
+		(*funcs[i])(param);
+		int64_t us = esp_timer_get_time() - start;
+		wifi_manager_record_call(msg->code, funcs[i], us);
+		if(us > WIFI_MANAGER_CALLBACK_SLOW_US){
+			ESP_LOGW(TAG, "callback %p for message %d held up the wifi_manager for %lld us, consider WIFI_MANAGER_CALLBACK_ASYNC", funcs[i], msg->code, us);
+		}
 	}
 }
 
@@ -979,28 +1485,57 @@ void wifi_manager( void * pvParameters ){
 			switch(msg.code){
 
 			case WM_EVENT_SCAN_DONE:{
-				wifi_event_sta_scan_done_t *evt_scan_done = (wifi_event_sta_scan_done_t*)msg.param;
+				wifi_event_sta_scan_done_t *evt_scan_done = &msg.scan_done;
 				/* only check for AP if the scan is succesful */
 				if(evt_scan_done->status == 0){
+					/* dense areas can return many more APs than MAX_AP_NUM: grow the store rather than drop networks */
+					uint16_t found = 0;
+					esp_wifi_scan_get_ap_num(&found);
+					if(found > accessp_records_capacity){
+						wifi_ap_record_t *records = (wifi_ap_record_t*)realloc(accessp_records, sizeof(wifi_ap_record_t) * found);
+						if(records){
+							accessp_records = records;
+							accessp_records_capacity = found;
+						}
+						else{
+							ESP_LOGW(TAG, "out of memory: keeping %d of %d scanned APs", accessp_records_capacity, found);
+						}
+					}
 					/* As input param, it stores max AP number ap_records can hold. As output param, it receives the actual AP number this API returns.
-					* As a consequence, ap_num MUST be reset to MAX_AP_NUM at every scan */
-					ap_num = MAX_AP_NUM;
+					* As a consequence, ap_num MUST be reset to the capacity at every scan */
+					ap_num = accessp_records_capacity;
 					ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&ap_num, accessp_records));
-					/* make sure the http server isn't trying to access the list while it gets refreshed */
-					if(wifi_manager_lock_json_buffer( pdMS_TO_TICKS(1000) )){
-						/* Will remove the duplicate SSIDs from the list and update ap_num */
-						wifi_manager_filter_unique(accessp_records, &ap_num);
-						wifi_manager_generate_acess_points_json();
-						wifi_manager_unlock_json_buffer();
+					/* Will remove the duplicate SSIDs from the list, sort it by RSSI and update ap_num */
+					int64_t filter_started_at = esp_timer_get_time();
+					uint16_t scanned = ap_num;
+					wifi_manager_filter_unique(accessp_records, &ap_num);
+					ESP_LOGD(TAG, "filtered %d scanned APs down to %d in %lld us", scanned, ap_num, (long long)(esp_timer_get_time() - filter_started_at));
+					/* publish the new list, the http server keeps sending the previous one to clients it is already serving */
+					wifi_manager_generate_acess_points_json();
+				}
+
+				/* this scan was ranking the known networks: connect to the strongest */
+				if(profile_scan_request != CONNECTION_REQUEST_NONE){
+					connection_request_made_by_code_t request = profile_scan_request;
+					profile_scan_request = CONNECTION_REQUEST_NONE;
+					if(evt_scan_done->status == 0 && wifi_manager_select_profile(accessp_records, ap_num)){
+						ap_hint_failed = false;
 					}
 					else{
-						ESP_LOGE(TAG, "could not get access to json mutex in wifi_scan");
+						/* none in range, or hidden: try the current network with a full scan of its own */
+						ESP_LOGW(TAG, "No known network found in the scan");
+						ap_hint_failed = true;
+						if(wifi_manager_config_sta->sta.ssid[0] == '\0'){
+							memcpy(wifi_manager_config_sta->sta.ssid, profiles[0].ssid, sizeof(wifi_manager_config_sta->sta.ssid));
+							memcpy(wifi_manager_config_sta->sta.password, profiles[0].password, sizeof(wifi_manager_config_sta->sta.password));
+						}
 					}
+					profile_scan_done = true;
+					wifi_manager_send_message(WM_ORDER_CONNECT_STA, (void*)request);
 				}
 
 				/* callback */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])( msg.param );
-				free(evt_scan_done);
+				wifi_manager_dispatch(&msg, evt_scan_done);
 				}
 				break;
 
@@ -1015,14 +1550,27 @@ void wifi_manager( void * pvParameters ){
 				}
 
 				/* callback */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])(NULL);
+				wifi_manager_dispatch(&msg, NULL);
 
 				break;
 
 			case WM_ORDER_LOAD_AND_RESTORE_STA:
 				ESP_LOGI(TAG, "MESSAGE: ORDER_LOAD_AND_RESTORE_STA");
-				if(wifi_manager_fetch_wifi_sta_config()){
+				ap_hint_failed = false;
+				profile_scan_done = false;
+				wifi_manager_fetch_profiles();
+				bool saved = wifi_manager_fetch_wifi_sta_config();
+				if(wifi_manager_profile_count() > 1){
+					/* several networks are known: connect to the strongest in range */
+					xEventGroupSetBits(wifi_manager_event_group, WIFI_MANAGER_REQUEST_RESTORE_STA_BIT);
+					wifi_manager_scan_for_profiles(CONNECTION_REQUEST_RESTORE_CONNECTION, &scan_config);
+				}
+				else if(saved || wifi_manager_profile_count() == 1){
 					ESP_LOGI(TAG, "Saved wifi found on startup. Will attempt to connect.");
+					if(!saved){
+						memcpy(wifi_manager_config_sta->sta.ssid, profiles[0].ssid, sizeof(wifi_manager_config_sta->sta.ssid));
+						memcpy(wifi_manager_config_sta->sta.password, profiles[0].password, sizeof(wifi_manager_config_sta->sta.password));
+					}
 					wifi_manager_send_message(WM_ORDER_CONNECT_STA, (void*)CONNECTION_REQUEST_RESTORE_CONNECTION);
 				}
 				else{
@@ -1032,7 +1580,7 @@ void wifi_manager( void * pvParameters ){
 				}
 
 				/* callback */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])(NULL);
+				wifi_manager_dispatch(&msg, NULL);
 
 				break;
 
@@ -1051,9 +1599,41 @@ void wifi_manager( void * pvParameters ){
 				}
 
 				uxBits = xEventGroupGetBits(wifi_manager_event_group);
-				if( ! (uxBits & WIFI_MANAGER_WIFI_CONNECTED_BIT) ){
+				if( ! (uxBits & WIFI_MANAGER_WIFI_CONNECTED_BIT) &&
+						(BaseType_t)msg.param == CONNECTION_REQUEST_AUTO_RECONNECT && ap_hint_failed && !profile_scan_done && wifi_manager_profile_count() > 1){
+					/* the current network could not be reached: check whether another known network is in range */
+					wifi_manager_scan_for_profiles(CONNECTION_REQUEST_AUTO_RECONNECT, &scan_config);
+				}
+				else if( ! (uxBits & WIFI_MANAGER_WIFI_CONNECTED_BIT) ){
+					wifi_config_t* config = wifi_manager_get_wifi_sta_config();
+					struct wifi_manager_profile_t *profile = wifi_manager_find_profile(config->sta.ssid);
+					profile_scan_done = false;
+					/* connect straight to the last known AP on its channel, unless the user picked a network or a direct attempt already failed.
+					 * Without bssid and channel the driver scans every channel before associating. */
+					ap_hint_in_use = WIFI_MANAGER_FAST_RECONNECT &&
+							(BaseType_t)msg.param != CONNECTION_REQUEST_USER &&
+							!ap_hint_failed &&
+							profile != NULL &&
+							profile->channel != 0;
+					if(ap_hint_in_use){
+						config->sta.bssid_set = true;
+						memcpy(config->sta.bssid, profile->bssid, sizeof(config->sta.bssid));
+						config->sta.channel = profile->channel;
+						ESP_LOGI(TAG, "Direct connection to the last known AP on channel %d", profile->channel);
+					}
+					else{
+						config->sta.bssid_set = false;
+						config->sta.channel = 0;
+					}
+					wifi_manager_apply_sta_ip_config();
+					connect_started_at = esp_timer_get_time();
+					if((BaseType_t)msg.param != CONNECTION_REQUEST_USER){
+						portENTER_CRITICAL(&reconnect_stats_mux);
+						reconnect_stats.attempts++;
+						portEXIT_CRITICAL(&reconnect_stats_mux);
+					}
 					/* update config to latest and attempt connection */
-					ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, wifi_manager_get_wifi_sta_config()));
+					ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, config));
 
 					/* if there is a wifi scan in progress abort it first
 					   Calling esp_wifi_scan_stop will trigger a SCAN_DONE event which will reset this bit */
@@ -1064,14 +1644,29 @@ void wifi_manager( void * pvParameters ){
 				}
 
 				/* callback */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])(NULL);
+				wifi_manager_dispatch(&msg, NULL);
 
 				break;
 
 			case WM_EVENT_STA_DISCONNECTED:
-				;wifi_event_sta_disconnected_t* wifi_event_sta_disconnected = (wifi_event_sta_disconnected_t*)msg.param;
+				;wifi_event_sta_disconnected_t* wifi_event_sta_disconnected = &msg.sta_disconnected;
 				ESP_LOGI(TAG, "MESSAGE: EVENT_STA_DISCONNECTED with Reason code: %d", wifi_event_sta_disconnected->reason);
 
+				/* a direct connection to the last known AP failed: the AP may have moved to another channel or been replaced.
+				 * Retry right away with a full scan instead of counting this as a failed attempt. */
+				if(ap_hint_in_use){
+					ap_hint_in_use = false;
+					uxBits = xEventGroupGetBits(wifi_manager_event_group);
+					if( ! (uxBits & WIFI_MANAGER_REQUEST_DISCONNECT_BIT) ){
+						ESP_LOGW(TAG, "Direct connection failed, falling back to a full scan");
+						ap_hint_failed = true;
+						profile_scan_done = true;
+						wifi_manager_send_message(WM_ORDER_CONNECT_STA,
+								(uxBits & WIFI_MANAGER_REQUEST_RESTORE_STA_BIT) ? (void*)CONNECTION_REQUEST_RESTORE_CONNECTION : (void*)CONNECTION_REQUEST_AUTO_RECONNECT);
+						break;
+					}
+				}
+
 				/* this even can be posted in numerous different conditions
 				 *
 				 * 1. SSID password is wrong
@@ -1089,7 +1684,7 @@ void wifi_manager( void * pvParameters ){
 				 *
 				 *  If WIFI_MANAGER_REQUEST_STA_CONNECT_BIT and WIFI_MANAGER_REQUEST_STA_CONNECT_BIT are NOT set, it's a lost connection
 				 *
-				 *  In this version of the software, reason codes are not used. They are indicated here for potential future usage.
+				 *  When the connection is lost, the reason code picks the delay before the next attempt, see wifi_manager_retry_delay.
 				 *
 				 *  REASON CODE:
 				 *  1		UNSPECIFIED
@@ -1138,26 +1733,21 @@ void wifi_manager( void * pvParameters ){
 					 * in case they typed a wrong password for instance. Here we simply clear the request bit and move on */
 					xEventGroupClearBits(wifi_manager_event_group, WIFI_MANAGER_REQUEST_STA_CONNECT_BIT);
 
-					if(wifi_manager_lock_json_buffer( portMAX_DELAY )){
-						wifi_manager_generate_ip_info_json( UPDATE_FAILED_ATTEMPT );
-						wifi_manager_unlock_json_buffer();
-					}
-
+					wifi_manager_generate_ip_info_json( UPDATE_FAILED_ATTEMPT );
 				}
 				else if (uxBits & WIFI_MANAGER_REQUEST_DISCONNECT_BIT){
 					/* user manually requested a disconnect so the lost connection is a normal event. Clear the flag and restart the AP */
 					xEventGroupClearBits(wifi_manager_event_group, WIFI_MANAGER_REQUEST_DISCONNECT_BIT);
 
-					/* erase configuration */
+					/* erase configuration. All known networks go too: a user disconnect means staying in portal mode,
+					 * including after a reboot, and the portal has no way to remove the other networks */
+					wifi_manager_forget_profiles();
 					if(wifi_manager_config_sta){
 						memset(wifi_manager_config_sta, 0x00, sizeof(wifi_config_t));
 					}
 
 					/* regenerate json status */
-					if(wifi_manager_lock_json_buffer( portMAX_DELAY )){
-						wifi_manager_generate_ip_info_json( UPDATE_USER_DISCONNECT );
-						wifi_manager_unlock_json_buffer();
-					}
+					wifi_manager_generate_ip_info_json( UPDATE_USER_DISCONNECT );
 
 					/* save NVS memory */
 					wifi_manager_save_sta_config();
@@ -1167,13 +1757,25 @@ void wifi_manager( void * pvParameters ){
 				}
 				else{
 					/* lost connection ? */
-					if(wifi_manager_lock_json_buffer( portMAX_DELAY )){
-						wifi_manager_generate_ip_info_json( UPDATE_LOST_CONNECTION );
-						wifi_manager_unlock_json_buffer();
-					}
-
-					/* Start the timer that will try to restore the saved config */
-					xTimerStart( wifi_manager_retry_timer, (TickType_t)0 );
+					wifi_manager_generate_ip_info_json( UPDATE_LOST_CONNECTION );
+
+					uint8_t reason = wifi_event_sta_disconnected->reason;
+					bool auth_failure = wifi_manager_is_auth_failure(reason);
+
+					portENTER_CRITICAL(&reconnect_stats_mux);
+					reconnect_stats.consecutive_failures++;
+					reconnect_stats.last_reason = reason;
+					if(auth_failure) reconnect_stats.auth_failures++;
+					else if(reason == WIFI_REASON_NO_AP_FOUND) reconnect_stats.no_ap_found++;
+					else if(reason == WIFI_REASON_BEACON_TIMEOUT) reconnect_stats.beacon_timeouts++;
+					else reconnect_stats.other_failures++;
+					uint32_t delay = wifi_manager_retry_delay(reason, reconnect_stats.consecutive_failures);
+					reconnect_stats.last_delay_ms = delay;
+					portEXIT_CRITICAL(&reconnect_stats_mux);
+
+					/* Start the timer that will try to restore the saved config. Changing the period of a dormant timer starts it. */
+					ESP_LOGI(TAG, "Reconnecting in %u ms (failure %u, reason %d)", (unsigned int)delay, (unsigned int)reconnect_stats.consecutive_failures, reason);
+					xTimerChangePeriod( wifi_manager_retry_timer, pdMS_TO_TICKS(delay), (TickType_t)0 );
 
 					/* if it was a restore attempt connection, we clear the bit */
 					xEventGroupClearBits(wifi_manager_event_group, WIFI_MANAGER_REQUEST_RESTORE_STA_BIT);
@@ -1181,9 +1783,16 @@ void wifi_manager( void * pvParameters ){
 					/* if the AP is not started, we check if we have reached the threshold of failed attempt to start it */
 					if(! (uxBits & WIFI_MANAGER_AP_STARTED_BIT) ){
 
+						/* the AP refused the credentials: the password was probably changed, the user will have to enter it again.
+						 * Retries go on in the background at the slowest pace in case it was a fluke. */
+						if(auth_failure){
+							ESP_LOGW(TAG, "Authentication failed, starting the access point");
+							retries = 0;
+							wifi_manager_send_message(WM_ORDER_START_AP, NULL);
+						}
 						/* if the nunber of retries is below the threshold to start the AP, a reconnection attempt is made
 						 * This way we avoid restarting the AP directly in case the connection is mementarily lost */
-						if(retries < WIFI_MANAGER_MAX_RETRY_START_AP){
+						else if(retries < WIFI_MANAGER_MAX_RETRY_START_AP){
 							retries++;
 						}
 						else{
@@ -1197,8 +1806,7 @@ void wifi_manager( void * pvParameters ){
 				}
 
 				/* callback */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])( msg.param );
-				free(wifi_event_sta_disconnected);
+				wifi_manager_dispatch(&msg, wifi_event_sta_disconnected);
 
 				break;
 
@@ -1215,7 +1823,7 @@ void wifi_manager( void * pvParameters ){
 				dns_server_start();
 
 				/* callback */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])(NULL);
+				wifi_manager_dispatch(&msg, NULL);
 
 				break;
 
@@ -1241,14 +1849,14 @@ void wifi_manager( void * pvParameters ){
 					http_app_start(false);
 
 					/* callback */
-					if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])(NULL);
+					wifi_manager_dispatch(&msg, NULL);
 				}
 
 				break;
 
 			case WM_EVENT_STA_GOT_IP:
 				ESP_LOGI(TAG, "WM_EVENT_STA_GOT_IP");
-				ip_event_got_ip_t* ip_event_got_ip = (ip_event_got_ip_t*)msg.param; 
+				ip_event_got_ip_t* ip_event_got_ip = &msg.got_ip;
 				uxBits = xEventGroupGetBits(wifi_manager_event_group);
 
 				/* reset connection requests bits -- doesn't matter if it was set or not */
@@ -1256,6 +1864,21 @@ void wifi_manager( void * pvParameters ){
 
 				/* save IP as a string for the HTTP server host */
 				wifi_manager_safe_update_sta_ip_string(ip_event_got_ip->ip_info.ip.addr);
+				/* a DHCP renewal also posts GOT_IP: only the first one after a connection attempt is timed */
+				if(connect_started_at != 0){
+					ESP_LOGI(TAG, "Time to IP: %lld ms (%s)", (long long)((esp_timer_get_time() - connect_started_at) / 1000), ap_hint_in_use ? "direct" : "scan");
+					connect_started_at = 0;
+				}
+				ap_hint_in_use = false;
+				ap_hint_failed = false;
+				/* remember the network, and which AP and channel this association landed on for the next reconnect */
+				wifi_ap_record_t ap_info;
+				if(WIFI_MANAGER_FAST_RECONNECT && esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK){
+					wifi_manager_remember_profile(wifi_manager_config_sta, ap_info.bssid, ap_info.primary);
+				}
+				else{
+					wifi_manager_remember_profile(wifi_manager_config_sta, NULL, 0);
+				}
 
 				/* save wifi config in NVS if it wasn't a restored of a connection */
 				if(uxBits & WIFI_MANAGER_REQUEST_RESTORE_STA_BIT){
@@ -1267,14 +1890,13 @@ void wifi_manager( void * pvParameters ){
 
 				/* reset number of retries */
 				retries = 0;
+				portENTER_CRITICAL(&reconnect_stats_mux);
+				if(reconnect_stats.consecutive_failures > 0) reconnect_stats.reconnections++;
+				reconnect_stats.consecutive_failures = 0;
+				portEXIT_CRITICAL(&reconnect_stats_mux);
 
 				/* refresh JSON with the new IP */
-				if(wifi_manager_lock_json_buffer( portMAX_DELAY )){
-					/* generate the connection info with success */
-					wifi_manager_generate_ip_info_json( UPDATE_CONNECTION_OK );
-					wifi_manager_unlock_json_buffer();
-				}
-				else { abort(); }
+				wifi_manager_generate_ip_info_json( UPDATE_CONNECTION_OK );
 
 				/* bring down DNS hijack */
 				dns_server_stop();
@@ -1296,9 +1918,8 @@ void wifi_manager( void * pvParameters ){
 
 				}
 
-				/* callback and free memory allocated for the void* param */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])( msg.param );
-				free(ip_event_got_ip);
+				/* callback, the event is only valid until it returns */
+				wifi_manager_dispatch(&msg, ip_event_got_ip);
 
 				break;
 
@@ -1312,7 +1933,7 @@ void wifi_manager( void * pvParameters ){
 				ESP_ERROR_CHECK(esp_wifi_disconnect());
 
 				/* callback */
-				if(cb_ptr_arr[msg.code]) (*cb_ptr_arr[msg.code])(NULL);
+				wifi_manager_dispatch(&msg, NULL);
 
 				break;
 
@@ -0,0 +1,77 @@
+/**
+@file wifi_manager_scan.c
+@brief Post-processing of the AP scan list
+Depends on nothing but the wifi_ap_record_t type so that it can also be built and benchmarked on the host, see host/filter_unique_bench.c
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "esp_wifi_types.h"
+#include "esp_log.h"
+#include "wifi_manager_scan.h"
+
+
+static const char TAG[] = "wifi_manager";
+
+/**
+ * @brief FNV-1a hash of the SSID and auth mode of an AP, the key under which scan results are merged.
+ */
+static uint32_t wifi_manager_ap_hash(const wifi_ap_record_t *ap){
+	uint32_t hash = 2166136261u;
+	for(size_t i=0; i<sizeof(ap->ssid) && ap->ssid[i]; i++){
+		hash = (hash ^ ap->ssid[i]) * 16777619u;
+	}
+	return (hash ^ (uint32_t)ap->authmode) * 16777619u;
+}
+
+static int wifi_manager_ap_rssi_cmp(const void *a, const void *b){
+	return ((const wifi_ap_record_t*)b)->rssi - ((const wifi_ap_record_t*)a)->rssi;
+}
+
+void wifi_manager_filter_unique( wifi_ap_record_t * aplist, uint16_t * aps) {
+
+	const uint16_t empty = 0xffff;
+	uint16_t total_unique = 0;
+
+	/* open addressing table of indexes into aplist, kept at most half full so probes stay short */
+	size_t slots = 16;
+	while(slots < (size_t)*aps * 2) slots <<= 1;
+	uint16_t *table = (uint16_t*)malloc(slots * sizeof(uint16_t));
+	if(table == NULL){
+		ESP_LOGE(TAG, "wifi_manager_filter_unique: out of memory, scan list left unfiltered");
+		return;
+	}
+	memset(table, 0xff, slots * sizeof(uint16_t));
+
+	for(int i=0; i<*aps; i++){
+		wifi_ap_record_t * ap = &aplist[i];
+
+		/* hidden networks cannot be picked from the list */
+		if (ap->ssid[0] == 0) continue;
+
+		size_t slot = wifi_manager_ap_hash(ap) & (slots - 1);
+		while(table[slot] != empty){
+			wifi_ap_record_t * kept = &aplist[table[slot]];
+			if(kept->authmode == ap->authmode && strncmp((const char *)kept->ssid, (const char *)ap->ssid, sizeof(ap->ssid)) == 0) break;
+			slot = (slot + 1) & (slots - 1);
+		}
+
+		if(table[slot] == empty){
+			/* first time this SSID+authmode is seen: move it down to the end of the unique records.
+			 * total_unique <= i, so this never overwrites a record that is still to be visited */
+			if(total_unique != i) memcpy(&aplist[total_unique], ap, sizeof(wifi_ap_record_t));
+			table[slot] = total_unique++;
+		}
+		else if(ap->rssi > aplist[table[slot]].rssi){
+			/* keep the strongest AP of the network so that rssi and channel match */
+			memcpy(&aplist[table[slot]], ap, sizeof(wifi_ap_record_t));
+		}
+	}
+	free(table);
+
+	qsort(aplist, total_unique, sizeof(wifi_ap_record_t), wifi_manager_ap_rssi_cmp);
+
+	/* update the length of the list */
+	*aps = total_unique;
+}
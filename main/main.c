@@ -6,36 +6,115 @@
 #include "freertos/task.h"
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "spotify_client.h"
+#include "spotify_events.h"
 #include "wifi_manager.h"
 
-static bool internet_connection =  false;
-// static const char TAG[] = "main";
+#define DISPLAY_EVENT_BIT BIT0
 
+static const char TAG[] = "main";
+
+
+void display_now_playing(const now_playing_t *now_playing, const char *source)
+{
+	static bool first_display = true;
+	if (first_display) {
+		ESP_LOGI(TAG, "First display %lld ms after boot (%s)", esp_timer_get_time() / 1000, source);
+		first_display = false;
+	}
+	ESP_LOGI(TAG, "%s: %s - %s", now_playing->is_playing ? "Playing" : "Paused",
+			now_playing->track_name, now_playing->num_artists > 0 ? now_playing->artists[0] : "");
+}
+
+/**
+ * Sleeps until the spotify client reports a change, or until the current track should end: the
+ * extrapolated state then switches to the prefetched next track before a poll confirms it.
+ */
+void display_task(void *pvParameter)
+{
+	now_playing_t now_playing;
+	spotify_event_t event;
+	char shown_track_id[MAX_SONG_ID_LENGTH + 1] = "";
+	int subscriber = spotify_events_subscribe(SPOTIFY_EVENT_ALL, xTaskGetCurrentTaskHandle(), DISPLAY_EVENT_BIT);
+
+	/* warm boot: show the last known state before the network is up */
+	if (spotify_get_now_playing(&now_playing)) {
+		display_now_playing(&now_playing, "cached");
+		snprintf(shown_track_id, sizeof(shown_track_id), "%s", now_playing.track_id);
+	}
+	for(;;){
+		TickType_t wait = portMAX_DELAY;
+		if (spotify_get_now_playing(&now_playing) && now_playing.is_playing) {
+			uint32_t remaining = now_playing.duration_ms > now_playing.progress_ms ?
+					now_playing.duration_ms - now_playing.progress_ms : 0;
+			wait = pdMS_TO_TICKS(remaining > 0 ? remaining + 50 : 1000);
+		}
+		xTaskNotifyWait(0, DISPLAY_EVENT_BIT, NULL, wait);
+
+		bool redraw = false;
+		while (spotify_events_receive(subscriber, &event)) {
+			switch (event.type) {
+				case SPOTIFY_EVENT_TRACK_CHANGED:
+				case SPOTIFY_EVENT_PLAY_STATE:
+					redraw = true;
+					break;
+				case SPOTIFY_EVENT_SEEK:
+					ESP_LOGI(TAG, "Seek to %u ms", event.seek.progress_ms);
+					break;
+				case SPOTIFY_EVENT_VOLUME:
+					ESP_LOGI(TAG, "Volume %d%%", event.volume.volume_percent);
+					break;
+				case SPOTIFY_EVENT_DEVICE:
+					ESP_LOGI(TAG, "Playing on device %s", event.device.device_id);
+					break;
+				default:
+					break;
+			}
+		}
+		if (spotify_get_now_playing(&now_playing) && (redraw || strcmp(now_playing.track_id, shown_track_id) != 0)) {
+			display_now_playing(&now_playing, "live");
+			snprintf(shown_track_id, sizeof(shown_track_id), "%s", now_playing.track_id);
+		}
+	}
+}
 
 void monitoring_task(void *pvParameter)
 {	
-	player_details_t player_details;
-	currently_playing_t currently_playing;
+	player_details_t player_details = { 0 };
+	currently_playing_t currently_playing = { 0 };
+
+	spotify_wait_for_network(portMAX_DELAY);
+	// Debug builds only; a no-op otherwise.
+	spotify_latency_benchmark();
+
 	spotify_get_player_details(&player_details);
-	vTaskDelay(pdMS_TO_TICKS(1000));
 	spotify_get_current_playing(&currently_playing);
+	vTaskDelay(pdMS_TO_TICKS(1000));
 	if (currently_playing.is_playing)
 		spotify_pause();
 	vTaskDelay(pdMS_TO_TICKS(1000));
 	spotify_play("spotify:album:5ht7ItJgpBH7W6vJ5BqpPr", 5, 0, player_details.device.id);
 	vTaskDelay(pdMS_TO_TICKS(1000));
 	spotify_change_volume(25, player_details.device.id);
-	for(;;){
+	for(int tick = 1;; tick++){
 		// ESP_LOGI(TAG, "free heap: %d",esp_get_free_heap_size());
+		/* the display task wakes on the changes these polls detect */
+		spotify_get_current_playing(&currently_playing);
+		if (tick % 6 == 0)
+			spotify_get_player_details(&player_details);
 		vTaskDelay(pdMS_TO_TICKS(10000));
 	}
 }
 
-void cb_connection_ok(void *pvParameter)
+void cb_spotify_circuit(void *pvParameter)
 {
-	internet_connection = true;	
+	spotify_breaker_event_t *event = (spotify_breaker_event_t*)pvParameter;
+	if (event->state == SPOTIFY_BREAKER_OPEN)
+		ESP_LOGW(TAG, "Offline: %s unreachable, next probe in %u ms", event->host, event->open_ms);
+	else if (event->state == SPOTIFY_BREAKER_CLOSED)
+		ESP_LOGI(TAG, "Online: %s reachable again", event->host);
 }
 
 void init_system()
@@ -43,18 +122,18 @@ void init_system()
 	/* start the wifi manager */
 	wifi_manager_start();
 
-	/* register a callback as an example to how you can integrate your code with the wifi manager */
-	wifi_manager_set_callback(WM_EVENT_STA_GOT_IP, &cb_connection_ok);
-	while(!internet_connection){
-		vTaskDelay(pdMS_TO_TICKS(1000));
-	}
+	/* restores the stored token and last playback state: no network needed.
+	 * The spotify client registers its own WM_EVENT_STA_GOT_IP callback to pre-connect
+	 * and start SNTP as soon as an IP is assigned, or right away if the station connected
+	 * while it was initialising. */
+	spotify_breaker_set_callback(&cb_spotify_circuit);
 	spotify_init();
-	vTaskDelay(pdMS_TO_TICKS(1000));
 }
 
 void app_main()
 {
 	init_system();
 
+	xTaskCreate(&display_task, "display", 4096, NULL, 2, NULL);
 	xTaskCreate(&monitoring_task, "monitor", (2048*8), NULL, 1, NULL);
 }